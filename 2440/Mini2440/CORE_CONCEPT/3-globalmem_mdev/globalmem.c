@@ -6,20 +6,33 @@
 #include <linux/fs.h>
 #include <linux/device.h>   /* class_create */
 #include <linux/slab.h>     /* kmalloc/kfree */
+#include <linux/mm.h>       /* struct vm_area_struct */
+#include <linux/vmalloc.h>  /* vmalloc_user/remap_vmalloc_range */
+#include <linux/moduleparam.h>  /* module_param */
+#include <asm/cacheflush.h> /* flush_cache_all */
 #include <asm/uaccess.h>
 
 
-#define GLOBALMEM_SIZE  0x1000  /* global memory size 4KB */
+#define GLOBALMEM_SIZE  0x1000  /* default global memory size 4KB */
+#define GLOBALMEM_MAX_SIZE 0x1000000   /* largest globalmem_size, 16MB of vmalloc space */
 #define GLOBALMEM_MAJOR 250     /* The major number */
 #define MEM_CLEAR       0x1     /* The code to clear the memory region to zero */
+#define MEM_FLUSH       0x2     /* The code to make mmap and read/write views coherent */
+#define MEM_FENCE       0x3     /* The code to order earlier accesses before later ones */
+#define MEM_GET_SIZE    0x4     /* The code to read the region size, arg is an (unsigned int *) */
 
 
 static int globalmem_major = GLOBALMEM_MAJOR;
 
+/* Size of the region, rounded up to whole pages so that it can be mmapped */
+static unsigned int globalmem_size = GLOBALMEM_SIZE;
+module_param(globalmem_size, uint, S_IRUGO);
+
 /* Our own globalmem_dev structure */
 struct globalmem_dev {
     struct cdev cdev;
-    unsigned char mem[GLOBALMEM_SIZE];
+    unsigned int size;  /* region size, a multiple of PAGE_SIZE */
+    unsigned char *mem; /* vmalloc_user memory, page aligned */
 };
 
 /* Object of globalmem_dev structure */
@@ -41,6 +54,7 @@ static int globalmem_release(struct inode *inode, struct file *filp)
 
 static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig)
 {
+    struct globalmem_dev *dev = filp->private_data;
     loff_t ret;
 
     switch (orig) {
@@ -51,7 +65,7 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig)
             break;
         }
     
-        if (offset > GLOBALMEM_SIZE) {
+        if (offset > dev->size) {
             ret = -EINVAL;
             break;
         }
@@ -67,7 +81,7 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig)
             break;
         }
 
-        if ((filp->f_pos + offset) > GLOBALMEM_SIZE) {
+        if ((filp->f_pos + offset) > dev->size) {
             ret = -EINVAL;
             break;
         }
@@ -91,12 +105,12 @@ static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t count,
     struct globalmem_dev *dev = filp->private_data;
     
     /* The position which will be read is out of bound */
-    if (p >= GLOBALMEM_SIZE)
+    if (p >= dev->size)
         return 0;
     
     /* The byte which will be read is too big */
-    if (count > GLOBALMEM_SIZE - p)
-        count = GLOBALMEM_SIZE - p;
+    if (count > dev->size - p)
+        count = dev->size - p;
     
     /* Copy mem array from KERNEL space to USER space */
     if (copy_to_user(buf, (void *)(dev->mem + p), count))
@@ -118,11 +132,11 @@ static ssize_t globalmem_write(struct file *filp, const char __user *buf,
     unsigned long p = *ppos;
     struct globalmem_dev *dev = filp->private_data;
     
-    if (p >= GLOBALMEM_SIZE)
+    if (p >= dev->size)
         return 0;
     
-    if (count > GLOBALMEM_SIZE - p)
-        count = GLOBALMEM_SIZE - p;
+    if (count > dev->size - p)
+        count = dev->size - p;
     
     if (copy_from_user(dev->mem + p, buf, count))
         ret = -EFAULT;
@@ -143,10 +157,29 @@ static long globalmem_ioctl(struct file *filp, unsigned int cmd, unsigned long a
     switch (cmd) {
     /* Clear the memory region to zero */
     case MEM_CLEAR:
-        memset(dev->mem, 0, GLOBALMEM_SIZE);
+        memset(dev->mem, 0, dev->size);
         printk(KERN_INFO "[KERNEL(globalmem_ioctl)]globalmem is set to zero\n");
         break;
 
+    /*
+     * The region is seen through the kernel mapping by read/write and
+     * through the user mapping by mmap. On a VIVT cache (ARM920T) these
+     * alias, so write back and invalidate the data cache before switching
+     * from one view to the other.
+     */
+    case MEM_FLUSH:
+        flush_cache_all();
+        mb();
+        break;
+
+    /* Order every access issued before the ioctl against those after it */
+    case MEM_FENCE:
+        mb();
+        break;
+
+    case MEM_GET_SIZE:
+        return put_user(dev->size, (unsigned int __user *)arg);
+
     default:
         return -EINVAL;
     }
@@ -155,12 +188,25 @@ static long globalmem_ioctl(struct file *filp, unsigned int cmd, unsigned long a
 }
 
 
+static int globalmem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct globalmem_dev *dev = filp->private_data;
+
+    /* Mapping the same pages into user space, nothing is copied */
+    vma->vm_flags |= VM_RESERVED;
+
+    /* Fails with -EINVAL when the mapping runs past the end of the region */
+    return remap_vmalloc_range(vma, dev->mem, vma->vm_pgoff);
+}
+
+
 static const struct file_operations globalmem_fops = {
     .owner              = THIS_MODULE,
     .llseek             = globalmem_llseek,
     .read               = globalmem_read,
     .write              = globalmem_write,
     .unlocked_ioctl     = globalmem_ioctl,
+    .mmap               = globalmem_mmap,
     .open               = globalmem_open,
     .release            = globalmem_release,
 };
@@ -186,6 +232,13 @@ static int __init globalmem_init(void)
 {
     int result;
     dev_t devno = MKDEV(globalmem_major, 0);
+
+    /* Checked before PAGE_ALIGN(): it leaves 0 at 0 and wraps near UINT_MAX */
+    if (globalmem_size == 0 || globalmem_size > GLOBALMEM_MAX_SIZE) {
+        printk(KERN_NOTICE "[KERNEL(globalmem_init)]globalmem_size must be 1..%u\n", 
+            GLOBALMEM_MAX_SIZE);
+        return -EINVAL;
+    }
     
     /* Register char devices region */
     if (globalmem_major) {
@@ -207,19 +260,34 @@ static int __init globalmem_init(void)
     }
     
     memset(globalmem_devp, 0, sizeof(struct globalmem_dev));
+
+    /* Page aligned and zeroed, suitable for remap_vmalloc_range() */
+    globalmem_devp->size = PAGE_ALIGN(globalmem_size);
+    globalmem_devp->mem = vmalloc_user(globalmem_devp->size);
+    if (!globalmem_devp->mem) {
+        result = -ENOMEM;
+        goto fail_vmalloc;
+    }
     
     /* Helper function to initialize and add cdev structure */
     globalmem_setup_cdev(globalmem_devp, 0);
 
     /* mdev - automatically create the device node */
     globalmem_cls = class_create(THIS_MODULE, "globalmem");
-    if (IS_ERR(globalmem_cls))
-        return PTR_ERR(globalmem_cls);
+    if (IS_ERR(globalmem_cls)) {
+        result = PTR_ERR(globalmem_cls);
+        goto fail_class;
+    }
 
     device_create(globalmem_cls, NULL, devno, NULL, "globalmem");
         
     return 0;
 
+fail_class:
+    cdev_del(&globalmem_devp->cdev);
+    vfree(globalmem_devp->mem);
+fail_vmalloc:
+    kfree(globalmem_devp);
 fail_malloc:
     unregister_chrdev_region(devno, 1);
     return result;
@@ -230,6 +298,7 @@ static void __exit globalmem_exit(void)
     device_destroy(globalmem_cls, MKDEV(globalmem_major, 0));
     class_destroy(globalmem_cls);
     cdev_del(&globalmem_devp->cdev);
+    vfree(globalmem_devp->mem);
     kfree(globalmem_devp);
     unregister_chrdev_region(MKDEV(globalmem_major, 0), 1);
 }
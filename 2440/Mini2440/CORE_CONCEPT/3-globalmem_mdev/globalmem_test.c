@@ -4,15 +4,99 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>       /* mmap/munmap */
+#include <sys/time.h>       /* gettimeofday */
 #include <fcntl.h>
 #include <unistd.h>
 
 
 #define MEM_CLEAR       0x1     /* The code to clear the memory region to zero */
+#define MEM_FLUSH       0x2     /* The code to make mmap and read/write views coherent */
+#define MEM_FENCE       0x3     /* The code to order earlier accesses before later ones */
+#define MEM_GET_SIZE    0x4     /* The code to read the region size, arg is an (unsigned int *) */
+
+#define LAT_LOOPS       10000   /* accesses per measurement */
+#define LAT_LEN         64      /* bytes per access */
 
 char revtext[100];
 char sendtext[] = "Love ARM Linux!";
 
+static double now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/* Average latency of one LAT_LEN access over read/write and over mmap */
+static int latency_test(int fd)
+{
+    char buf[LAT_LEN];
+    unsigned int size;
+    unsigned char *map;
+    double start;
+    int i;
+
+    if (ioctl(fd, MEM_GET_SIZE, &size) < 0) {
+        printf("[USER]Error: failed to get the region size using ioctl!\n");
+        return -1;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("[USER]Error: can't mmap /dev/globalmem\n");
+        return -1;
+    }
+
+    memset(buf, 0x5a, sizeof(buf));
+    printf("\n[USER]Latency of %d byte accesses, %u byte region:\n", LAT_LEN, size);
+
+    start = now_usec();
+    for (i = 0; i < LAT_LOOPS; i++)
+        pwrite(fd, buf, LAT_LEN, (i * LAT_LEN) % size);
+    printf("[USER]write()        : %8.3f us\n", (now_usec() - start) / LAT_LOOPS);
+
+    start = now_usec();
+    for (i = 0; i < LAT_LOOPS; i++)
+        pread(fd, buf, LAT_LEN, (i * LAT_LEN) % size);
+    printf("[USER]read()         : %8.3f us\n", (now_usec() - start) / LAT_LOOPS);
+
+    start = now_usec();
+    for (i = 0; i < LAT_LOOPS; i++)
+        memcpy(map + (i * LAT_LEN) % size, buf, LAT_LEN);
+    printf("[USER]mmap store     : %8.3f us\n", (now_usec() - start) / LAT_LOOPS);
+
+    start = now_usec();
+    for (i = 0; i < LAT_LOOPS; i++)
+        memcpy(buf, map + (i * LAT_LEN) % size, LAT_LEN);
+    printf("[USER]mmap load      : %8.3f us\n", (now_usec() - start) / LAT_LOOPS);
+
+    start = now_usec();
+    for (i = 0; i < LAT_LOOPS; i++) {
+        memcpy(map + (i * LAT_LEN) % size, buf, LAT_LEN);
+        ioctl(fd, MEM_FENCE);
+    }
+    printf("[USER]mmap + fence   : %8.3f us\n", (now_usec() - start) / LAT_LOOPS);
+
+    start = now_usec();
+    for (i = 0; i < LAT_LOOPS; i++) {
+        memcpy(map + (i * LAT_LEN) % size, buf, LAT_LEN);
+        ioctl(fd, MEM_FLUSH);
+    }
+    printf("[USER]mmap + flush   : %8.3f us\n", (now_usec() - start) / LAT_LOOPS);
+
+    /* What was stored through the mapping must be visible to read() */
+    memcpy(map, sendtext, sizeof(sendtext));
+    ioctl(fd, MEM_FLUSH);
+    memset(revtext, 0, sizeof(revtext));
+    pread(fd, revtext, sizeof(sendtext), 0);
+    printf("\n[USER]mmap store, read() back = %s\n", revtext);
+
+    munmap(map, size);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int fd;
@@ -41,6 +125,9 @@ int main(int argc, char **argv)
 
     printf("\n[USER]After ioctl clear revtext = %s\n", revtext);
 
+    if (latency_test(fd) < 0)
+        return -1;
+
     return 0;
 }
 
@@ -11,29 +11,61 @@
 #include <linux/device.h>       /* class_create/class_destroy */
 #include <linux/semaphore.h>    /* struct semaphore */
 #include <linux/slab.h>         /* kmalloc/kfree */
+#include <linux/vmalloc.h>      /* vmalloc/vfree */
+#include <linux/gfp.h>          /* __get_free_pages/free_pages */
+#include <linux/mm.h>           /* is_vmalloc_addr */
+#include <linux/log2.h>         /* roundup_pow_of_two */
+#include <linux/moduleparam.h>  /* module_param */
+#include <asm/system.h>         /* smp_rmb/smp_wmb/smp_mb */
 #include <asm/uaccess.h>        /* copy_from_user/copy_to_user */
 
 
-#define GLOBALFIFO_SIZE  0x1000  /* global fifo size 4KB */
+#define GLOBALFIFO_SIZE  0x1000  /* default and minimum fifo size 4KB */
+#define GLOBALFIFO_MAX_SIZE 0x800000    /* maximum fifo size 8MB */
+#define GLOBALFIFO_DEVS  1       /* default number of fifo devices */
 #define GLOBALFIFO_MAJOR 250     /* The major number */
 #define FIFO_CLEAR       0x1     /* The code to clear the FIFO region to zero */
+#define FIFO_SET_MODE    0x2     /* The code to switch between the FIFO engines */
+#define FIFO_SET_SIZE    0x3     /* The code to resize the FIFO, arg is the size */
+#define FIFO_GET_SIZE    0x4     /* The code to read the FIFO size, arg is an (unsigned int *) */
+
+#define FIFO_MODE_LEGACY 0       /* memmove-on-read, serialized by dev->sem */
+#define FIFO_MODE_RING   1       /* head/tail ring, SPSC data path */
 
 
 static int globalfifo_major = GLOBALFIFO_MAJOR;
 
+/* FIFO engine used after insmod, FIFO_SET_MODE can change it later */
+static int ring_mode = FIFO_MODE_RING;
+module_param(ring_mode, int, S_IRUGO);
+
+/* Number of fifo devices, minor 0 is /dev/globalfifo, minor N is /dev/globalfifoN */
+static int globalfifo_nr_devs = GLOBALFIFO_DEVS;
+module_param(globalfifo_nr_devs, int, S_IRUGO);
+
+/* Initial buffer size of every device, FIFO_SET_SIZE can change it later */
+static unsigned int fifo_size = GLOBALFIFO_SIZE;
+module_param(fifo_size, uint, S_IRUGO);
+
 /* Our own globalfifo_dev structure */
 struct globalfifo_dev {
     struct cdev cdev;   /* cdev structure */
     unsigned int current_len;   /* valid fifo data length */
-    unsigned char mem[GLOBALFIFO_SIZE]; /* global memory */
+    unsigned int size;  /* buffer size, a power of two */
+    unsigned char *mem; /* page backed fifo buffer */
     struct semaphore sem;   /* semaphore structure */
+    int mode;   /* FIFO_MODE_LEGACY or FIFO_MODE_RING */
+    unsigned int head;  /* ring: free running read index, owned by reader */
+    unsigned int tail;  /* ring: free running write index, owned by writer */
+    struct semaphore r_sem; /* ring: serializes readers among themselves */
+    struct semaphore w_sem; /* ring: serializes writers among themselves */
     wait_queue_head_t r_wait;   /* wait queue head for read buffer */
     wait_queue_head_t w_wait;   /* wait queue head for write buffer */
     struct fasync_struct *async_queue;  /* async structure */
 };
 
-/* Object of globalmem_dev structure */
-static struct globalfifo_dev *globalfifo_devp;
+/* One separately allocated object per minor, nothing is shared between them */
+static struct globalfifo_dev **globalfifo_devp;
 
 /* Globalfifo class  */
 static struct class *globalfifo_cls;
@@ -47,7 +79,7 @@ static int globalfifo_fasync(int fd, struct file *filp, int mode)
 
 static int globalfifo_open(struct inode *inode, struct file *filp)
 {
-    filp->private_data = globalfifo_devp;
+    filp->private_data = container_of(inode->i_cdev, struct globalfifo_dev, cdev);
     return 0;
 }
 
@@ -59,6 +91,7 @@ static int globalfifo_release(struct inode *inode, struct file *filp)
 
 static loff_t globalfifo_llseek(struct file *filp, loff_t offset, int orig)
 {
+    struct globalfifo_dev *dev = filp->private_data;
     loff_t ret;
 
     switch (orig) {
@@ -69,7 +102,7 @@ static loff_t globalfifo_llseek(struct file *filp, loff_t offset, int orig)
             break;
         }
     
-        if (offset > GLOBALFIFO_SIZE) {
+        if (offset > dev->size) {
             ret = -EINVAL;
             break;
         }
@@ -85,7 +118,7 @@ static loff_t globalfifo_llseek(struct file *filp, loff_t offset, int orig)
             break;
         }
 
-        if ((filp->f_pos + offset) > GLOBALFIFO_SIZE) {
+        if ((filp->f_pos + offset) > dev->size) {
             ret = -EINVAL;
             break;
         }
@@ -101,6 +134,144 @@ static loff_t globalfifo_llseek(struct file *filp, loff_t offset, int orig)
     return ret;
 }
 
+/*
+ * Ring engine
+ *
+ * head and tail are free running, the slot of an index is (index & (size - 1)).
+ * Only the reader moves head and only the writer moves tail, so one reader
+ * and one writer never share a lock: the writer publishes data with
+ * smp_wmb() before advancing tail, the reader consumes it with smp_rmb()
+ * after sampling tail, and vice versa for freeing space. r_sem/w_sem are
+ * only contended when several readers (or several writers) share the device.
+ */
+static inline unsigned int ring_len(struct globalfifo_dev *dev)
+{
+    return ACCESS_ONCE(dev->tail) - ACCESS_ONCE(dev->head);
+}
+
+static inline unsigned int ring_room(struct globalfifo_dev *dev)
+{
+    return dev->size - ring_len(dev);
+}
+
+static ssize_t globalfifo_ring_read(struct file *filp, char __user *buf, 
+    size_t count)
+{
+    struct globalfifo_dev *dev = filp->private_data;
+    unsigned int head, len, off, first;
+    int ret;
+
+    /* Waiting the FIFO is not empty, r_sem is not held while sleeping */
+    for (;;) {
+        if (down_interruptible(&dev->r_sem))
+            return -ERESTARTSYS;
+
+        len = ring_len(dev);
+        if (len != 0)
+            break;
+
+        up(&dev->r_sem);
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev->r_wait, ring_len(dev) != 0))
+            return -ERESTARTSYS;
+    }
+
+    /* Read the data only after we have seen tail move past it */
+    smp_rmb();
+
+    if (count > len)
+        count = len;
+
+    head = dev->head;
+    off = head & (dev->size - 1);
+    first = min_t(unsigned int, count, dev->size - off);
+
+    /* Copy memory fifo from KERNEL space to USER space, at most two chunks */
+    if (copy_to_user(buf, dev->mem + off, first) ||
+        copy_to_user(buf + first, dev->mem, count - first)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Finish reading the slots before handing them back to the writer */
+    smp_mb();
+    dev->head = head + count;
+
+    /* Wakeup the write wait queue, only if somebody sleeps on it */
+    smp_mb();
+    if (waitqueue_active(&dev->w_wait))
+        wake_up_interruptible(&dev->w_wait);
+
+    ret = count;
+
+out:
+    up(&dev->r_sem);
+    return ret;
+}
+
+static ssize_t globalfifo_ring_write(struct file *filp, const char __user *buf, 
+    size_t count)
+{
+    struct globalfifo_dev *dev = filp->private_data;
+    unsigned int tail, room, off, first;
+    int ret;
+
+    /* Waiting FIFO is not full, w_sem is not held while sleeping */
+    for (;;) {
+        if (down_interruptible(&dev->w_sem))
+            return -ERESTARTSYS;
+
+        room = ring_room(dev);
+        if (room != 0)
+            break;
+
+        up(&dev->w_sem);
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev->w_wait, ring_room(dev) != 0))
+            return -ERESTARTSYS;
+    }
+
+    /* Do not overwrite slots before the reader is done with them */
+    smp_mb();
+
+    if (count > room)
+        count = room;
+
+    tail = dev->tail;
+    off = tail & (dev->size - 1);
+    first = min_t(unsigned int, count, dev->size - off);
+
+    if (copy_from_user(dev->mem + off, buf, first) ||
+        copy_from_user(dev->mem, buf + first, count - first)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Publish the data before the new tail */
+    smp_wmb();
+    dev->tail = tail + count;
+
+    /* Wakeup read wait queue, only if somebody sleeps on it */
+    smp_mb();
+    if (waitqueue_active(&dev->r_wait))
+        wake_up_interruptible(&dev->r_wait);
+
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+
+    ret = count;
+
+out:
+    up(&dev->w_sem);
+    return ret;
+}
+
 static ssize_t globalfifo_read(struct file *filp, char __user *buf, size_t count, 
        loff_t *ppos)
 {
@@ -109,6 +280,9 @@ static ssize_t globalfifo_read(struct file *filp, char __user *buf, size_t count
 
     /* Declare the wait queue */
     DECLARE_WAITQUEUE(wait, current);
+
+    if (dev->mode == FIFO_MODE_RING)
+        return globalfifo_ring_read(filp, buf, count);
       
     /* Acquire the semaphore */
     down(&dev->sem);
@@ -176,6 +350,9 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf,
     /* Declare the wait queue */
     DECLARE_WAITQUEUE(wait, current);
 
+    if (dev->mode == FIFO_MODE_RING)
+        return globalfifo_ring_write(filp, buf, count);
+
     /* Acquire the semaphore */
     down(&dev->sem);
 
@@ -183,7 +360,7 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf,
     add_wait_queue(&dev->w_wait, &wait);
 
     /* Waiting FIFO is not full */
-    while (dev->current_len == GLOBALFIFO_SIZE) {
+    while (dev->current_len == dev->size) {
         if (filp->f_flags & O_NONBLOCK) {
             ret = -EAGAIN;
             goto out;
@@ -207,8 +384,8 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf,
         down(&dev->sem);
     }
 
-    if (count > GLOBALFIFO_SIZE - dev->current_len)
-        count = GLOBALFIFO_SIZE - dev->current_len;
+    if (count > dev->size - dev->current_len)
+        count = dev->size - dev->current_len;
     
     if (copy_from_user(dev->mem + dev->current_len, buf, count)) {
         ret = -EFAULT;
@@ -237,18 +414,147 @@ out2:
     return ret;
 }
 
+/* Take every lock of both engines, so that the device is quiescent */
+static int globalfifo_lock_all(struct globalfifo_dev *dev)
+{
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+
+    if (down_interruptible(&dev->r_sem))
+        goto fail_r;
+
+    if (down_interruptible(&dev->w_sem))
+        goto fail_w;
+
+    return 0;
+
+fail_w:
+    up(&dev->r_sem);
+fail_r:
+    up(&dev->sem);
+    return -ERESTARTSYS;
+}
+
+static void globalfifo_unlock_all(struct globalfifo_dev *dev)
+{
+    up(&dev->w_sem);
+    up(&dev->r_sem);
+    up(&dev->sem);
+}
+
+/* Nothing buffered and nobody waiting, called with every lock held */
+static int globalfifo_idle(struct globalfifo_dev *dev)
+{
+    return dev->current_len == 0 && ring_len(dev) == 0 &&
+        !waitqueue_active(&dev->r_wait) && !waitqueue_active(&dev->w_wait);
+}
+
+/* Round a requested size up to a power of two, 0 if it is out of range */
+static unsigned int globalfifo_check_size(unsigned long size)
+{
+    if (size < GLOBALFIFO_SIZE || size > GLOBALFIFO_MAX_SIZE)
+        return 0;
+
+    return roundup_pow_of_two(size);
+}
+
+/*
+ * Physically contiguous pages first, vmalloc when the buddy allocator can
+ * not satisfy a multi MB request. Either way the buffer is page backed.
+ */
+static unsigned char *globalfifo_alloc_mem(unsigned int size)
+{
+    unsigned char *mem;
+
+    mem = (unsigned char *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_ZERO, 
+        get_order(size));
+    if (mem)
+        return mem;
+
+    mem = vmalloc(size);
+    if (mem)
+        memset(mem, 0, size);
+
+    return mem;
+}
+
+static void globalfifo_free_mem(unsigned char *mem, unsigned int size)
+{
+    if (is_vmalloc_addr(mem))
+        vfree(mem);
+    else
+        free_pages((unsigned long)mem, get_order(size));
+}
+
+static int globalfifo_resize(struct globalfifo_dev *dev, unsigned long arg)
+{
+    unsigned int size = globalfifo_check_size(arg);
+    unsigned int old_size;
+    unsigned char *mem, *old_mem;
+
+    if (!size)
+        return -EINVAL;
+
+    /* Allocate before taking the locks, the FIFO keeps running meanwhile */
+    mem = globalfifo_alloc_mem(size);
+    if (!mem)
+        return -ENOMEM;
+
+    if (globalfifo_lock_all(dev)) {
+        globalfifo_free_mem(mem, size);
+        return -ERESTARTSYS;
+    }
+
+    if (!globalfifo_idle(dev)) {
+        globalfifo_unlock_all(dev);
+        globalfifo_free_mem(mem, size);
+        return -EBUSY;
+    }
+
+    old_mem = dev->mem;
+    old_size = dev->size;
+
+    dev->mem = mem;
+    dev->size = size;
+    dev->current_len = 0;
+    dev->head = dev->tail = 0;
+
+    globalfifo_unlock_all(dev);
+
+    globalfifo_free_mem(old_mem, old_size);
+
+    printk(KERN_INFO "[KERNEL(globalfifo_ioctl)]globalfifo size:%u\n", size);
+    return 0;
+}
+
 static long globalfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct globalfifo_dev *dev = filp->private_data;
+    int ret = 0;
     
     switch (cmd) {
     /* Clear the memory region to zero */
     case FIFO_CLEAR:
+        if (dev->mode == FIFO_MODE_RING) {
+            if (globalfifo_lock_all(dev))
+                return -ERESTARTSYS;
+
+            /* The ring is emptied as well, the stale bytes are gone */
+            memset(dev->mem, 0, dev->size);
+            dev->head = dev->tail = 0;
+
+            globalfifo_unlock_all(dev);
+            wake_up_interruptible(&dev->w_wait);
+
+            printk(KERN_INFO "[KERNEL(globalfifo_ioctl)]globalfifo is set to zero\n");
+            break;
+        }
+
         /* Acquire the semaphore */
         if (down_interruptible(&dev->sem))
             return -ERESTARTSYS;
         
-        memset(dev->mem, 0, GLOBALFIFO_SIZE);
+        memset(dev->mem, 0, dev->size);
 
         /* Free the semaphore */
         up(&dev->sem);
@@ -256,6 +562,34 @@ static long globalfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long
         printk(KERN_INFO "[KERNEL(globalfifo_ioctl)]globalfifo is set to zero\n");
         break;
 
+    /* Switch the FIFO engine, only allowed while the FIFO is idle */
+    case FIFO_SET_MODE:
+        if (arg != FIFO_MODE_LEGACY && arg != FIFO_MODE_RING)
+            return -EINVAL;
+
+        if (globalfifo_lock_all(dev))
+            return -ERESTARTSYS;
+
+        if (!globalfifo_idle(dev)) {
+            ret = -EBUSY;
+        }else {
+            dev->mode = arg;
+            dev->current_len = 0;
+            dev->head = dev->tail = 0;
+            printk(KERN_INFO "[KERNEL(globalfifo_ioctl)]globalfifo mode:%s\n", 
+                arg == FIFO_MODE_RING ? "ring" : "legacy");
+        }
+
+        globalfifo_unlock_all(dev);
+        return ret;
+
+    /* Resize the FIFO, only allowed while the FIFO is idle */
+    case FIFO_SET_SIZE:
+        return globalfifo_resize(dev, arg);
+
+    case FIFO_GET_SIZE:
+        return put_user(dev->size, (unsigned int __user *)arg);
+
     default:
         return -EINVAL;
     }
@@ -270,6 +604,22 @@ static unsigned int globalfifo_poll(struct file *filp,
     unsigned int mask = 0;
     struct globalfifo_dev *dev = filp->private_data;
 
+    if (dev->mode == FIFO_MODE_RING) {
+        poll_wait(filp, &dev->r_wait, wait);
+        poll_wait(filp, &dev->w_wait, wait);
+
+        /* Pairs with the smp_mb() before waitqueue_active() in read/write */
+        smp_mb();
+
+        if (ring_len(dev) != 0)
+            mask |= POLLIN | POLLRDNORM;
+
+        if (ring_room(dev) != 0)
+            mask |= POLLOUT | POLLWRNORM;
+
+        return mask;
+    }
+
     /* Acquire the semaphore */
     down(&dev->sem);
 
@@ -283,7 +633,7 @@ static unsigned int globalfifo_poll(struct file *filp,
         mask |= POLLIN | POLLRDNORM;
 
     /* FIFO is not full */
-    if (dev->current_len != GLOBALFIFO_SIZE)
+    if (dev->current_len != dev->size)
         /* Be able to write the data to the FIFO */
         mask |= POLLOUT | POLLWRNORM;
 
@@ -323,63 +673,122 @@ static void globalfifo_setup_cdev(struct globalfifo_dev *dev, int index)
     }
 }
 
+/* Allocate and initialize the device behind one minor */
+static struct globalfifo_dev *globalfifo_create(int index, unsigned int size)
+{
+    struct globalfifo_dev *dev;
+
+    /* Allocating globalfifo_dev structure dynamically */
+    dev = kzalloc(sizeof(struct globalfifo_dev), GFP_KERNEL);
+    if (!dev)
+        return NULL;
+
+    dev->mem = globalfifo_alloc_mem(size);
+    if (!dev->mem) {
+        kfree(dev);
+        return NULL;
+    }
+    dev->size = size;
+
+    /* Initialize semaphore structure */
+    sema_init(&dev->sem, 1);
+    sema_init(&dev->r_sem, 1);
+    sema_init(&dev->w_sem, 1);
+
+    dev->mode = ring_mode ? FIFO_MODE_RING : FIFO_MODE_LEGACY;
+
+    /* Initialize wait_queue for read_wait_queue and write_wait_queue */
+    init_waitqueue_head(&dev->r_wait);
+    init_waitqueue_head(&dev->w_wait);
+
+    /* Helper function to initialize and add cdev structure */
+    globalfifo_setup_cdev(dev, index);
+
+    return dev;
+}
+
+static void globalfifo_destroy(struct globalfifo_dev *dev)
+{
+    cdev_del(&dev->cdev);
+    globalfifo_free_mem(dev->mem, dev->size);
+    kfree(dev);
+}
+
 static int __init globalfifo_init(void)
 {
-    int result;
+    int result, i;
+    unsigned int size;
     dev_t devno = MKDEV(globalfifo_major, 0);
+
+    size = globalfifo_check_size(fifo_size);
+    if (!size || globalfifo_nr_devs <= 0)
+        return -EINVAL;
     
     /* Register char devices region */
     if (globalfifo_major) {
-        result = register_chrdev_region(devno, 1, "globalfifo");
+        result = register_chrdev_region(devno, globalfifo_nr_devs, "globalfifo");
     }else {
         /* Allocating major number dynamically */
-        result = alloc_chrdev_region(&devno, 0, 1, "globalfifo");
+        result = alloc_chrdev_region(&devno, 0, globalfifo_nr_devs, "globalfifo");
         globalfifo_major = MAJOR(devno);
     }
 
     if (result < 0)
         return result;
 
-    /* Allocating globalmem_dev structure dynamically */
-    globalfifo_devp = kmalloc(sizeof(struct globalfifo_dev), GFP_KERNEL);
+    globalfifo_devp = kzalloc(globalfifo_nr_devs * sizeof(*globalfifo_devp), GFP_KERNEL);
     if (!globalfifo_devp) {
         result = -ENOMEM;
         goto fail_malloc;
     }
-    
-    memset(globalfifo_devp, 0, sizeof(struct globalfifo_dev));
-    
-    /* Helper function to initialize and add cdev structure */
-    globalfifo_setup_cdev(globalfifo_devp, 0);
 
     /* mdev - automatically create the device node */
     globalfifo_cls = class_create(THIS_MODULE, "globalfifo");
-    if (IS_ERR(globalfifo_cls))
-        return PTR_ERR(globalfifo_cls);
-
-    device_create(globalfifo_cls, NULL, devno, NULL, "globalfifo"); /* /dev/globalfifo */
+    if (IS_ERR(globalfifo_cls)) {
+        result = PTR_ERR(globalfifo_cls);
+        goto fail_class;
+    }
 
-    /* Initialize semaphore structure */
-    sema_init(&globalfifo_devp->sem, 1);
+    for (i = 0; i < globalfifo_nr_devs; i++) {
+        globalfifo_devp[i] = globalfifo_create(i, size);
+        if (!globalfifo_devp[i]) {
+            result = -ENOMEM;
+            goto fail_dev;
+        }
 
-    /* Initialize wait_queue for read_wait_queue and write_wait_queue */
-    init_waitqueue_head(&globalfifo_devp->r_wait);
-    init_waitqueue_head(&globalfifo_devp->w_wait);
+        if (i == 0)
+            device_create(globalfifo_cls, NULL, devno, NULL, "globalfifo"); /* /dev/globalfifo */
+        else
+            device_create(globalfifo_cls, NULL, MKDEV(globalfifo_major, i), NULL, 
+                "globalfifo%d", i);
+    }
     
     return 0;
 
+fail_dev:
+    while (--i >= 0) {
+        device_destroy(globalfifo_cls, MKDEV(globalfifo_major, i));
+        globalfifo_destroy(globalfifo_devp[i]);
+    }
+    class_destroy(globalfifo_cls);
+fail_class:
+    kfree(globalfifo_devp);
 fail_malloc:
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, globalfifo_nr_devs);
     return result;
 }
 
 static void __exit globalfifo_exit(void)
 {
-    device_destroy(globalfifo_cls, MKDEV(globalfifo_major, 0));
+    int i;
+
+    for (i = 0; i < globalfifo_nr_devs; i++) {
+        device_destroy(globalfifo_cls, MKDEV(globalfifo_major, i));
+        globalfifo_destroy(globalfifo_devp[i]);
+    }
     class_destroy(globalfifo_cls);
-    cdev_del(&globalfifo_devp->cdev);
     kfree(globalfifo_devp);
-    unregister_chrdev_region(MKDEV(globalfifo_major, 0), 1);
+    unregister_chrdev_region(MKDEV(globalfifo_major, 0), globalfifo_nr_devs);
 }
 
 module_init(globalfifo_init);
@@ -0,0 +1,171 @@
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>       /* gettimeofday */
+#include <sys/wait.h>       /* waitpid */
+#include <signal.h>         /* kill */
+#include <fcntl.h>
+#include <unistd.h>
+
+
+#define FIFO_CLEAR          0x1     /* The code to clear the FIFO region to zero */
+#define FIFO_SET_MODE       0x2     /* The code to switch between the FIFO engines */
+
+#define FIFO_MODE_LEGACY    0       /* memmove-on-read, serialized by dev->sem */
+#define FIFO_MODE_RING      1       /* head/tail ring, SPSC data path */
+
+#define DEFAULT_MSG_SIZE    64      /* bytes per write() */
+#define DEFAULT_TOTAL_KB    4096    /* bytes moved per mode */
+#define MAX_MSG_SIZE        0x1000
+
+
+static double now_sec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Consumer: drain total bytes from the FIFO, then exit */
+static int consumer(unsigned long total, int msg_size)
+{
+    char buf[MAX_MSG_SIZE];
+    unsigned long done = 0;
+    ssize_t len;
+    int fd;
+
+    fd = open("/dev/globalfifo", O_RDONLY);
+    if (fd < 0) {
+        printf("[USER]Error: consumer can't open /dev/globalfifo\n");
+        return -1;
+    }
+
+    while (done < total) {
+        len = read(fd, buf, msg_size);
+        if (len <= 0) {
+            printf("[USER]Error: read failed after %lu bytes\n", done);
+            close(fd);
+            return -1;
+        }
+        done += len;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Producer: push total bytes into the FIFO in msg_size writes */
+static int producer(unsigned long total, int msg_size)
+{
+    char buf[MAX_MSG_SIZE];
+    unsigned long done = 0;
+    ssize_t len;
+    int fd, chunk;
+
+    memset(buf, 0x5a, sizeof(buf));
+
+    fd = open("/dev/globalfifo", O_WRONLY);
+    if (fd < 0) {
+        printf("[USER]Error: producer can't open /dev/globalfifo\n");
+        return -1;
+    }
+
+    while (done < total) {
+        chunk = msg_size;
+        if (total - done < (unsigned long)chunk)
+            chunk = total - done;
+
+        len = write(fd, buf, chunk);
+        if (len <= 0) {
+            printf("[USER]Error: write failed after %lu bytes\n", done);
+            close(fd);
+            return -1;
+        }
+        done += len;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int run_mode(int mode, unsigned long total, int msg_size)
+{
+    double start, elapsed;
+    int fd, status;
+    pid_t pid;
+
+    fd = open("/dev/globalfifo", O_RDWR);
+    if (fd < 0) {
+        printf("[USER]Error: can't open /dev/globalfifo\n");
+        return -1;
+    }
+
+    if (ioctl(fd, FIFO_SET_MODE, mode) < 0) {
+        printf("[USER]Error: failed to set the FIFO mode using ioctl!\n");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    start = now_sec();
+
+    pid = fork();
+    if (pid < 0) {
+        printf("[USER]Error: fork failed\n");
+        return -1;
+    }
+
+    if (pid == 0)
+        exit(consumer(total, msg_size) ? 1 : 0);
+
+    if (producer(total, msg_size)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    waitpid(pid, &status, 0);
+    elapsed = now_sec() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    printf("[USER]%-6s: %lu bytes in %.3f s, %.2f MB/s, %.0f msgs/s\n",
+        mode == FIFO_MODE_RING ? "ring" : "legacy", total, elapsed,
+        total / elapsed / (1024 * 1024), total / msg_size / elapsed);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int msg_size = DEFAULT_MSG_SIZE;
+    unsigned long total = DEFAULT_TOTAL_KB * 1024UL;
+
+    if (argc > 1)
+        msg_size = atoi(argv[1]);
+    if (argc > 2)
+        total = strtoul(argv[2], NULL, 0) * 1024UL;
+
+    if (msg_size <= 0 || msg_size > MAX_MSG_SIZE || total == 0) {
+        printf("Usage: %s [msg_size(1-%d)] [total_KB]\n", argv[0], MAX_MSG_SIZE);
+        return -1;
+    }
+
+    printf("[USER]globalfifo throughput, %d bytes per message, %lu KB per mode\n",
+        msg_size, total / 1024);
+
+    if (run_mode(FIFO_MODE_LEGACY, total, msg_size))
+        printf("[USER]Error: legacy mode run failed\n");
+
+    if (run_mode(FIFO_MODE_RING, total, msg_size))
+        printf("[USER]Error: ring mode run failed\n");
+
+    return 0;
+}
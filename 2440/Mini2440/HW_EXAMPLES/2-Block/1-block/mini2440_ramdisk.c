@@ -3,6 +3,7 @@
 
 
 #include <linux/module.h>               
+#include <linux/moduleparam.h>          /* module_param */
 #include <linux/kernel.h>               /* printk */
 #include <linux/errno.h>                /* error numbers */
 #include <linux/types.h>                
@@ -15,19 +16,39 @@
 #include <linux/blk_types.h>            /* bio_vec structure */
 #include <linux/hdreg.h>                /* hd_geometry structure */
 #include <linux/fs.h>                   /* block_device structure */
+#include <linux/highmem.h>              /* kmap_atomic */
+#include <linux/radix-tree.h>           /* sparse backing store */
+#include <linux/rcupdate.h>             /* rcu_read_lock/synchronize_rcu */
+#include <linux/gfp.h>                  /* alloc_page */
+#include <linux/device.h>               /* DEVICE_ATTR */
 
 
 #define MINI2440_RAMDISK_MINOR               (16)
-#define MINI2440_RAMDISK_SIZE                (1024*1024)
+#define MINI2440_RAMDISK_SIZE                (1024*1024)    /* default capacity */
 #define MINI2440_RAMDISK_SECTOR_SIZE         (512)
 
 static int mini2440_ramdisk_major = 0;
 
+/* Capacity in KB, set at load time. Pages are only allocated when written */
+static int ramdisk_size = MINI2440_RAMDISK_SIZE / 1024;
+module_param(ramdisk_size, int, S_IRUGO);
+
+enum {
+    RM_SIMPLE   = 0,    /* request queue, one segment per step, under dev->lock */
+    RM_NOQUEUE  = 1,    /* make_request, whole bios, no queue lock */
+};
+
+static int request_mode = RM_NOQUEUE;
+module_param(request_mode, int, S_IRUGO);
+
 struct mini2440_ramdisk_dev {
     struct gendisk *gdisk;
     struct request_queue *queue;
     spinlock_t lock;
-    unsigned char *ramdisk_buffer;
+    unsigned long size;             /* capacity in bytes */
+    struct radix_tree_root pages;   /* backing pages, indexed by offset >> PAGE_SHIFT */
+    spinlock_t pages_lock;          /* protects insertions/deletions in pages */
+    unsigned long nr_pages;         /* pages currently allocated */
 };
 
 /* Instance of the ramdisk_dev pointer */
@@ -35,10 +56,12 @@ static struct mini2440_ramdisk_dev *mini2440_ramdisk_devp;
 
 static int mini2440_ramdisk_getgeo(struct block_device *bdev, struct hd_geometry *geo)
 {
+    struct mini2440_ramdisk_dev *dev = bdev->bd_disk->private_data;
+
     /* Capacity = heads * cylinders * sectors * RAMDISK_SECTOR_SIZE(512) */
     geo->heads      = 2;
-    geo->cylinders  = 32;
-    geo->sectors    = MINI2440_RAMDISK_SIZE/geo->heads/geo->cylinders/MINI2440_RAMDISK_SECTOR_SIZE;
+    geo->sectors    = 32;
+    geo->cylinders  = dev->size/geo->heads/geo->sectors/MINI2440_RAMDISK_SECTOR_SIZE;
 
     return 0;
 }
@@ -48,10 +71,190 @@ static struct block_device_operations mini2440_ramdisk_fops = {
     .getgeo     = mini2440_ramdisk_getgeo,       /* for fdisk */
 };
 
+/*
+ * Sparse backing store
+ *
+ * Nothing is allocated at load time. A page is allocated on the first
+ * write to it, a sector without a page reads back as zeros, and discard
+ * gives whole pages back. Lookups run under RCU, insertions and deletions
+ * under pages_lock.
+ */
+static struct page *ramdisk_insert_page(struct mini2440_ramdisk_dev *dev, 
+    pgoff_t idx, gfp_t gfp)
+{
+	struct page *page;
+	unsigned long flags;
+
+	page = alloc_page(gfp | __GFP_ZERO);
+	if (!page)
+		return NULL;
+
+	if ((gfp & __GFP_WAIT) && radix_tree_preload(gfp)) {
+		__free_page(page);
+		return NULL;
+	}
+
+	page->index = idx;
+	spin_lock_irqsave(&dev->pages_lock, flags);
+	if (radix_tree_insert(&dev->pages, idx, page)) {
+		/* Somebody else was first, or no memory for the tree node */
+		__free_page(page);
+		page = radix_tree_lookup(&dev->pages, idx);
+	}else {
+		dev->nr_pages++;
+	}
+	spin_unlock_irqrestore(&dev->pages_lock, flags);
+
+	if (gfp & __GFP_WAIT)
+		radix_tree_preload_end();
+
+	return page;
+}
+
+/* Allocate every missing page of a range, before entering atomic context */
+static int ramdisk_prealloc(struct mini2440_ramdisk_dev *dev, 
+    unsigned long offset, unsigned long len)
+{
+	pgoff_t idx, last = (offset + len - 1) >> PAGE_SHIFT;
+	struct page *page;
+
+	for (idx = offset >> PAGE_SHIFT; idx <= last; idx++) {
+		rcu_read_lock();
+		page = radix_tree_lookup(&dev->pages, idx);
+		rcu_read_unlock();
+
+		if (!page && !ramdisk_insert_page(dev, idx, GFP_NOIO))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ramdisk_copy_from_store(struct mini2440_ramdisk_dev *dev, 
+    void *dst, unsigned long offset, unsigned long len)
+{
+	unsigned long off, chunk;
+	struct page *page;
+
+	while (len) {
+		off = offset & ~PAGE_MASK;
+		chunk = min_t(unsigned long, len, PAGE_SIZE - off);
+
+		rcu_read_lock();
+		page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+		if (page)
+			memcpy(dst, page_address(page) + off, chunk);
+		else
+			memset(dst, 0, chunk);
+		rcu_read_unlock();
+
+		dst += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+}
+
+static int ramdisk_copy_to_store(struct mini2440_ramdisk_dev *dev, 
+    const void *src, unsigned long offset, unsigned long len, gfp_t gfp)
+{
+	unsigned long off, chunk;
+	struct page *page;
+
+	while (len) {
+		off = offset & ~PAGE_MASK;
+		chunk = min_t(unsigned long, len, PAGE_SIZE - off);
+
+		rcu_read_lock();
+		page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+		if (page)
+			memcpy(page_address(page) + off, src, chunk);
+		rcu_read_unlock();
+
+		if (!page) {
+			/* First write to this page, allocate it and look again */
+			if (!ramdisk_insert_page(dev, offset >> PAGE_SHIFT, gfp))
+				return -ENOMEM;
+			continue;
+		}
+
+		src += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Whole pages in the range are freed, the partial ones at both ends are
+ * zeroed. When the caller can sleep, readers that may still hold a page
+ * under RCU are waited for, otherwise the caller guarantees there are none.
+ */
+static void ramdisk_discard(struct mini2440_ramdisk_dev *dev, 
+    unsigned long offset, unsigned long len, int can_sleep)
+{
+	unsigned long off, chunk, flags;
+	struct page *page, *next;
+	LIST_HEAD(freed);
+
+	while (len) {
+		off = offset & ~PAGE_MASK;
+		chunk = min_t(unsigned long, len, PAGE_SIZE - off);
+
+		spin_lock_irqsave(&dev->pages_lock, flags);
+		page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+		if (page && chunk == PAGE_SIZE) {
+			radix_tree_delete(&dev->pages, page->index);
+			dev->nr_pages--;
+			list_add(&page->lru, &freed);
+		}else if (page) {
+			memset(page_address(page) + off, 0, chunk);
+		}
+		spin_unlock_irqrestore(&dev->pages_lock, flags);
+
+		offset += chunk;
+		len -= chunk;
+	}
+
+	if (can_sleep)
+		synchronize_rcu();
+
+	list_for_each_entry_safe(page, next, &freed, lru)
+		__free_page(page);
+}
+
+static void ramdisk_free_store(struct mini2440_ramdisk_dev *dev)
+{
+	struct page *pages[16];
+	pgoff_t pos = 0;
+	int i, nr;
+
+	do {
+		nr = radix_tree_gang_lookup(&dev->pages, (void **)pages, pos, ARRAY_SIZE(pages));
+		for (i = 0; i < nr; i++) {
+			pos = pages[i]->index;
+			radix_tree_delete(&dev->pages, pos);
+			__free_page(pages[i]);
+		}
+		pos++;
+	} while (nr == ARRAY_SIZE(pages));
+
+	dev->nr_pages = 0;
+}
+
+/* /sys/block/mini2440_ramdisk/mem_used: bytes of RAM backing the disk */
+static ssize_t ramdisk_mem_used_show(struct device *d, 
+    struct device_attribute *attr, char *buf)
+{
+	struct mini2440_ramdisk_dev *dev = dev_to_disk(d)->private_data;
+
+	return sprintf(buf, "%lu\n", dev->nr_pages << PAGE_SHIFT);
+}
+
+static DEVICE_ATTR(mem_used, S_IRUGO, ramdisk_mem_used_show, NULL);
+
 static void mini2440_ramdisk_request(struct request_queue *q)
 {    
-	static int r_cnt = 0;
-	static int w_cnt = 0;
 	struct request *req;
 	
 	req = blk_fetch_request(q);
@@ -63,25 +266,90 @@ static void mini2440_ramdisk_request(struct request_queue *q)
 		/* : */		
 		unsigned long len = blk_rq_cur_bytes(req);
 
-		if (rq_data_dir(req) == READ) {
-			printk("[RAMDISK]ramdisk_request read %d\n", ++r_cnt);
-			memcpy(req->buffer, mini2440_ramdisk_devp->ramdisk_buffer+offset, len);
-		}else {
-			printk("[RAMDISK]ramdisk_request write %d\n", ++w_cnt);
-			memcpy(mini2440_ramdisk_devp->ramdisk_buffer+offset, req->buffer, len);
-		}		
-		
-		if (!__blk_end_request_cur(req, 0))
+		int err = 0;
+
+		/* Under the queue lock nobody else touches the store, free at once */
+		if (req->cmd_flags & REQ_DISCARD) {
+			if (offset + blk_rq_bytes(req) > mini2440_ramdisk_devp->size)
+				err = -EIO;
+			else
+				ramdisk_discard(mini2440_ramdisk_devp, offset, blk_rq_bytes(req), 0);
+			__blk_end_request_all(req, err);
 			req = blk_fetch_request(q);
+			continue;
+		}
+
+		/* The queue lock is held with interrupts off, allocations can't sleep */
+		if (offset + len > mini2440_ramdisk_devp->size)
+			err = -EIO;
+		else if (rq_data_dir(req) == READ)
+			ramdisk_copy_from_store(mini2440_ramdisk_devp, req->buffer, offset, len);
 		else
-			printk("[RAMDISK]__blk_end_request_cur error!\n");
+			err = ramdisk_copy_to_store(mini2440_ramdisk_devp, req->buffer, offset, len, GFP_ATOMIC);
+		
+		/* true: the request still has segments, go on with the same req */
+		if (!__blk_end_request_cur(req, err))
+			req = blk_fetch_request(q);
+	}
+}
+
+/*
+ * Bio based path: the block layer hands over whole bios without taking a
+ * queue lock, so submitters on different CPUs never serialize here, and
+ * every segment of a multi segment bio is copied in one pass.
+ */
+static void mini2440_ramdisk_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct mini2440_ramdisk_dev *dev = q->queuedata;
+	unsigned long offset = bio->bi_sector << 9;
+	struct bio_vec *bvec;
+	void *mem;
+	int i, err = 0;
+
+	if (offset + bio->bi_size > dev->size) {
+		err = -EIO;
+		goto out;
 	}
+
+	if (bio->bi_rw & REQ_DISCARD) {
+		ramdisk_discard(dev, offset, bio->bi_size, 1);
+		goto out;
+	}
+
+	/* Allocate while we still may sleep, the copy below runs kmapped */
+	if (bio_data_dir(bio) == WRITE) {
+		err = ramdisk_prealloc(dev, offset, bio->bi_size);
+		if (err)
+			goto out;
+	}
+
+	bio_for_each_segment(bvec, bio, i) {
+		mem = kmap_atomic(bvec->bv_page);
+		if (bio_data_dir(bio) == WRITE) {
+			/* GFP_ATOMIC only matters if a discard raced with us */
+			err = ramdisk_copy_to_store(dev, mem + bvec->bv_offset, offset, 
+				bvec->bv_len, GFP_ATOMIC);
+		}else {
+			ramdisk_copy_from_store(dev, mem + bvec->bv_offset, offset, bvec->bv_len);
+			flush_dcache_page(bvec->bv_page);
+		}
+		kunmap_atomic(mem);
+		if (err)
+			break;
+		offset += bvec->bv_len;
+	}
+
+out:
+	bio_endio(bio, err);
 }
 
 
 static int __init mini2440_ramdisk_init(void)
 {
     int ret = 0;
+
+    if (ramdisk_size <= 0)
+        return -EINVAL;
     
     /* Register block device */
     mini2440_ramdisk_major = register_blkdev(mini2440_ramdisk_major, "mini2440_ramdisk"); /* cat /proc/devices */
@@ -104,18 +372,43 @@ static int __init mini2440_ramdisk_init(void)
 
     /* Initialize spinlock_t structure */
     spin_lock_init(&mini2440_ramdisk_devp->lock);
+    spin_lock_init(&mini2440_ramdisk_devp->pages_lock);
+
+    /* Empty store, node allocations outside a preload must not sleep */
+    INIT_RADIX_TREE(&mini2440_ramdisk_devp->pages, GFP_ATOMIC);
+    mini2440_ramdisk_devp->nr_pages = 0;
+
+    mini2440_ramdisk_devp->size = (unsigned long)ramdisk_size * 1024;
 
     /* 
      * Allocating request_queue structure and config it in order to 
      * support read/write capabilities 
      */
-    mini2440_ramdisk_devp->queue = blk_init_queue(mini2440_ramdisk_request, &mini2440_ramdisk_devp->lock);
+    if (request_mode == RM_NOQUEUE) {
+        mini2440_ramdisk_devp->queue = blk_alloc_queue(GFP_KERNEL);
+        if (mini2440_ramdisk_devp->queue) {
+            blk_queue_make_request(mini2440_ramdisk_devp->queue, mini2440_ramdisk_make_request);
+            /* Pages are kmapped, no need to bounce highmem */
+            blk_queue_bounce_limit(mini2440_ramdisk_devp->queue, BLK_BOUNCE_ANY);
+        }
+    }else {
+        mini2440_ramdisk_devp->queue = blk_init_queue(mini2440_ramdisk_request, &mini2440_ramdisk_devp->lock);
+    }
     if (!mini2440_ramdisk_devp->queue) {
-        printk(KERN_NOTICE "[RAMDISK]blk_init_queue is failed!\n");
+        printk(KERN_NOTICE "[RAMDISK]allocating request queue is failed!\n");
         ret = -ENOMEM;
         goto error_request_queue_gendisk;
     }
 
+    blk_queue_logical_block_size(mini2440_ramdisk_devp->queue, MINI2440_RAMDISK_SECTOR_SIZE);
+    queue_flag_set_unlocked(QUEUE_FLAG_NONROT, mini2440_ramdisk_devp->queue);
+
+    /* Discard (TRIM) gives pages back to the system */
+    mini2440_ramdisk_devp->queue->limits.discard_granularity = PAGE_SIZE;
+    mini2440_ramdisk_devp->queue->limits.discard_zeroes_data = 1;
+    blk_queue_max_discard_sectors(mini2440_ramdisk_devp->queue, UINT_MAX);
+    queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, mini2440_ramdisk_devp->queue);
+
     /* Store the ramdisk_devp to queuedata */
     mini2440_ramdisk_devp->queue->queuedata = mini2440_ramdisk_devp;
     
@@ -126,18 +419,15 @@ static int __init mini2440_ramdisk_init(void)
     mini2440_ramdisk_devp->gdisk->fops           = &mini2440_ramdisk_fops;
     mini2440_ramdisk_devp->gdisk->private_data   = mini2440_ramdisk_devp;       
     sprintf(mini2440_ramdisk_devp->gdisk->disk_name, "mini2440_ramdisk");
-    set_capacity(mini2440_ramdisk_devp->gdisk, MINI2440_RAMDISK_SIZE / MINI2440_RAMDISK_SECTOR_SIZE);
-
-    mini2440_ramdisk_devp->ramdisk_buffer = kzalloc(MINI2440_RAMDISK_SIZE, GFP_KERNEL);
-    if (!mini2440_ramdisk_devp->ramdisk_buffer) {
-        printk(KERN_NOTICE "[RAMDISK]allocating ramdisk_buffer is failed!\n");
-        ret = -ENOMEM;
-        goto error_ramdisk_buffer;
-    }
+    set_capacity(mini2440_ramdisk_devp->gdisk, mini2440_ramdisk_devp->size / MINI2440_RAMDISK_SECTOR_SIZE);
 
     /* Adding(Registering) gendisk */
     add_disk(mini2440_ramdisk_devp->gdisk);
 
+    /* Memory footprint, cat /sys/block/mini2440_ramdisk/mem_used */
+    if (device_create_file(disk_to_dev(mini2440_ramdisk_devp->gdisk), &dev_attr_mem_used))
+        printk(KERN_NOTICE "[RAMDISK]creating mem_used attribute is failed!\n");
+
     return ret;
 
 error_ramdisk_devp:
@@ -148,20 +438,15 @@ error_request_queue_gendisk:
     kfree(mini2440_ramdisk_devp);
     unregister_blkdev(mini2440_ramdisk_major, "ramdisk");
     return ret;
-
-error_ramdisk_buffer:
-    blk_cleanup_queue(mini2440_ramdisk_devp->queue);
-    kfree(mini2440_ramdisk_devp);
-    unregister_blkdev(mini2440_ramdisk_major, "ramdisk");
-    return ret;
 } 
 
 static void __exit mini2440_ramdisk_exit(void)
 {
+    device_remove_file(disk_to_dev(mini2440_ramdisk_devp->gdisk), &dev_attr_mem_used);
     del_gendisk(mini2440_ramdisk_devp->gdisk);
     put_disk(mini2440_ramdisk_devp->gdisk);
-    kfree(mini2440_ramdisk_devp->ramdisk_buffer);
     blk_cleanup_queue(mini2440_ramdisk_devp->queue);
+    ramdisk_free_store(mini2440_ramdisk_devp);
     kfree(mini2440_ramdisk_devp);
     unregister_blkdev(mini2440_ramdisk_major, "mini2440_ramdisk");
 }
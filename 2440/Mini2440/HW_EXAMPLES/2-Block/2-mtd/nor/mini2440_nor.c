@@ -23,6 +23,8 @@ MODULE_AUTHOR("Pete&Charles <http://embeddedfansclub.taobao.com>");
 static struct map_info *mini2440_nor;
 static struct mtd_info *mini2440_nor_mtd;
 
+#include "../../../../../Super2440/15-norflash/s3c_nor_ra.h"
+
 static struct mtd_partition mini2440_nor_parts[] = {
 	[0] = {
         .name   = "u-boot_nor",
@@ -49,6 +51,8 @@ static int mini2440_nor_init(void)
 	mini2440_nor->virt = ioremap(mini2440_nor->phys, mini2440_nor->size);
 
 	simple_map_init(mini2440_nor);
+
+	s3c_nor_ra_init(mini2440_nor);
 	
 	/* 3. ʹ: NOR FLASHЭṩĺʶ */
 	printk("use cfi_probe\n");
@@ -61,11 +65,14 @@ static int mini2440_nor_init(void)
 
 	if (!mini2440_nor_mtd)
 	{		
+		s3c_nor_ra_exit(mini2440_nor);
 		iounmap(mini2440_nor->virt);
 		kfree(mini2440_nor);
 		return -EIO;
 	}
 	
+	s3c_nor_page_mode(mini2440_nor);
+
 	/* 4. add_mtd_partitions */
 	mtd_device_register(mini2440_nor_mtd, mini2440_nor_parts, 2);
 	
@@ -75,6 +82,9 @@ static int mini2440_nor_init(void)
 static void mini2440_nor_exit(void)
 {
 	mtd_device_unregister(mini2440_nor_mtd);
+	map_destroy(mini2440_nor_mtd);
+
+	s3c_nor_ra_exit(mini2440_nor);
 	iounmap(mini2440_nor->virt);
 	kfree(mini2440_nor);
 }
@@ -18,6 +18,11 @@
 #include <linux/delay.h>
 #include <linux/gfp.h>
 #include <linux/ip.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <net/xfrm.h>
+#include <linux/ethtool.h>
 
 #include <asm/system.h>
 #include <asm/io.h>
@@ -28,18 +33,113 @@ MODULE_AUTHOR("Pete&Charles <http://embeddedfansclub.taobao.com>");
 MODULE_LICENSE("GPL");
 
 
-static struct net_device *mini2440_vnet;
+/* Depth of each loopback TX ring, rounded up to a power of 2 */
+static int tx_ring_size = 256;
+module_param(tx_ring_size, int, S_IRUGO);
 
-static void construct_rxpack(struct sk_buff *skb, struct net_device *dev)
+/* Max frames handed to the stack per NAPI poll */
+static int napi_weight = 64;
+module_param(napi_weight, int, S_IRUGO);
+
+/* 
+ *  0: one efc%d device that answers pings sent to it 
+ *  N: N linked pairs efc(2k) <-> efc(2k+1), what one sends the other receives 
+ */
+static int nr_pairs = 0;
+module_param(nr_pairs, int, S_IRUGO);
+
+/* TX/RX queues per device, each with its own ring, NAPI context and stats */
+static int num_queues = 1;
+module_param(num_queues, int, S_IRUGO);
+
+#define VNET_MAX_QUEUES     16
+#define VNET_MAX_PAIRS      32
+
+/* 
+ *  Loopback engine
+ *
+ *  mini2440_vnet_sendpack() only puts the frame on the TX ring of the queue
+ *  the stack picked, the NAPI poll of that queue takes it off and hands the
+ *  same skb to the peer, up to napi_weight frames at a time. In the single
+ *  device mode the peer is the device itself and the frame is turned around
+ *  first. ndo_start_xmit is serialized by the per queue TX lock and a poll
+ *  runs on one CPU at a time, so every ring is single producer/single
+ *  consumer and needs no lock, only the barriers around tx_head/tx_tail.
+ *  Queues never share anything, traffic on different queues scales with
+ *  the number of CPUs.
+ */
+struct vnet_queue_stats {
+    unsigned long tx_packets;
+    unsigned long tx_bytes;
+    unsigned long tx_dropped;
+    unsigned long rx_packets;       /* written by the peer's poll */
+    unsigned long rx_bytes;
+    unsigned long rx_dropped;
+};
+
+#define VNET_STATS_LEN  (sizeof(struct vnet_queue_stats) / sizeof(unsigned long))
+
+static const char vnet_stats_names[VNET_STATS_LEN][ETH_GSTRING_LEN - 4] = {
+    "tx_packets", "tx_bytes", "tx_dropped",
+    "rx_packets", "rx_bytes", "rx_dropped",
+};
+
+struct vnet_queue {
+    struct net_device *dev;
+    unsigned int index;
+    struct napi_struct napi;
+    struct sk_buff **ring;
+    unsigned int size;              /* power of 2 */
+    unsigned int tx_head;           /* next slot the poll takes, free running */
+    unsigned int tx_tail;           /* next slot xmit fills, free running */
+    struct vnet_queue_stats stats;
+} ____cacheline_aligned_in_smp;
+
+/* 
+ *  The padding above only keeps neighbours apart if the array itself starts
+ *  on a cache line, kcalloc does not promise that. All queue arrays of the
+ *  module have the same size, they come from one cache aligned slab.
+ */
+static struct kmem_cache *vnet_queue_cache;
+
+struct mini2440_vnet_priv {
+    struct net_device *peer;        /* receives what this device sends */
+    int reflect;                    /* turn pings around, single device mode */
+    unsigned int nr_queues;
+    struct vnet_queue *queues;
+};
+
+static struct net_device **vnet_devs;
+static int vnet_nr_devs;
+
+static inline unsigned int vnet_ring_used(struct vnet_queue *q)
+{
+    return ACCESS_ONCE(q->tx_tail) - ACCESS_ONCE(q->tx_head);
+}
+
+/* Wake the queue again once a quarter of the ring is free */
+static inline int vnet_ring_can_wake(struct vnet_queue *q)
+{
+    return q->size - vnet_ring_used(q) >= q->size / 4;
+}
+
+static int construct_rxpack(struct sk_buff *skb, struct net_device *dev)
 { 
 	unsigned char *type;
 	struct iphdr *ih;
 	__be32 *saddr, *daddr, tmp;
 	unsigned char	tmp_dev_addr[ETH_ALEN];
 	struct ethhdr *ethhdr;
-	
-	struct sk_buff *rx_skb;
 		
+    /* 
+     *  The headers are rewritten in place, so they have to be linear 
+     *  and not shared with a clone 
+     */
+	if (!pskb_may_pull(skb, sizeof(struct ethhdr) + sizeof(struct iphdr) + 1))
+		return -EINVAL;
+	if (skb_cow_head(skb, 0))
+		return -ENOMEM;
+
     /* 
      *  Read and save the data from hardware 
      *  Switch the source/destination of the MAC address 
@@ -72,92 +172,387 @@ static void construct_rxpack(struct sk_buff *skb, struct net_device *dev)
 	
 	ih->check = 0;		   /* and rebuild the checksum (ip needs it) */
 	ih->check = ip_fast_csum((unsigned char *)ih,ih->ihl);
-	
-    /* Construct a sk_buff structure */
-    rx_skb = dev_alloc_skb(skb->len + 2);
-	skb_reserve(rx_skb, 2); /* align IP on 16B boundary */	
-	memcpy(skb_put(rx_skb, skb->len), skb->data, skb->len);
+
+	return 0;
+}
+
+/* Turn a transmitted skb into one received by the peer, no copy */
+static void vnet_rx_skb(struct vnet_queue *q, struct sk_buff *skb)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(q->dev);
+    struct net_device *peer = priv->peer;
+    struct mini2440_vnet_priv *peer_priv = netdev_priv(peer);
+    /* Same queue index on the peer, so the flow stays on one CPU */
+    struct vnet_queue *rxq = &peer_priv->queues[q->index % peer_priv->nr_queues];
+
+    if (unlikely(!netif_running(peer))) {
+        rxq->stats.rx_dropped++;
+        dev_kfree_skb(skb);
+        return;
+    }
+
+    /* Drop what belonged to the sending side */
+    skb_orphan(skb);
+    skb_dst_drop(skb);
+    nf_reset(skb);
+    secpath_reset(skb);
 
 	/* Write metadata, and then pass to the receive level */
-	rx_skb->dev = dev;
-	rx_skb->protocol = eth_type_trans(rx_skb, dev);
-	rx_skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	dev->stats.rx_packets++;
-	dev->stats.rx_bytes += skb->len;
+	skb->protocol = eth_type_trans(skb, peer);
+	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+    skb_record_rx_queue(skb, rxq->index);
+	rxq->stats.rx_packets++;
+	rxq->stats.rx_bytes += skb->len;
 
 	/* Submit sk_buff */
-	netif_rx(rx_skb);
+	netif_receive_skb(skb);
 }
 
+static int mini2440_vnet_poll(struct napi_struct *napi, int budget)
+{
+    struct vnet_queue *q = container_of(napi, struct vnet_queue, napi);
+    struct sk_buff *skb;
+    int done = 0;
+
+    while (done < budget && q->tx_head != ACCESS_ONCE(q->tx_tail)) {
+        /* Read the slot only after seeing the tail that published it */
+        smp_rmb();
+        skb = q->ring[q->tx_head & (q->size - 1)];
+        q->ring[q->tx_head & (q->size - 1)] = NULL;
+        smp_mb();
+        q->tx_head++;
+
+        vnet_rx_skb(q, skb);
+        done++;
+    }
+
+    if (__netif_subqueue_stopped(q->dev, q->index) && vnet_ring_can_wake(q))
+        netif_wake_subqueue(q->dev, q->index);
+
+    if (done < budget) {
+        napi_complete(napi);
+        /* A frame queued after the last check would wait for the next xmit */
+        if (q->tx_head != ACCESS_ONCE(q->tx_tail))
+            napi_schedule(napi);
+    }
+
+    return done;
+}
 
 static netdev_tx_t mini2440_vnet_sendpack(struct sk_buff *skb,
                        struct net_device *dev)
 {
-    static int counter = 0;
-    printk("[DRIVER]counter = %d\n", ++counter);
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    struct vnet_queue *q = &priv->queues[skb_get_queue_mapping(skb)];
 
-    /* Stop the net queue */
-    netif_stop_queue(dev);
+    /* The stop below should prevent this */
+    if (unlikely(vnet_ring_used(q) >= q->size)) {
+        netif_stop_subqueue(dev, q->index);
+        return NETDEV_TX_BUSY;
+    }
 
     /* Construct a counterfeit packet */
-    construct_rxpack(skb, dev);
+    if (priv->reflect && construct_rxpack(skb, dev)) {
+        q->stats.tx_dropped++;
+        dev_kfree_skb(skb);
+        return NETDEV_TX_OK;
+    }
 
-    /* Free the skb packet */
-    dev_kfree_skb(skb);
+    /* Updating the tx stats, the skb belongs to the poll once published */
+    q->stats.tx_packets++;
+    q->stats.tx_bytes += skb->len;
 
-    /* Wakeup the net queue */
-    netif_wake_queue(dev);
-    
-    /* Updating the tx stats */
-    dev->stats.tx_packets++;
-    dev->stats.tx_bytes += skb->len;
+    q->ring[q->tx_tail & (q->size - 1)] = skb;
+    /* Publish the slot before the tail that points past it */
+    smp_wmb();
+    q->tx_tail++;
+
+    /* Stop the net queue only when the ring is full */
+    if (vnet_ring_used(q) >= q->size) {
+        netif_stop_subqueue(dev, q->index);
+        /* The poll may have drained it meanwhile and missed the stop */
+        smp_mb();
+        if (vnet_ring_can_wake(q))
+            netif_wake_subqueue(dev, q->index);
+    }
+
+    napi_schedule(&q->napi);
+
+    return NETDEV_TX_OK;
+}
+
+static int mini2440_vnet_open(struct net_device *dev)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    unsigned int i;
+
+    for (i = 0; i < priv->nr_queues; i++)
+        napi_enable(&priv->queues[i].napi);
+    netif_tx_start_all_queues(dev);
 
     return 0;
 }
 
+static int mini2440_vnet_stop(struct net_device *dev)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    struct vnet_queue *q;
+    unsigned int i;
+
+    netif_tx_stop_all_queues(dev);
+
+    for (i = 0; i < priv->nr_queues; i++) {
+        q = &priv->queues[i];
+        napi_disable(&q->napi);
+
+        /* Drop whatever the poll did not get to */
+        while (q->tx_head != q->tx_tail) {
+            dev_kfree_skb(q->ring[q->tx_head & (q->size - 1)]);
+            q->ring[q->tx_head & (q->size - 1)] = NULL;
+            q->tx_head++;
+            q->stats.tx_dropped++;
+        }
+    }
+
+    return 0;
+}
+
+/* The device totals are the sum over the queues */
+static struct rtnl_link_stats64 *mini2440_vnet_get_stats64(struct net_device *dev,
+                       struct rtnl_link_stats64 *tot)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    struct vnet_queue_stats *st;
+    unsigned int i;
+
+    for (i = 0; i < priv->nr_queues; i++) {
+        st = &priv->queues[i].stats;
+        tot->tx_packets += st->tx_packets;
+        tot->tx_bytes   += st->tx_bytes;
+        tot->tx_dropped += st->tx_dropped;
+        tot->rx_packets += st->rx_packets;
+        tot->rx_bytes   += st->rx_bytes;
+        tot->rx_dropped += st->rx_dropped;
+    }
+
+    return tot;
+}
 
 static const struct net_device_ops vnet_netdev_ops = {
+    .ndo_open               = mini2440_vnet_open,
+    .ndo_stop               = mini2440_vnet_stop,
     .ndo_start_xmit         = mini2440_vnet_sendpack,
+    .ndo_get_stats64        = mini2440_vnet_get_stats64,
 };
 
-static int __init mini2440_vnet_init(void)
+/* Per queue stats, ethtool -S efcN */
+static int mini2440_vnet_get_sset_count(struct net_device *dev, int sset)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+
+    if (sset != ETH_SS_STATS)
+        return -EOPNOTSUPP;
+    return priv->nr_queues * VNET_STATS_LEN;
+}
+
+static void mini2440_vnet_get_strings(struct net_device *dev, u32 sset, u8 *buf)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    unsigned int i, j;
+
+    if (sset != ETH_SS_STATS)
+        return;
+
+    for (i = 0; i < priv->nr_queues; i++)
+        for (j = 0; j < VNET_STATS_LEN; j++) {
+            snprintf(buf, ETH_GSTRING_LEN, "q%u_%s", i, vnet_stats_names[j]);
+            buf += ETH_GSTRING_LEN;
+        }
+}
+
+static void mini2440_vnet_get_ethtool_stats(struct net_device *dev,
+                       struct ethtool_stats *stats, u64 *data)
 {
-	/*  1. Allocating a net_device structure(mini2440_vnet) */
-	mini2440_vnet = alloc_netdev(0, "efc%d", ether_setup);;  /* alloc_etherdev */
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    unsigned long *st;
+    unsigned int i, j;
+
+    for (i = 0; i < priv->nr_queues; i++) {
+        st = (unsigned long *)&priv->queues[i].stats;
+        for (j = 0; j < VNET_STATS_LEN; j++)
+            *data++ = st[j];
+    }
+}
+
+static const struct ethtool_ops vnet_ethtool_ops = {
+    .get_link               = ethtool_op_get_link,
+    .get_sset_count         = mini2440_vnet_get_sset_count,
+    .get_strings            = mini2440_vnet_get_strings,
+    .get_ethtool_stats      = mini2440_vnet_get_ethtool_stats,
+};
 
-	/*  2. Setup mini2440_vnet */
+/* Allocate one device with its queues, peer is linked by the caller */
+static struct net_device *mini2440_vnet_create(int reflect)
+{
+    struct mini2440_vnet_priv *priv;
+    struct net_device *dev;
+    struct vnet_queue *q;
+    unsigned int i;
+
+	/*  1. Allocating a net_device structure with num_queues TX/RX queues */
+	dev = alloc_netdev_mqs(sizeof(struct mini2440_vnet_priv), "efc%d", ether_setup, 
+        num_queues, num_queues);
+    if (!dev)
+        return NULL;
+
+	/*  2. Setup the net_device */
     /* The net operations of the net_device structure */
-    mini2440_vnet->netdev_ops = &vnet_netdev_ops;
+    dev->netdev_ops = &vnet_netdev_ops;
+    SET_ETHTOOL_OPS(dev, &vnet_ethtool_ops);
+
+    /* One loopback TX ring and NAPI context per queue */
+    priv = netdev_priv(dev);
+    priv->reflect = reflect;
+    priv->nr_queues = num_queues;
+    priv->queues = kmem_cache_zalloc(vnet_queue_cache, GFP_KERNEL);
+    if (!priv->queues)
+        goto error_queues;
+
+    for (i = 0; i < priv->nr_queues; i++) {
+        q = &priv->queues[i];
+        q->dev = dev;
+        q->index = i;
+        q->size = roundup_pow_of_two(tx_ring_size);
+        q->ring = kcalloc(q->size, sizeof(struct sk_buff *), GFP_KERNEL);
+        if (!q->ring)
+            goto error_ring;
+        netif_napi_add(dev, &q->napi, mini2440_vnet_poll, napi_weight);
+    }
 
     /*  3. Setup the MAC address */
-    mini2440_vnet->dev_addr[0] = 0x1A;
-    mini2440_vnet->dev_addr[1] = 0x2B;
-    mini2440_vnet->dev_addr[2] = 0x3C;
-    mini2440_vnet->dev_addr[3] = 0x4D;
-    mini2440_vnet->dev_addr[4] = 0x5E;
-    mini2440_vnet->dev_addr[5] = 0x6F;
+    if (reflect) {
+        dev->dev_addr[0] = 0x1A;
+        dev->dev_addr[1] = 0x2B;
+        dev->dev_addr[2] = 0x3C;
+        dev->dev_addr[3] = 0x4D;
+        dev->dev_addr[4] = 0x5E;
+        dev->dev_addr[5] = 0x6F;
+
+        /* Need to setup the following 2 members in order to ping successfully */
+        dev->flags           |= IFF_NOARP;
+        //dev->features        |= NETIF_F_NO_CSUM;
+    } else {
+        /* The two ends of a pair ARP for each other like real NICs */
+        eth_hw_addr_random(dev);
+    }
 
-    /* Need to setup the following 2 members in order to ping successfully */
-	mini2440_vnet->flags           |= IFF_NOARP;
-	//mini2440_vnet->features        |= NETIF_F_NO_CSUM;
+    /* Keep the qdisc from becoming the bottleneck in front of the ring */
+    dev->tx_queue_len = roundup_pow_of_two(tx_ring_size);
 
+    return dev;
+
+error_ring:
+    while (i--) {
+        netif_napi_del(&priv->queues[i].napi);
+        kfree(priv->queues[i].ring);
+    }
+    kmem_cache_free(vnet_queue_cache, priv->queues);
+error_queues:
+    free_netdev(dev);
+    return NULL;
+}
+
+/* Free a device that is not (or no longer) registered */
+static void mini2440_vnet_destroy(struct net_device *dev)
+{
+    struct mini2440_vnet_priv *priv = netdev_priv(dev);
+    unsigned int i;
+
+    for (i = 0; i < priv->nr_queues; i++) {
+        netif_napi_del(&priv->queues[i].napi);
+        kfree(priv->queues[i].ring);
+    }
+    kmem_cache_free(vnet_queue_cache, priv->queues);
+	free_netdev(dev);
+}
+
+static int __init mini2440_vnet_init(void)
+{
+    struct mini2440_vnet_priv *priv;
+    int i, ret, registered = 0;
+
+    if (tx_ring_size < 4 || napi_weight <= 0 || 
+        num_queues <= 0 || num_queues > VNET_MAX_QUEUES || 
+        nr_pairs < 0 || nr_pairs > VNET_MAX_PAIRS) {
+        printk(KERN_NOTICE "[DRIVER]Bad tx_ring_size %d, napi_weight %d, num_queues %d or nr_pairs %d!\n", 
+            tx_ring_size, napi_weight, num_queues, nr_pairs);
+        return -EINVAL;
+    }
+
+    vnet_queue_cache = kmem_cache_create("vnet_queues", num_queues * sizeof(struct vnet_queue), 
+        cache_line_size(), SLAB_HWCACHE_ALIGN, NULL);
+    if (!vnet_queue_cache)
+        return -ENOMEM;
+
+    vnet_nr_devs = nr_pairs ? 2 * nr_pairs : 1;
+    vnet_devs = kcalloc(vnet_nr_devs, sizeof(struct net_device *), GFP_KERNEL);
+    if (!vnet_devs) {
+        kmem_cache_destroy(vnet_queue_cache);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < vnet_nr_devs; i++) {
+        vnet_devs[i] = mini2440_vnet_create(!nr_pairs);
+        if (!vnet_devs[i]) {
+            ret = -ENOMEM;
+            goto error_create;
+        }
+    }
+
+    /* Link the peers, a lone device is its own peer */
+    for (i = 0; i < vnet_nr_devs; i++) {
+        priv = netdev_priv(vnet_devs[i]);
+        priv->peer = nr_pairs ? vnet_devs[i ^ 1] : vnet_devs[i];
+    }
 
 	/* 
-	 *  3. Register mini2440_vnet
-	 *  DONOT use register_netdevice(mini2440_vnet) since this function does not do 
+	 *  4. Register the devices
+	 *  DONOT use register_netdevice() since this function does not do 
 	 *  rtnl_lock().
 	 */
-	register_netdev(mini2440_vnet);
+    for (registered = 0; registered < vnet_nr_devs; registered++) {
+        ret = register_netdev(vnet_devs[registered]);
+        if (ret)
+            goto error_register;
+    }
     
     return 0;
+
+error_register:
+    while (registered--)
+        unregister_netdev(vnet_devs[registered]);
+    i = vnet_nr_devs;
+error_create:
+    while (i--)
+        if (vnet_devs[i])
+            mini2440_vnet_destroy(vnet_devs[i]);
+    kfree(vnet_devs);
+    kmem_cache_destroy(vnet_queue_cache);
+    return ret;
 }
 
 static void __exit mini2440_vnet_exit(void)
 {
-	unregister_netdev(mini2440_vnet);
-	free_netdev(mini2440_vnet);
+    int i;
+
+    /* Both ends of every pair have to be gone before any is freed */
+    for (i = 0; i < vnet_nr_devs; i++)
+	    unregister_netdev(vnet_devs[i]);
+    for (i = 0; i < vnet_nr_devs; i++)
+        mini2440_vnet_destroy(vnet_devs[i]);
+    kfree(vnet_devs);
+    kmem_cache_destroy(vnet_queue_cache);
 }
 
 module_init(mini2440_vnet_init);
 module_exit(mini2440_vnet_exit);
-
@@ -10,13 +10,31 @@
 #include <linux/platform_device.h>
 #include <linux/clk.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include <asm/io.h>
 #include <asm/irq.h>
 
 #include <plat/regs-adc.h>
 #include <mach/regs-gpio.h>
 
-#define AVG_TS(a, b, c, d)         (((a) + (b) + (c) + (d)) / 4)
+#define TS_MAX_SAMPLES      16
+#define TS_UPDOWN_DELAY     0xFFFF      /* ADCDLY while waiting for stylus up/down */
+#define TS_DELAY_CLK_MHZ    12          /* ADCDLY counts X-tal clocks in normal conversion */
+#define TS_CONVERT_US       10          /* X/Y pair, 2 x 5 ADC clocks at PCLK/50 */
+#define TS_POLL_MAX_US      500         /* poll_batch: longest batch spun with irqs off */
+
+/* Filter pipeline stages, run in this order on every batch of samples */
+#define TS_FILTER_AVERAGE   (1<<0)      /* mean, rejected when samples spread more than err_limit */
+#define TS_FILTER_MEDIAN    (1<<1)      /* median, takes precedence over average */
+#define TS_FILTER_IIR       (1<<2)      /* first order low pass across reports */
+#define TS_FILTER_DEJITTER  (1<<3)      /* no report for moves below dejitter */
+
+static const char *ts_filter_names[] = { "average", "median", "iir", "dejitter" };
 
 struct s3c_ts_regs {
     unsigned long ADCCON;
@@ -31,7 +49,202 @@ static struct input_dev *s3c_ts_dev;
 
 static volatile struct s3c_ts_regs *s3c_ts_regs;
 
-static struct timer_list ts_timer;
+static struct hrtimer ts_timer;
+
+/* Tunables, /sys/class/input/inputN/ */
+static int ts_samples       = 4;        /* conversions per report */
+static int ts_report_hz     = 200;      /* reports per second while the stylus is down */
+static int ts_filters       = TS_FILTER_MEDIAN | TS_FILTER_IIR | TS_FILTER_DEJITTER;
+static int ts_err_limit     = 10;       /* average: max spread, 0: no check */
+static int ts_iir_coeff     = 128;      /* iir: weight of the previous output, out of 256 */
+static int ts_dejitter      = 2;        /* dejitter: min move in ADC units */
+static int ts_settle_delay  = 1000;     /* ADCDLY while converting */
+static int ts_poll_batch    = 0;        /* 0: one IRQ_ADC per sample, 1: poll short batches */
+
+/* Sampling and filter state, all under ts_lock */
+static DEFINE_SPINLOCK(ts_lock);
+static long int ts_x[TS_MAX_SAMPLES], ts_y[TS_MAX_SAMPLES];
+static int ts_cnt;
+static int ts_adc_busy;                 /* a conversion of the IRQ chain is running */
+static int ts_down;                     /* BTN_TOUCH 1 has been reported */
+static long int ts_out_x, ts_out_y;     /* last reported position */
+static long int ts_iir_x, ts_iir_y;     /* iir state, 8 fractional bits */
+
+static unsigned long ts_nr_irqs;
+static unsigned long ts_nr_samples;
+static unsigned long ts_nr_reports;
+static unsigned long ts_nr_rejected;
+static unsigned long ts_nr_suppressed;
+
+
+/*  
+ *  Latency trace, /sys/kernel/debug/s3c_ts/{trace,histograms,reset}
+ *  Comment out S3C_TS_TRACE to compile every hook away.
+ */
+#define S3C_TS_TRACE
+#ifndef CONFIG_DEBUG_FS
+#undef S3C_TS_TRACE
+#endif
+
+#ifdef S3C_TS_TRACE
+
+#define TS_TRACE_SIZE       256         /* records, power of 2 */
+#define TS_HIST_BUCKETS     20          /* log2 us, the last one takes everything above */
+
+enum {
+    TS_SRC_PENDOWN,                     /* IRQ_TC, stylus down */
+    TS_SRC_TIMER,                       /* report period */
+};
+
+enum {
+    TS_END_REPORTED,
+    TS_END_REJECTED,                    /* average: samples spread too far */
+    TS_END_SUPPRESSED,                  /* dejitter: no move */
+    TS_END_UP,                          /* stylus went up during the batch */
+};
+
+enum {
+    TS_HIST_IRQ_TO_ADC,                 /* IRQ/timer to the first conversion */
+    TS_HIST_ADC_TO_ADC,                 /* between conversions of a batch */
+    TS_HIST_ADC_TO_FILTER,              /* last conversion to the filter decision */
+    TS_HIST_FILTER_TO_SYNC,             /* filter decision to input_sync */
+    TS_HIST_IRQ_TO_SYNC,                /* the whole report */
+    TS_HIST_TIMER_LATE,                 /* hrtimer expiry to its callback */
+    TS_NR_HISTS,
+};
+
+static const char *ts_src_names[] = { "pendown", "timer" };
+static const char *ts_end_names[] = { "reported", "rejected", "suppressed", "up" };
+static const char *ts_hist_names[] = {
+    "irq_to_adc", "adc_to_adc", "adc_to_filter", "filter_to_sync", "irq_to_sync", "timer_late",
+};
+
+/* One report, times in ns after start */
+struct s3c_ts_trace_rec {
+    u64 start;
+    u32 adc[TS_MAX_SAMPLES];
+    u32 filter;
+    u32 sync;
+    u8 src;
+    u8 nr_adc;
+    u8 end;
+};
+
+struct s3c_ts_hist {
+    unsigned long count;
+    u32 min_ns, max_ns;
+    u64 sum_ns;
+    unsigned long bucket[TS_HIST_BUCKETS];
+};
+
+/*  
+ *  Every writer runs under ts_lock, so the ring has one producer at a time. 
+ *  Readers take no lock: they copy the slots and then drop every record the 
+ *  producer may have overwritten meanwhile, see s3c_ts_trace_show().
+ */
+static struct s3c_ts_trace_rec ts_trace[TS_TRACE_SIZE];
+static unsigned long ts_trace_head;     /* records ever written */
+static struct s3c_ts_trace_rec ts_trace_cur;
+static int ts_trace_active;
+static struct s3c_ts_hist ts_hist[TS_NR_HISTS];
+static struct dentry *ts_debugfs;
+
+static void s3c_ts_hist_add(int h, u32 ns)
+{
+    struct s3c_ts_hist *hist = &ts_hist[h];
+    int b = fls(ns / 1000);
+
+    if (b >= TS_HIST_BUCKETS)
+        b = TS_HIST_BUCKETS - 1;
+
+    if (!hist->count || ns < hist->min_ns)
+        hist->min_ns = ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+    hist->sum_ns += ns;
+    hist->count++;
+    hist->bucket[b]++;
+}
+
+static u32 s3c_ts_trace_now(void)
+{
+    return ktime_to_ns(ktime_get()) - ts_trace_cur.start;
+}
+
+static void s3c_ts_trace_start(int src)
+{
+    ts_trace_cur.start = ktime_to_ns(ktime_get());
+    ts_trace_cur.src = src;
+    ts_trace_cur.nr_adc = 0;
+    ts_trace_cur.filter = 0;
+    ts_trace_cur.sync = 0;
+    ts_trace_active = 1;
+}
+
+static void s3c_ts_trace_adc(void)
+{
+    struct s3c_ts_trace_rec *rec = &ts_trace_cur;
+
+    if (!ts_trace_active || rec->nr_adc >= TS_MAX_SAMPLES)
+        return;
+
+    rec->adc[rec->nr_adc] = s3c_ts_trace_now();
+    if (rec->nr_adc)
+        s3c_ts_hist_add(TS_HIST_ADC_TO_ADC, rec->adc[rec->nr_adc] - rec->adc[rec->nr_adc - 1]);
+    else
+        s3c_ts_hist_add(TS_HIST_IRQ_TO_ADC, rec->adc[0]);
+    rec->nr_adc++;
+}
+
+static void s3c_ts_trace_filter(void)
+{
+    struct s3c_ts_trace_rec *rec = &ts_trace_cur;
+
+    if (!ts_trace_active)
+        return;
+
+    rec->filter = s3c_ts_trace_now();
+    if (rec->nr_adc)
+        s3c_ts_hist_add(TS_HIST_ADC_TO_FILTER, rec->filter - rec->adc[rec->nr_adc - 1]);
+}
+
+static void s3c_ts_trace_end(int end)
+{
+    struct s3c_ts_trace_rec *rec = &ts_trace_cur;
+
+    if (!ts_trace_active)
+        return;
+    ts_trace_active = 0;
+
+    rec->end = end;
+    if (end == TS_END_REPORTED) {
+        rec->sync = s3c_ts_trace_now();
+        s3c_ts_hist_add(TS_HIST_FILTER_TO_SYNC, rec->sync - rec->filter);
+        s3c_ts_hist_add(TS_HIST_IRQ_TO_SYNC, rec->sync);
+    }
+
+    /* Publish the slot before the head that makes it visible */
+    ts_trace[ts_trace_head & (TS_TRACE_SIZE - 1)] = *rec;
+    smp_wmb();
+    ts_trace_head++;
+}
+
+static void s3c_ts_trace_timer(struct hrtimer *timer)
+{
+    s64 late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+
+    s3c_ts_hist_add(TS_HIST_TIMER_LATE, late > 0 ? late : 0);
+}
+
+#else
+
+static inline void s3c_ts_trace_start(int src) {}
+static inline void s3c_ts_trace_adc(void) {}
+static inline void s3c_ts_trace_filter(void) {}
+static inline void s3c_ts_trace_end(int end) {}
+static inline void s3c_ts_trace_timer(struct hrtimer *timer) {}
+
+#endif
 
 
 static void wait4IntMode_Down(void)
@@ -58,59 +271,251 @@ static void start_adc(void)
 }
 
 
-static irqreturn_t stylus_updown(int irq, void *dev_id)
+static void s3c_ts_report_up(void)
 {
-    if(s3c_ts_regs->ADCDAT0 & (1<<15)) {
-        //printk("Stylus up\n");
-        input_report_key(s3c_ts_dev, BTN_TOUCH, 0);
-		input_report_abs(s3c_ts_dev, ABS_PRESSURE, 0);
-		input_sync(s3c_ts_dev);
-        wait4IntMode_Down();
+    s3c_ts_trace_end(TS_END_UP);
+
+    input_report_key(s3c_ts_dev, BTN_TOUCH, 0);
+    input_report_abs(s3c_ts_dev, ABS_PRESSURE, 0);
+    input_sync(s3c_ts_dev);
+
+    ts_down = 0;
+    ts_cnt = 0;
+    ts_adc_busy = 0;
+    s3c_ts_regs->ADCDLY = TS_UPDOWN_DELAY;
+    wait4IntMode_Down();
+}
+
+
+/*  
+ *  Extra: Optimization 4
+ *  Software filter, every sample must stay within err_limit of the mean 
+ *  of the two before it.
+ */
+static int s3c_filter_ts(long int x[], long int y[], int n)
+{
+    long int avg_x, avg_y, delta_x, delta_y;
+    int i;
+
+    for (i = 2; i < n; i++) {
+        avg_x = (x[i - 2] + x[i - 1]) / 2;
+        avg_y = (y[i - 2] + y[i - 1]) / 2;
+
+        delta_x = (x[i] > avg_x) ? (x[i] - avg_x) : (avg_x - x[i]);
+        delta_y = (y[i] > avg_y) ? (y[i] - avg_y) : (avg_y - y[i]);
+
+        if ((delta_x > ts_err_limit) || (delta_y > ts_err_limit))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int s3c_ts_cmp(const void *a, const void *b)
+{
+    return *(const long int *)a - *(const long int *)b;
+}
+
+static long int s3c_ts_median(long int v[], int n)
+{
+    long int tmp[TS_MAX_SAMPLES];
+
+    memcpy(tmp, v, n * sizeof(tmp[0]));
+    sort(tmp, n, sizeof(tmp[0]), s3c_ts_cmp, NULL);
+    return (n & 1) ? tmp[n / 2] : (tmp[n / 2 - 1] + tmp[n / 2]) / 2;
+}
+
+static long int s3c_ts_average(long int v[], int n)
+{
+    long int sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        sum += v[i];
+    return sum / n;
+}
+
+/* Run the pipeline over a full batch and report the result as one frame */
+static void s3c_ts_process(void)
+{
+    long int x, y;
+    int n = ts_cnt;
+
+    ts_cnt = 0;
+
+    if (ts_filters & TS_FILTER_MEDIAN) {
+        x = s3c_ts_median(ts_x, n);
+        y = s3c_ts_median(ts_y, n);
     }else {
-        //printk("Stylus down\n");
-        //wait4IntMode_Up();
-        measure_xy_mode();
-        start_adc();
+        if ((ts_filters & TS_FILTER_AVERAGE) && ts_err_limit && !s3c_filter_ts(ts_x, ts_y, n)) {
+            ts_nr_rejected++;
+            s3c_ts_trace_filter();
+            s3c_ts_trace_end(TS_END_REJECTED);
+            return;
+        }
+        x = s3c_ts_average(ts_x, n);
+        y = s3c_ts_average(ts_y, n);
     }
-    
-	return IRQ_HANDLED;    
+
+    /* The first report of a touch goes out unfiltered, no lag on touch down */
+    if (ts_filters & TS_FILTER_IIR) {
+        if (ts_down) {
+            ts_iir_x = (ts_iir_x * ts_iir_coeff + (x << 8) * (256 - ts_iir_coeff)) >> 8;
+            ts_iir_y = (ts_iir_y * ts_iir_coeff + (y << 8) * (256 - ts_iir_coeff)) >> 8;
+        }else {
+            ts_iir_x = x << 8;
+            ts_iir_y = y << 8;
+        }
+        x = (ts_iir_x + 128) >> 8;
+        y = (ts_iir_y + 128) >> 8;
+    }
+
+    s3c_ts_trace_filter();
+
+    if ((ts_filters & TS_FILTER_DEJITTER) && ts_down &&
+        abs(x - ts_out_x) < ts_dejitter && abs(y - ts_out_y) < ts_dejitter) {
+        ts_nr_suppressed++;
+        s3c_ts_trace_end(TS_END_SUPPRESSED);
+        return;
+    }
+
+    /* One frame: position, touch and pressure, then a single sync */
+    input_report_abs(s3c_ts_dev, ABS_X, x);
+    input_report_abs(s3c_ts_dev, ABS_Y, y);
+    input_report_key(s3c_ts_dev, BTN_TOUCH, 1);
+    input_report_abs(s3c_ts_dev, ABS_PRESSURE, 1);
+    input_sync(s3c_ts_dev);
+    s3c_ts_trace_end(TS_END_REPORTED);
+
+    ts_down = 1;
+    ts_out_x = x;
+    ts_out_y = y;
+    ts_nr_reports++;
 }
 
+/*  
+ *  Next report period. ts_timer's expiry is the start of the current period 
+ *  (the pen down or the last expiry), so forwarding it keeps report_hz no 
+ *  matter how long the batch took.
+ */
+static void s3c_ts_rearm(void)
+{
+    if (hrtimer_is_queued(&ts_timer))
+        return;
+
+    hrtimer_forward(&ts_timer, ktime_get(), ktime_set(0, NSEC_PER_SEC / ts_report_hz));
+    hrtimer_start_expires(&ts_timer, HRTIMER_MODE_ABS);
+}
 
-static int s3c_filter_ts(long int x[], long int y[])
+/* Batch done: wait for the stylus up interrupt and the next report period */
+static void s3c_ts_batch_done(void)
 {
-#define ERR_LIMIT 10
+    s3c_ts_process();
 
-    int avg_x, avg_y, delta_x, delta_y;
-    
-    avg_x = (x[0] + x[1]) / 2;
-    avg_y = (y[0] + y[1]) / 2;
+    s3c_ts_regs->ADCDLY = TS_UPDOWN_DELAY;
+    wait4IntMode_Up();
+
+    /* Extra: Optimization 5(Timer), follow the slither at report_hz */
+    s3c_ts_rearm();
+}
+
+/*  
+ *  Convert one X/Y pair by polling ADCCON[15] ECFLG. IRQ_ADC still latches 
+ *  once, s3c_ts_action() drops it since no chained conversion is running.
+ *  Returns 0, or 1 when the stylus went up.
+ */
+static int s3c_ts_convert(long int *x, long int *y)
+{
+    unsigned long adcdat0;
+    int timeout = ts_settle_delay + 100;  /* us, the delay clock is >= 1MHz */
+
+    measure_xy_mode();
+    start_adc();
+    while (s3c_ts_regs->ADCCON & (1<<0))
+        ;
+    while (!(s3c_ts_regs->ADCCON & (1<<15))) {
+        if (--timeout < 0)
+            return 1;
+        udelay(1);
+    }
 
-    delta_x = (x[2] > avg_x) ? (x[2] - avg_x) : (avg_x - x[2]);
-    delta_y = (y[2] > avg_y) ? (y[2] - avg_y) : (avg_y - y[2]);
+    adcdat0 = s3c_ts_regs->ADCDAT0;
+    *x = adcdat0 & 0x3FF;
+    *y = s3c_ts_regs->ADCDAT1 & 0x3FF;
+    ts_nr_samples++;
+    s3c_ts_trace_adc();
 
-    if ((delta_x > ERR_LIMIT) || (delta_y > ERR_LIMIT))
-        return 0;
+    return (adcdat0 & (1<<15)) ? 1 : 0;
+}
 
-    avg_x = (x[1] + x[2]) / 2;
-    avg_y = (y[1] + y[2]) / 2;
+/*  
+ *  Start a batch of ts_samples conversions, called with ts_lock held. 
+ *  Polling spins in hard irq context with interrupts off, so it is only 
+ *  used while the whole batch fits in TS_POLL_MAX_US, longer ones go 
+ *  through the IRQ_ADC chain.
+ */
+static void s3c_ts_start_batch(void)
+{
+    int batch_us = ts_samples * (ts_settle_delay / TS_DELAY_CLK_MHZ + TS_CONVERT_US);
 
-    delta_x = (x[3] > avg_x) ? (x[3] - avg_x) : (avg_x - x[3]);
-    delta_y = (y[3] > avg_y) ? (y[3] - avg_y) : (avg_y - y[3]);
+    ts_cnt = 0;
+    s3c_ts_regs->ADCDLY = ts_settle_delay;
 
-    if ((delta_x > ERR_LIMIT) || (delta_y > ERR_LIMIT))
-        return 0;
+    if (!ts_poll_batch || batch_us > TS_POLL_MAX_US) {
+        ts_adc_busy = 1;
+        measure_xy_mode();
+        start_adc();
+        return;
+    }
 
-    return 1;
+    while (ts_cnt < ts_samples) {
+        if (s3c_ts_convert(&ts_x[ts_cnt], &ts_y[ts_cnt])) {
+            s3c_ts_report_up();
+            return;
+        }
+        ts_cnt++;
+    }
+
+    s3c_ts_batch_done();
+}
+
+
+static irqreturn_t stylus_updown(int irq, void *dev_id)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&ts_lock, flags);
+
+    if(s3c_ts_regs->ADCDAT0 & (1<<15)) {
+        //printk("Stylus up\n");
+        hrtimer_try_to_cancel(&ts_timer);
+        s3c_ts_report_up();
+    }else if (!ts_adc_busy) {
+        //printk("Stylus down\n");
+        s3c_ts_trace_start(TS_SRC_PENDOWN);
+        if (!hrtimer_is_queued(&ts_timer))
+            hrtimer_set_expires(&ts_timer, ktime_get());    /* first period starts now */
+        s3c_ts_start_batch();
+    }
+
+    spin_unlock_irqrestore(&ts_lock, flags);
+	return IRQ_HANDLED;    
 }
 
 
 static irqreturn_t stylus_action(int irq, void *dev_id)
 {
-    static int cnt = 0;
     long int adcdat0, adcdat1;
-    static long int x[4], y[4];
+    unsigned long flags;
     
+    spin_lock_irqsave(&ts_lock, flags);
+    ts_nr_irqs++;
+
+    /* Left over from a polled batch, nothing to do */
+    if (!ts_adc_busy)
+        goto out;
+    ts_adc_busy = 0;
+
     /* 
      *  Extra: Optimization 2 
      *  After the ADC interrupt is finished, if the stylus is up, then discards this results
@@ -118,70 +523,320 @@ static irqreturn_t stylus_action(int irq, void *dev_id)
     adcdat0 = s3c_ts_regs->ADCDAT0;
     adcdat1 = s3c_ts_regs->ADCDAT1;
 
-    if(s3c_ts_regs->ADCDAT0 & (1<<15)) {
+    if(adcdat0 & (1<<15)) {
         /* Stylus is already up */
-        cnt = 0;
-        input_report_key(s3c_ts_dev, BTN_TOUCH, 0);
-		input_report_abs(s3c_ts_dev, ABS_PRESSURE, 0);
-		input_sync(s3c_ts_dev);
-        wait4IntMode_Down();
+        s3c_ts_report_up();
+        goto out;
+    }
+
+    /* 
+     *  Extra: Optimization 3 
+     *  Measure many times and filter the results
+     */
+    ts_x[ts_cnt] = adcdat0 & 0x3FF;
+    ts_y[ts_cnt] = adcdat1 & 0x3FF;
+    ts_nr_samples++;
+    s3c_ts_trace_adc();
+
+    if (++ts_cnt >= ts_samples) {
+        s3c_ts_batch_done();
     }else {
-        //printk("stylus_action cnt = %d, (x,y) = (%ld,%ld)\n", ++cnt, adcdat0 & 0x3FF, adcdat1 & 0x3FF);
-
-        /* 
-         *  Extra: Optimization 3 
-         *  Measure many times and calculate the average value
-         */
-        x[cnt] = adcdat0 & 0x3FF;
-        y[cnt] = adcdat1 & 0x3FF;
-        ++cnt;
-        if(4 == cnt) {
-            /*  
-             *  Extra: Optimization 4
-             *  Software filter
-             */
-            if(s3c_filter_ts(x, y)) {
-                //printk("(x,y) = (%ld,%ld)\n", AVG_TS(x[0],x[1],x[2],x[3]), AVG_TS(y[0],y[1],y[2],y[3]));  
-                input_report_abs(s3c_ts_dev, ABS_X, AVG_TS(x[0],x[1],x[2],x[3]));
-                input_report_abs(s3c_ts_dev, ABS_Y, AVG_TS(y[0],y[1],y[2],y[3]));
-
-                input_report_key(s3c_ts_dev, BTN_TOUCH, 1);
-     			input_report_abs(s3c_ts_dev, ABS_PRESSURE, 1);
- 	    		input_sync(s3c_ts_dev);
-            }
-            cnt = 0;
-            wait4IntMode_Up();
-
-            /* Start timer for handling the slither */
-            mod_timer(&ts_timer, jiffies + HZ/100);  /* HZ/100 = 10ms since HZ = 1s */
-            
-        }else {            
-            measure_xy_mode();
-            start_adc();
-        }
+        ts_adc_busy = 1;
+        measure_xy_mode();
+        start_adc();
     }
 
+out:
+    spin_unlock_irqrestore(&ts_lock, flags);
     return IRQ_HANDLED;
 }
 
 
-static void s3c_ts_timer_function(unsigned long data)
+static enum hrtimer_restart s3c_ts_timer_function(struct hrtimer *timer)
 {
+    unsigned long flags;
+
+    spin_lock_irqsave(&ts_lock, flags);
+    s3c_ts_trace_timer(timer);
+
     if(s3c_ts_regs->ADCDAT0 & (1<<15)) {
         /* Stylus is up */
-        input_report_key(s3c_ts_dev, BTN_TOUCH, 0);
-		input_report_abs(s3c_ts_dev, ABS_PRESSURE, 0);
-		input_sync(s3c_ts_dev);
-
-        wait4IntMode_Down();
-    }else {
+        s3c_ts_report_up();
+    }else if (!ts_adc_busy) {
         /* Measure X/Y axis values */
-        measure_xy_mode();
-        start_adc();
+        s3c_ts_trace_start(TS_SRC_TIMER);
+        s3c_ts_start_batch();
     }
+
+    spin_unlock_irqrestore(&ts_lock, flags);
+    return HRTIMER_NORESTART;
 }
 
 
+/*  
+ *  sysfs: every tunable is an integer attribute with its own range, 
+ *  "filter" takes stage names and "stats" is read only.
+ */
+struct s3c_ts_param {
+    struct device_attribute attr;
+    int *val;
+    int min, max;
+};
+
+static ssize_t s3c_ts_param_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct s3c_ts_param *param = container_of(attr, struct s3c_ts_param, attr);
+
+    return snprintf(buf, PAGE_SIZE, "%d\n", *param->val);
+}
+
+static ssize_t s3c_ts_param_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t len)
+{
+    struct s3c_ts_param *param = container_of(attr, struct s3c_ts_param, attr);
+    unsigned long flags;
+    long val;
+
+    if (strict_strtol(buf, 0, &val) || val < param->min || val > param->max)
+        return -EINVAL;
+
+    /* Takes effect with the next batch */
+    spin_lock_irqsave(&ts_lock, flags);
+    *param->val = val;
+    spin_unlock_irqrestore(&ts_lock, flags);
+
+    return len;
+}
+
+#define TS_PARAM(_name, _var, _min, _max)                                           \
+    static struct s3c_ts_param ts_param_##_name = {                                 \
+        .attr   = __ATTR(_name, S_IRUGO | S_IWUSR, s3c_ts_param_show, s3c_ts_param_store), \
+        .val    = &_var,                                                            \
+        .min    = _min,                                                             \
+        .max    = _max,                                                             \
+    }
+
+TS_PARAM(samples,       ts_samples,         1,  TS_MAX_SAMPLES);
+TS_PARAM(report_hz,     ts_report_hz,       10, 1000);
+TS_PARAM(err_limit,     ts_err_limit,       0,  0x3FF);
+TS_PARAM(iir_coeff,     ts_iir_coeff,       0,  255);
+TS_PARAM(dejitter,      ts_dejitter,        0,  0x3FF);
+TS_PARAM(settle_delay,  ts_settle_delay,    1,  0xFFFF);
+TS_PARAM(poll_batch,    ts_poll_batch,      0,  1);
+
+static ssize_t s3c_ts_filter_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    int i, len = 0;
+
+    for (i = 0; i < ARRAY_SIZE(ts_filter_names); i++)
+        if (ts_filters & (1<<i))
+            len += snprintf(buf + len, PAGE_SIZE - len, "%s ", ts_filter_names[i]);
+
+    if (!len)
+        return snprintf(buf, PAGE_SIZE, "none\n");
+    buf[len - 1] = '\n';
+    return len;
+}
+
+/* e.g. echo "median iir" > filter, "none" or an empty line turns everything off */
+static ssize_t s3c_ts_filter_store(struct device *dev, struct device_attribute *attr,
+                                   const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    unsigned long flags;
+    int i, n, filters = 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',' || *p == '\n'))
+            p++;
+        for (n = 0; p + n < end && p[n] != ' ' && p[n] != ',' && p[n] != '\n'; n++)
+            ;
+        if (!n)
+            break;
+
+        for (i = 0; i < ARRAY_SIZE(ts_filter_names); i++)
+            if (strlen(ts_filter_names[i]) == n && !strncmp(p, ts_filter_names[i], n))
+                break;
+        if (i < ARRAY_SIZE(ts_filter_names))
+            filters |= 1<<i;
+        else if (n != 4 || strncmp(p, "none", 4))
+            return -EINVAL;
+        p += n;
+    }
+
+    spin_lock_irqsave(&ts_lock, flags);
+    ts_filters = filters;
+    spin_unlock_irqrestore(&ts_lock, flags);
+
+    return len;
+}
+
+static ssize_t s3c_ts_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return snprintf(buf, PAGE_SIZE,
+        "adc_irqs %lu\nsamples %lu\nreports %lu\nrejected %lu\nsuppressed %lu\n",
+        ts_nr_irqs, ts_nr_samples, ts_nr_reports, ts_nr_rejected, ts_nr_suppressed);
+}
+
+static DEVICE_ATTR(filter, S_IRUGO | S_IWUSR, s3c_ts_filter_show, s3c_ts_filter_store);
+static DEVICE_ATTR(stats, S_IRUGO, s3c_ts_stats_show, NULL);
+
+static struct attribute *s3c_ts_attrs[] = {
+    &ts_param_samples.attr.attr,
+    &ts_param_report_hz.attr.attr,
+    &ts_param_err_limit.attr.attr,
+    &ts_param_iir_coeff.attr.attr,
+    &ts_param_dejitter.attr.attr,
+    &ts_param_settle_delay.attr.attr,
+    &ts_param_poll_batch.attr.attr,
+    &dev_attr_filter.attr,
+    &dev_attr_stats.attr,
+    NULL,
+};
+
+static struct attribute_group s3c_ts_attr_group = {
+    .attrs = s3c_ts_attrs,
+};
+
+
+#ifdef S3C_TS_TRACE
+
+/* Newest TS_TRACE_SIZE reports, oldest first; ns offsets printed in us */
+static int s3c_ts_trace_show(struct seq_file *m, void *v)
+{
+    struct s3c_ts_trace_rec *snap, *rec;
+    unsigned long head, first, seq;
+    int i;
+
+    snap = kmalloc(sizeof(ts_trace), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+
+    head = ACCESS_ONCE(ts_trace_head);
+    smp_rmb();
+    first = head > TS_TRACE_SIZE ? head - TS_TRACE_SIZE : 0;
+    for (seq = first; seq < head; seq++)
+        snap[seq & (TS_TRACE_SIZE - 1)] = ts_trace[seq & (TS_TRACE_SIZE - 1)];
+    smp_rmb();
+
+    /*  The producer may have rewritten every slot up to the current head, 
+     *  including the one it is filling now. Drop those.
+     */
+    if (ACCESS_ONCE(ts_trace_head) + 1 > first + TS_TRACE_SIZE)
+        first = ts_trace_head + 1 - TS_TRACE_SIZE;
+
+    seq_printf(m, "# seq src start_us adc_us... filter_us sync_us end\n");
+    for (seq = first; seq < head; seq++) {
+        rec = &snap[seq & (TS_TRACE_SIZE - 1)];
+        seq_printf(m, "%lu %s %llu", seq, ts_src_names[rec->src],
+            (unsigned long long)div_u64(rec->start, 1000));
+        for (i = 0; i < rec->nr_adc; i++)
+            seq_printf(m, " %u", rec->adc[i] / 1000);
+        seq_printf(m, " %u %u %s\n", rec->filter / 1000, rec->sync / 1000, ts_end_names[rec->end]);
+    }
+
+    kfree(snap);
+    return 0;
+}
+
+static int s3c_ts_hist_show(struct seq_file *m, void *v)
+{
+    struct s3c_ts_hist hist;
+    unsigned long flags;
+    int h, b;
+
+    for (h = 0; h < TS_NR_HISTS; h++) {
+        spin_lock_irqsave(&ts_lock, flags);
+        hist = ts_hist[h];
+        spin_unlock_irqrestore(&ts_lock, flags);
+
+        seq_printf(m, "%s: count %lu", ts_hist_names[h], hist.count);
+        if (hist.count)
+            seq_printf(m, " min %u avg %llu max %u us", hist.min_ns / 1000,
+                (unsigned long long)div_u64(hist.sum_ns, hist.count) / 1000, hist.max_ns / 1000);
+        seq_printf(m, "\n");
+
+        for (b = 0; b < TS_HIST_BUCKETS; b++)
+            if (hist.bucket[b])
+                seq_printf(m, "  %s%7u us %lu\n", b == TS_HIST_BUCKETS - 1 ? ">=" : "< ",
+                    b == TS_HIST_BUCKETS - 1 ? 1U << (b - 1) : 1U << b, hist.bucket[b]);
+    }
+
+    return 0;
+}
+
+static int s3c_ts_trace_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, s3c_ts_trace_show, NULL);
+}
+
+static int s3c_ts_hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, s3c_ts_hist_show, NULL);
+}
+
+/* Any write clears the histograms and the trace */
+static ssize_t s3c_ts_reset_write(struct file *file, const char __user *buf,
+                                  size_t len, loff_t *ppos)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&ts_lock, flags);
+    memset(ts_hist, 0, sizeof(ts_hist));
+    ts_trace_head = 0;
+    ts_trace_active = 0;
+    spin_unlock_irqrestore(&ts_lock, flags);
+
+    return len;
+}
+
+static const struct file_operations s3c_ts_trace_fops = {
+    .owner      = THIS_MODULE,
+    .open       = s3c_ts_trace_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static const struct file_operations s3c_ts_hist_fops = {
+    .owner      = THIS_MODULE,
+    .open       = s3c_ts_hist_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static const struct file_operations s3c_ts_reset_fops = {
+    .owner      = THIS_MODULE,
+    .write      = s3c_ts_reset_write,
+};
+
+static void s3c_ts_debugfs_init(void)
+{
+    ts_debugfs = debugfs_create_dir("s3c_ts", NULL);
+    if (IS_ERR_OR_NULL(ts_debugfs)) {
+        ts_debugfs = NULL;
+        return;
+    }
+
+    debugfs_create_file("trace", S_IRUGO, ts_debugfs, NULL, &s3c_ts_trace_fops);
+    debugfs_create_file("histograms", S_IRUGO, ts_debugfs, NULL, &s3c_ts_hist_fops);
+    debugfs_create_file("reset", S_IWUSR, ts_debugfs, NULL, &s3c_ts_reset_fops);
+}
+
+static void s3c_ts_debugfs_exit(void)
+{
+    debugfs_remove_recursive(ts_debugfs);
+}
+
+#else
+
+static inline void s3c_ts_debugfs_init(void) {}
+static inline void s3c_ts_debugfs_exit(void) {}
+
+#endif
+
+
 static int s3c_ts_init(void)
 {
 	struct clk *adc_clock;
@@ -234,43 +889,56 @@ static int s3c_ts_init(void)
      */    
     s3c_ts_regs->ADCCON = (1<<14) | (49<<6);
 
+    /* Extra: Optimization 5(Timer), set up before the IRQs, stylus_updown() uses it */
+    hrtimer_init(&ts_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ts_timer.function = s3c_ts_timer_function;
+
     /* Register IRQ */
 //	if (request_irq(IRQ_ADC, stylus_action, IRQF_SHARED|IRQF_SAMPLE_RANDOM, "s3c_action", NULL)) { /* not work by adding IRQF_SHARED */
 	if (request_irq(IRQ_ADC, stylus_action, IRQF_SAMPLE_RANDOM, "s3c_action", NULL)) {
         printk(KERN_ERR "s3c_ts.c: Could not allocate ts IRQ_ADC !\n");
-    	iounmap(s3c_ts_regs);
-    	return -EIO;
+        goto fail_adc;
 	}
 
     if (request_irq(IRQ_TC, stylus_updown, IRQF_SAMPLE_RANDOM, "s3c_action", NULL)) {
 		printk(KERN_ERR "s3c_ts.c: Could not allocate ts IRQ_TC !\n");
-		iounmap(s3c_ts_regs);
-		return -EIO;
+        goto fail_tc;
 	}
 
+    /*  Filter pipeline tunables and the trace, only once nothing can fail:
+     *  a failed load must not leave files behind that call into the module.
+     */
+    if (sysfs_create_group(&s3c_ts_dev->dev.kobj, &s3c_ts_attr_group))
+        printk(KERN_ERR "s3c_ts.c: Could not create the sysfs attributes !\n");
+    s3c_ts_debugfs_init();
+
     /* 
      *  Extra: Optimization 1 
      *  Setup the ADCDLY register to the max value so that the IRQ_TC interrupt is triggered after
      *  the power is stabilized.
      */
-    s3c_ts_regs->ADCDLY = 0xFFFF;
-
-    /* Extra: Optimization 5(Timer) */
-    init_timer(&ts_timer);
-    ts_timer.function = s3c_ts_timer_function;
-    add_timer(&ts_timer);
+    s3c_ts_regs->ADCDLY = TS_UPDOWN_DELAY;
     
     wait4IntMode_Down();
     
     return 0;
+
+fail_tc:
+    free_irq(IRQ_ADC, NULL);
+fail_adc:
+    iounmap(s3c_ts_regs);
+    input_unregister_device(s3c_ts_dev);
+    return -EIO;
 }
 
 static void s3c_ts_exit(void)
 {
-    del_timer(&ts_timer);
     free_irq(IRQ_TC, NULL);
     free_irq(IRQ_ADC, NULL);
+    hrtimer_cancel(&ts_timer);
+    s3c_ts_debugfs_exit();
     iounmap(s3c_ts_regs);
+    sysfs_remove_group(&s3c_ts_dev->dev.kobj, &s3c_ts_attr_group);
     input_unregister_device(s3c_ts_dev);
     input_free_device(s3c_ts_dev);
 }
@@ -19,62 +19,109 @@
 #define DRIVER_DESC "USB mouse as key_button driver"
 
 
-static struct input_dev *usbmouse_key_dev;
-static char *usb_buffer;
-static dma_addr_t usb_buffer_phys;
-static struct urb *usbmouse_key_urb;
+/* Interrupt URBs kept in flight per mouse, 1 is the old single URB */
+static int nr_urbs = 4;
+module_param(nr_urbs, int, S_IRUGO);
 
-static int len;
+#define MAX_URBS    16
+
+
+/* One per mouse, so several of them can be plugged in at once */
+struct usbmouse_key {
+    struct usb_device *udev;
+    struct input_dev *input;
+    char phys[64];
+
+    int nr_urbs;
+    int len;
+    struct urb *urbs[MAX_URBS];
+    unsigned char *bufs[MAX_URBS];
+    dma_addr_t bufs_phys[MAX_URBS];
+
+    spinlock_t lock;                /* prev_val, completions of the URBs */
+    unsigned char prev_val;
+    unsigned long reports;
+    unsigned long changes;
+};
 
 
 static void usbmouse_as_key_irq(struct urb *urb)
 {
-    static unsigned char prev_val;
-#if 0
-    int i;
-    static int cnt = 0;
-    printk("cnt = %d: ", ++cnt);
-    for (i = 0; i < len; ++i)
-        printk("%02x ", usb_buffer[i]);
-    printk("\n");
-#endif
+    struct usbmouse_key *mk = urb->context;
+    unsigned char *data = urb->transfer_buffer;
+    unsigned char changed;
+    int status;
+
+    switch (urb->status) {
+    case 0:
+        break;
+    case -ECONNRESET:               /* unlinked, disconnect or rmmod */
+    case -ENOENT:
+    case -ESHUTDOWN:
+        return;
+    default:                        /* error, poll again */
+        goto resubmit;
+    }
+
     /* The meanings of data */
     /*
      * data[0]  bit0 - left_key,      1 - pressed, 0 - released
      *          bit1 - right_key,     1 - pressed, 0 - released   
      *          bit2 - middle_key,    1 - pressed, 0 - released   
      *
+     * With several URBs in flight the reports still complete in order, 
+     * the lock only keeps prev_val consistent.
      */
-    if ( (prev_val & (1<<0)) != (usb_buffer[0] & (1<<0)) ) {
-        input_event(usbmouse_key_dev, EV_KEY, KEY_L, ((usb_buffer[0] & (1<<0)) ? 1 : 0));
-        input_sync(usbmouse_key_dev);
+    spin_lock(&mk->lock);
+    mk->reports++;
+
+    changed = (mk->prev_val ^ data[0]) & 0x07;
+    if (changed) {
+        if (changed & (1<<0))
+            input_event(mk->input, EV_KEY, KEY_L, (data[0] & (1<<0)) ? 1 : 0);
+        if (changed & (1<<1))
+            input_event(mk->input, EV_KEY, KEY_S, (data[0] & (1<<1)) ? 1 : 0);
+        if (changed & (1<<2))
+            input_event(mk->input, EV_KEY, KEY_ENTER, (data[0] & (1<<2)) ? 1 : 0);
+
+        /* All changes of one report in one frame */
+        input_sync(mk->input);
+        mk->changes++;
     }
 
-    if ( (prev_val & (1<<1)) != (usb_buffer[0] & (1<<1)) ) {
-        input_event(usbmouse_key_dev, EV_KEY, KEY_S, ((usb_buffer[0] & (1<<1)) ? 1 : 0));
-        input_sync(usbmouse_key_dev);
-    }
+    mk->prev_val = data[0];   /* Record the previous value */
+    spin_unlock(&mk->lock);
+
+resubmit:
+    /* Re-submit urb, we are in interrupt context */
+    status = usb_submit_urb(urb, GFP_ATOMIC);
+    if (status)
+        dev_err(&mk->udev->dev, "can't resubmit intr, %s-%s/input0, status %d\n",
+            mk->udev->bus->bus_name, mk->udev->devpath, status);
+}
 
-    if ( (prev_val & (1<<2)) != (usb_buffer[0] & (1<<2)) ) {
-        input_event(usbmouse_key_dev, EV_KEY, KEY_ENTER, ((usb_buffer[0] & (1<<2)) ? 1 : 0));
-        input_sync(usbmouse_key_dev);
-    }
 
-    prev_val = usb_buffer[0];   /* Record the previous value */
+static void usbmouse_as_key_free_urbs(struct usbmouse_key *mk)
+{
+    int i;
 
-    /* Re-submit urb */
-    usb_submit_urb(usbmouse_key_urb, GFP_KERNEL);
+    for (i = 0; i < mk->nr_urbs; i++) {
+        usb_free_urb(mk->urbs[i]);
+        if (mk->bufs[i])
+            usb_free_coherent(mk->udev, mk->len, mk->bufs[i], mk->bufs_phys[i]);
+    }
 }
 
 
 static int usbmouse_as_key_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
-	struct usb_device *dev = interface_to_usbdev(intf);
-	struct usb_host_interface *interface;
-	struct usb_endpoint_descriptor *endpoint;
+	struct usb_device *dev = interface_to_usbdev(intf);
+	struct usb_host_interface *interface;
+	struct usb_endpoint_descriptor *endpoint;
+    struct usbmouse_key *mk;
 
     int error = -ENOMEM;
-    int pipe;
+    int pipe, i;
 
 //    printk("Invoking usbmouse_as_key_probe function....\n");
 
@@ -83,33 +130,42 @@ static int usbmouse_as_key_probe(struct usb_interface *intf, const struct usb_de
 //    printk("idProduct   = %x\n", dev->descriptor.idProduct);
 
 	interface = intf->cur_altsetting;
-
-	if (interface->desc.bNumEndpoints != 1)
-		return -ENODEV;
+
+	if (interface->desc.bNumEndpoints != 1)
+		return -ENODEV;
 
 	endpoint = &interface->endpoint[0].desc;
 
+    mk = kzalloc(sizeof(struct usbmouse_key), GFP_KERNEL);
+    if (!mk)
+        return -ENOMEM;
+    mk->udev = dev;
+    mk->nr_urbs = clamp(nr_urbs, 1, MAX_URBS);
+    spin_lock_init(&mk->lock);
+
     /*  1. Allocate an input_dev structure */
-    usbmouse_key_dev = input_allocate_device();
+    mk->input = input_allocate_device();
+    if (!mk->input)
+        goto fail_input;
     
     /*  2. Configure this input_dev structure */
+    usb_make_path(dev, mk->phys, sizeof(mk->phys));
+    strlcat(mk->phys, "/input0", sizeof(mk->phys));
+    mk->input->name = "usbmouse_as_key";
+    mk->input->phys = mk->phys;
+    usb_to_input_id(dev, &mk->input->id);
+    mk->input->dev.parent = &intf->dev;
+
     /*  2.1 Which event will occur */
-    set_bit(EV_KEY, usbmouse_key_dev->evbit);
-    set_bit(EV_REP, usbmouse_key_dev->evbit);
+    set_bit(EV_KEY, mk->input->evbit);
+    set_bit(EV_REP, mk->input->evbit);
 
     /*  2.2 In the specific event, which sub-event will occur */
-    set_bit(KEY_L, usbmouse_key_dev->keybit);
-    set_bit(KEY_S, usbmouse_key_dev->keybit);
-    set_bit(KEY_ENTER, usbmouse_key_dev->keybit);
-    
-    /*  3. Register */
-    error = input_register_device(usbmouse_key_dev);
-    if(error) {
-        input_free_device(usbmouse_key_dev);
-        return error;
-    }
+    set_bit(KEY_L, mk->input->keybit);
+    set_bit(KEY_S, mk->input->keybit);
+    set_bit(KEY_ENTER, mk->input->keybit);
     
-    /*  4. Hardware specific configurations */
+    /*  3. Hardware specific configurations */
     /*  Focusing on the 3 major key elements of data transfer 
      *  a) Source  b) Destination c) Length
      */
@@ -117,38 +173,76 @@ static int usbmouse_as_key_probe(struct usb_interface *intf, const struct usb_de
 	pipe = usb_rcvintpipe(dev, endpoint->bEndpointAddress);
 
     /* Length:  */
-    len = endpoint->wMaxPacketSize;
+    mk->len = endpoint->wMaxPacketSize;
 
-    /* Destination:  */
-	usb_buffer = usb_alloc_coherent(dev, len, GFP_ATOMIC, &usb_buffer_phys);
-
-    /* Use these 3 major key elements */
-    /* Allocate urb ( USB Request Block ) */
-	usbmouse_key_urb = usb_alloc_urb(0, GFP_KERNEL);    
+    /*  Destination: every URB owns its buffer, all allocated here so 
+     *  the completion path never allocates
+     */
+    for (i = 0; i < mk->nr_urbs; i++) {
+        mk->bufs[i] = usb_alloc_coherent(dev, mk->len, GFP_KERNEL, &mk->bufs_phys[i]);
+        mk->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!mk->bufs[i] || !mk->urbs[i])
+            goto fail_urbs;
+
+        /* Use these 3 major key elements, configure this urb */
+        usb_fill_int_urb(mk->urbs[i], dev, pipe, mk->bufs[i],
+                 (mk->len > 8 ? 8 : mk->len),
+                 usbmouse_as_key_irq, mk, endpoint->bInterval);
+        mk->urbs[i]->transfer_dma = mk->bufs_phys[i];
+        mk->urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    }
 
-    /* Use these 3 major key elements, configure this urb */
-	usb_fill_int_urb(usbmouse_key_urb, dev, pipe, usb_buffer,
-			 (len > 8 ? 8 : len),
-			 usbmouse_as_key_irq, NULL, endpoint->bInterval);
-	usbmouse_key_urb->transfer_dma = usb_buffer_phys;
-	usbmouse_key_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    /*  4. Register */
+    error = input_register_device(mk->input);
+    if (error)
+        goto fail_urbs;
+    usb_set_intfdata(intf, mk);
 
-    /* Use URB */
-	if (usb_submit_urb(usbmouse_key_urb, GFP_KERNEL))
-		return -EIO;
+    /*  Use URB: queue all of them, the host controller polls the endpoint 
+     *  for the next one while we are still in the completion of another
+     */
+    for (i = 0; i < mk->nr_urbs; i++) {
+        error = usb_submit_urb(mk->urbs[i], GFP_KERNEL);
+        if (error)
+            goto fail_submit;
+    }
     
     return 0;
+
+fail_submit:
+    while (--i >= 0)
+        usb_kill_urb(mk->urbs[i]);
+    usb_set_intfdata(intf, NULL);
+    input_unregister_device(mk->input);
+    mk->input = NULL;
+fail_urbs:
+    usbmouse_as_key_free_urbs(mk);
+    input_free_device(mk->input);
+fail_input:
+    kfree(mk);
+    return error;
 }
 
 
 static void usbmouse_as_key_disconnect(struct usb_interface *intf)
 {
+    struct usbmouse_key *mk = usb_get_intfdata(intf);
+    int i;
+
     //printk("Invoking usbmouse_as_key_disconnect function....\n");
-	usb_kill_urb(usbmouse_key_urb);
-    usb_free_urb(usbmouse_key_urb);
-    usb_free_coherent(interface_to_usbdev(intf), len, usb_buffer, usb_buffer_phys);
-    input_unregister_device(usbmouse_key_dev);
-    input_free_device(usbmouse_key_dev);
+    usb_set_intfdata(intf, NULL);
+    if (!mk)
+        return;
+
+    for (i = 0; i < mk->nr_urbs; i++)
+        usb_kill_urb(mk->urbs[i]);
+
+    dev_info(&intf->dev, "%lu reports, %lu with key changes, %d URBs in flight\n",
+        mk->reports, mk->changes, mk->nr_urbs);
+
+    usbmouse_as_key_free_urbs(mk);
+    input_unregister_device(mk->input);    /* drops the last reference, no input_free_device */
+    kfree(mk);
 }
 
 
@@ -17,6 +17,10 @@
 #include <linux/slab.h>
 #include <linux/clk.h>
 #include <linux/cpufreq.h>
+#include <linux/moduleparam.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
 
 #include <linux/mtd/mtd.h>
 #include <linux/mtd/nand.h>
@@ -25,8 +29,11 @@
 
 #include <asm/io.h>
 
+#ifdef CONFIG_ARCH_S3C2410
 #include <plat/regs-nand.h>
 #include <plat/nand.h>
+#include <mach/irqs.h>
+#endif
 
 
 struct s3c2440_nand_regs {
@@ -54,6 +61,93 @@ static struct mtd_info *s3c_mtd_info;
 
 static struct s3c2440_nand_regs *s3c_nand_regs;
 
+/* 1: 3 byte hardware ECC per 512 bytes, 0: software ECC like before */
+static int hardware_ecc = 1;
+module_param(hardware_ecc, int, S_IRUGO);
+
+/* 1: run on the RAM backed controller model in s3c_nand_sim.h, no hardware needed */
+#ifdef CONFIG_ARCH_S3C2410
+static int simulate = 0;
+#else
+static int simulate = 1;
+#endif
+module_param(simulate, int, S_IRUGO);
+
+/* 1: sleep until the R/nB rising edge interrupt during program/erase, 0: poll NFSTAT */
+static int rnb_irq = 1;
+module_param(rnb_irq, int, S_IRUGO);
+
+/* Time spent waiting for program/erase, /sys/module/s3c_nand/parameters/ */
+static unsigned long wait_poll_us;
+static unsigned long wait_poll_count;
+static unsigned long wait_sleep_us;
+static unsigned long wait_sleep_count;
+static unsigned long wait_timeouts;
+module_param(wait_poll_us, ulong, S_IRUGO);
+module_param(wait_poll_count, ulong, S_IRUGO);
+module_param(wait_sleep_us, ulong, S_IRUGO);
+module_param(wait_sleep_count, ulong, S_IRUGO);
+module_param(wait_timeouts, ulong, S_IRUGO);
+
+static DECLARE_COMPLETION(s3c_nand_rnb_done);
+static int s3c_nand_rnb_armed;
+
+#include "s3c_nand_sim.h"
+
+
+/*  
+ *  Every register access goes through these, so that simulate=1 can put 
+ *  the model under an otherwise unchanged driver.
+ */
+static inline unsigned long s3c_nand_readreg(unsigned long *reg)
+{
+    if (simulate)
+        return s3c_nand_sim_readreg(reg - (unsigned long *)s3c_nand_regs);
+    return *(volatile unsigned long *)reg;
+}
+
+static inline void s3c_nand_writereg(unsigned long *reg, unsigned long val)
+{
+    if (simulate)
+        s3c_nand_sim_writereg(reg - (unsigned long *)s3c_nand_regs, val);
+    else
+        *(volatile unsigned long *)reg = val;
+}
+
+/*  
+ *  NFDATA also takes 32 bit accesses, one moves 4 bytes. readsl/writesl 
+ *  cope with unaligned buffers, only the tail is left for byte accesses.
+ */
+static void s3c_nand_read_data(u_char *buf, int len)
+{
+    if (simulate) {
+        s3c_nand_sim_read_data(buf, len);
+        return;
+    }
+#ifdef CONFIG_ARCH_S3C2410
+    readsl(&s3c_nand_regs->NFDATA, buf, len >> 2);
+
+    buf += len & ~3;
+    for (len &= 3; len; len--)
+        *buf++ = readb(&s3c_nand_regs->NFDATA);
+#endif
+}
+
+static void s3c_nand_write_data(const u_char *buf, int len)
+{
+    if (simulate) {
+        s3c_nand_sim_write_data(buf, len);
+        return;
+    }
+#ifdef CONFIG_ARCH_S3C2410
+    writesl(&s3c_nand_regs->NFDATA, buf, len >> 2);
+
+    buf += len & ~3;
+    for (len &= 3; len; len--)
+        writeb(*buf++, &s3c_nand_regs->NFDATA);
+#endif
+}
+
 
 static struct mtd_partition s3c_nand_part[] = {
 	[0] = {
@@ -93,41 +187,287 @@ static void s3c2440_nand_select_chip(struct mtd_info *mtd, int chipnr)
 {
     if (chipnr == -1) {
         /* Cancel nand select chip */
-        s3c_nand_regs->NFCONT |= 1<<1;
+        s3c_nand_writereg(&s3c_nand_regs->NFCONT, s3c_nand_readreg(&s3c_nand_regs->NFCONT) | (1<<1));
     }else {
         /* nand select chip */
         /* NFCONT [1]   0: Force nFCE to low (Enable chip select) */        
-        s3c_nand_regs->NFCONT &= ~(1<<1);
+        s3c_nand_writereg(&s3c_nand_regs->NFCONT, s3c_nand_readreg(&s3c_nand_regs->NFCONT) & ~(1<<1));
     }
 }
 
 
 static void s3c2440_nand_cmd_ctrl(struct mtd_info *mtd, int data, unsigned int ctrl)
-{
+{
+    /* Only a control line change, nothing goes to the chip */
+    if (data == NAND_CMD_NONE)
+        return;
+
 	if (ctrl & NAND_CLE) {
+        /*  Program and erase end with a R/nB rising edge, forget any old 
+         *  one before the chip goes busy so that the waitfunc sleeps on 
+         *  this operation only. NFSTAT [2] is write 1 to clear.
+         *  NFCONT [9] is only set for this edge, page reads go busy too.
+         */
+        if (rnb_irq && (data == NAND_CMD_PAGEPROG || data == NAND_CMD_ERASE2)) {
+            INIT_COMPLETION(s3c_nand_rnb_done);
+            s3c_nand_writereg(&s3c_nand_regs->NFSTAT, 1<<2);
+            s3c_nand_rnb_armed = 1;
+            s3c_nand_writereg(&s3c_nand_regs->NFCONT, 
+                s3c_nand_readreg(&s3c_nand_regs->NFCONT) | (1<<9));
+        }
+
 		/* Send command: NFCMMD = data */
-        s3c_nand_regs->NFCMD = data;
+        s3c_nand_writereg(&s3c_nand_regs->NFCMD, data);
 	}else {
 		/* Send address: NFADDR = data */
-        s3c_nand_regs->NFADDR = data;
+        s3c_nand_writereg(&s3c_nand_regs->NFADDR, data);
 	}
 }
 
 
 static int s3c2440_nand_device_ready(struct mtd_info *mtd)
 {
-    return (s3c_nand_regs->NFSTAT & (1<<0));
+    return (s3c_nand_readreg(&s3c_nand_regs->NFSTAT) & (1<<0));
 }
 
 
-static int __init s3c_nand_init(void)
+/* NFSTAT [2] 1: R/nB went from busy to ready, the chip finished */
+static void s3c_nand_rnb_edge(void)
 {
+    if (!(s3c_nand_readreg(&s3c_nand_regs->NFSTAT) & (1<<2)))
+        return;
+
+    s3c_nand_writereg(&s3c_nand_regs->NFSTAT, 1<<2);
+    complete(&s3c_nand_rnb_done);
+}
+
+static irqreturn_t s3c_nand_rnb_irq(int irq, void *dev_id)
+{
+    s3c_nand_rnb_edge();
+    return IRQ_HANDLED;
+}
+
+
+/*  
+ *  Replaces nand_wait() for program and erase, where the chip stays busy 
+ *  for tPROG/tBERS (~200us/~2ms). With rnb_irq the caller sleeps until 
+ *  the NFCON interrupt instead of spinning on dev_ready.
+ */
+static int s3c2440_nand_waitfunc(struct mtd_info *mtd, struct nand_chip *chip)
+{
+    unsigned long timeo = (chip->state == FL_ERASING) ? HZ * 400 / 1000 : HZ * 20 / 1000;
+    ktime_t start = ktime_get();
+
+    if (s3c_nand_rnb_armed) {
+        s3c_nand_rnb_armed = 0;
+        if (!wait_for_completion_timeout(&s3c_nand_rnb_done, timeo) &&
+            !s3c2440_nand_device_ready(mtd))
+            wait_timeouts++;
+        s3c_nand_writereg(&s3c_nand_regs->NFCONT, 
+            s3c_nand_readreg(&s3c_nand_regs->NFCONT) & ~(1<<9));
+
+        wait_sleep_us += ktime_to_us(ktime_sub(ktime_get(), start));
+        wait_sleep_count++;
+    }else {
+        timeo += jiffies;
+        while (!s3c2440_nand_device_ready(mtd)) {
+            if (time_after(jiffies, timeo)) {
+                wait_timeouts++;
+                break;
+            }
+            cond_resched();
+        }
+
+        wait_poll_us += ktime_to_us(ktime_sub(ktime_get(), start));
+        wait_poll_count++;
+    }
+
+    chip->cmdfunc(mtd, NAND_CMD_STATUS, -1, -1);
+    return chip->read_byte(mtd);
+}
+
+
+static uint8_t s3c2440_nand_read_byte(struct mtd_info *mtd)
+{
+    u_char b;
+
+    s3c_nand_read_data(&b, 1);
+    return b;
+}
+
+static void s3c2440_nand_read_buf(struct mtd_info *mtd, u_char *buf, int len)
+{
+    s3c_nand_read_data(buf, len);
+}
+
+static void s3c2440_nand_write_buf(struct mtd_info *mtd, const u_char *buf, int len)
+{
+    s3c_nand_write_data(buf, len);
+}
+
+static int s3c2440_nand_verify_buf(struct mtd_info *mtd, const u_char *buf, int len)
+{
+    u_char b;
+
+    while (len--) {
+        s3c_nand_read_data(&b, 1);
+        if (b != *buf++)
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+/*  
+ *  Hardware ECC, referenced by s3c2440_nand_enable_hwecc() and friends
+ *  NFCONT [5]   0: Unlock main data area ECC generation
+ *  NFCONT [4]   1: Initialize main area ECC decoder/encoder
+ *  The controller then accumulates the ECC of every byte through NFDATA 
+ *  into NFMECC0, 3 bytes for each 512 byte step.
+ */
+static void s3c2440_nand_enable_hwecc(struct mtd_info *mtd, int mode)
+{
+    s3c_nand_writereg(&s3c_nand_regs->NFCONT, 
+        (s3c_nand_readreg(&s3c_nand_regs->NFCONT) & ~(1<<5)) | (1<<4));
+}
+
+static int s3c2440_nand_calculate_ecc(struct mtd_info *mtd, const u_char *dat, u_char *ecc_code)
+{
+    unsigned long ecc = s3c_nand_readreg(&s3c_nand_regs->NFMECC0);
+
+    ecc_code[0] = ecc;
+    ecc_code[1] = ecc >> 8;
+    ecc_code[2] = ecc >> 16;
+
+    return 0;
+}
+
+/*  
+ *  Same code as the SmartMedia 256 byte ECC: a single bit error flips 
+ *  exactly one bit of every pair in the syndrome, and the odd bits of 
+ *  the syndrome are the error position.
+ */
+static int s3c2440_nand_correct_data(struct mtd_info *mtd, u_char *dat, 
+                                     u_char *read_ecc, u_char *calc_ecc)
+{
+    unsigned int diff0, diff1, diff2;
+    unsigned int bit, byte;
+
+    diff0 = read_ecc[0] ^ calc_ecc[0];
+    diff1 = read_ecc[1] ^ calc_ecc[1];
+    diff2 = read_ecc[2] ^ calc_ecc[2];
+
+    if (diff0 == 0 && diff1 == 0 && diff2 == 0)
+        return 0;
+
+    /* An erased page has no ECC written yet */
+    if (read_ecc[0] == 0xff && read_ecc[1] == 0xff && read_ecc[2] == 0xff)
+        return 0;
+
+    /* One correctable bit in the data */
+    if (((diff0 ^ (diff0 >> 1)) & 0x55) == 0x55 &&
+        ((diff1 ^ (diff1 >> 1)) & 0x55) == 0x55 &&
+        ((diff2 ^ (diff2 >> 1)) & 0x55) == 0x55) {
+        bit  = ((diff2 >> 3) & 1) |
+               ((diff2 >> 4) & 2) |
+               ((diff2 >> 5) & 4);
+
+        byte = ((diff2 << 7) & 0x100) |
+               ((diff1 << 0) & 0x80)  |
+               ((diff1 << 1) & 0x40)  |
+               ((diff1 << 2) & 0x20)  |
+               ((diff1 << 3) & 0x10)  |
+               ((diff0 >> 4) & 0x08)  |
+               ((diff0 >> 3) & 0x04)  |
+               ((diff0 >> 2) & 0x02)  |
+               ((diff0 >> 1) & 0x01);
+
+        dat[byte] ^= (1 << bit);
+        return 1;
+    }
+
+    /* A single bit flip in the stored ECC itself, the data is fine */
+    diff0 |= (diff1 << 8);
+    diff0 |= (diff2 << 16);
+    if ((diff0 & (diff0 - 1)) == 0)
+        return 1;
+
+    return -1;
+}
+
+
+/* Map the controller and enable its clock */
+static int s3c_nand_hw_setup(void)
+{
+#ifdef CONFIG_ARCH_S3C2410
     struct clk *clk;
+
+    s3c_nand_regs = ioremap(0x4E000000, sizeof(struct s3c2440_nand_regs));
+    if (!s3c_nand_regs)
+        return -ENOMEM;
+
+    /*  Enable Nandflash clock */
+    clk = clk_get(NULL, "nand");
+	if (IS_ERR(clk)) {
+		printk("failed to get clock\n");
+        iounmap(s3c_nand_regs);
+		return -ENOENT;
+	}
+    clk_enable(clk);
+
+    return 0;
+#else
+    printk("s3c_nand: no S3C2440 in this kernel, load with simulate=1\n");
+    return -ENODEV;
+#endif
+}
+
+static void s3c_nand_hw_release(void)
+{
+    printk("s3c_nand: program/erase waits, %lu polled for %lu us, %lu slept for %lu us, %lu timeouts\n",
+        wait_poll_count, wait_poll_us, wait_sleep_count, wait_sleep_us, wait_timeouts);
+
+    if (rnb_irq)
+        s3c_nand_writereg(&s3c_nand_regs->NFCONT, 
+            s3c_nand_readreg(&s3c_nand_regs->NFCONT) & ~(1<<9));
+
+    if (simulate) {
+        s3c_nand_sim_exit();
+        kfree(s3c_nand_regs);
+    } else {
+#ifdef CONFIG_ARCH_S3C2410
+        if (rnb_irq)
+            free_irq(IRQ_NFCON, NULL);
+#endif
+        //clk_disable(clk);
+        iounmap(s3c_nand_regs);
+    }
+}
+
+
+static int __init s3c_nand_init(void)
+{
+    int ret;
         
     /*  1. Allocate nand_chip struct */
     s3c_nand_chip = kzalloc(sizeof(struct nand_chip), GFP_KERNEL);
-
-    s3c_nand_regs = ioremap(0x4E000000, sizeof(struct s3c2440_nand_regs));
+    if (!s3c_nand_chip)
+        return -ENOMEM;
+
+    /*  The register file, or its model backed by RAM */
+    if (simulate) {
+        s3c_nand_regs = kzalloc(sizeof(struct s3c2440_nand_regs), GFP_KERNEL);
+        ret = s3c_nand_regs ? s3c_nand_sim_init(s3c_nand_regs, s3c_nand_rnb_edge) : -ENOMEM;
+        if (ret)
+            kfree(s3c_nand_regs);
+    } else {
+        ret = s3c_nand_hw_setup();
+    }
+    if (ret) {
+        kfree(s3c_nand_chip);
+        return ret;
+    }
 
     
     /*  2. Configure nand_chip struct */
@@ -136,20 +476,25 @@ static int __init s3c_nand_init(void)
     s3c_nand_chip->IO_ADDR_R            = &s3c_nand_regs->NFDATA;   /* The virtual address of NFDATA */
     s3c_nand_chip->IO_ADDR_W            = &s3c_nand_regs->NFDATA;   /* The virtual address of NFDATA */
     s3c_nand_chip->dev_ready            = s3c2440_nand_device_ready;
-	s3c_nand_chip->ecc.mode             = NAND_ECC_SOFT;	        /* enable ECC */
+    s3c_nand_chip->read_byte            = s3c2440_nand_read_byte;
+    s3c_nand_chip->read_buf             = s3c2440_nand_read_buf;
+    s3c_nand_chip->write_buf            = s3c2440_nand_write_buf;
+    s3c_nand_chip->verify_buf           = s3c2440_nand_verify_buf;
+    s3c_nand_chip->waitfunc             = s3c2440_nand_waitfunc;
+
+    if (hardware_ecc) {
+        s3c_nand_chip->ecc.mode         = NAND_ECC_HW;
+        s3c_nand_chip->ecc.size         = 512;
+        s3c_nand_chip->ecc.bytes        = 3;
+        s3c_nand_chip->ecc.hwctl        = s3c2440_nand_enable_hwecc;
+        s3c_nand_chip->ecc.calculate    = s3c2440_nand_calculate_ecc;
+        s3c_nand_chip->ecc.correct      = s3c2440_nand_correct_data;
+    }else {
+	    s3c_nand_chip->ecc.mode         = NAND_ECC_SOFT;	        /* enable ECC */
+    }
 
 
     /*  3. Hardware related operations */
-    /* Enable Nandflash clock */
-    clk = clk_get(NULL, "nand");
-	if (IS_ERR(clk)) {
-		printk("failed to get clock\n");
-        iounmap(s3c_nand_regs);
-        kfree(s3c_nand_chip);
-		return -ENOENT;
-	}
-    clk_enable(clk);
-
 
     /*  According to the nand chip manual, setup the timing parameters 
      *  HCLK = 101.250MHz = 9.88ns
@@ -166,7 +511,7 @@ static int __init s3c_nand_init(void)
 #define TACLS           0
 #define TWRPH0          1
 #define TWRPH1          0
-    s3c_nand_regs->NFCONF = (TACLS<<12) | (TWRPH0<<8) | (TWRPH1<<4);
+    s3c_nand_writereg(&s3c_nand_regs->NFCONF, (TACLS<<12) | (TWRPH0<<8) | (TWRPH1<<4));
     
 
     /*  NFCONT [1] - 1: Force nFCE to High (Disable chip select) 
@@ -174,7 +519,26 @@ static int __init s3c_nand_init(void)
      *  NFCONT [0] - 1: NAND Flash Controller Enable
      *               0: NAND Flash Controller Disable (Dont work)
      */
-    s3c_nand_regs->NFCONT = (1<<1) | (1<<0);
+    s3c_nand_writereg(&s3c_nand_regs->NFCONT, (1<<1) | (1<<0));
+    
+
+    /*  NFCONT [9] - 0: R/nB transition interrupt masked, cmd_ctrl sets it 
+     *                  for program/erase and the waitfunc clears it again
+     *  NFCONT [8] - 0: Detect the rising edge, busy to ready
+     *  The model calls s3c_nand_rnb_edge() itself, only hardware needs the irq.
+     */
+#ifdef CONFIG_ARCH_S3C2410
+    if (rnb_irq && !simulate && 
+        request_irq(IRQ_NFCON, s3c_nand_rnb_irq, 0, "s3c_nand", NULL)) {
+        printk("s3c_nand: can't get IRQ_NFCON, polling R/nB\n");
+        rnb_irq = 0;
+    }
+#endif
+    if (rnb_irq) {
+        s3c_nand_writereg(&s3c_nand_regs->NFSTAT, 1<<2);
+        s3c_nand_writereg(&s3c_nand_regs->NFCONT, 
+            s3c_nand_readreg(&s3c_nand_regs->NFCONT) & ~((1<<9) | (1<<8)));
+    }
     
 
     /*  4. Use: nand_scan_ident */
@@ -200,8 +564,7 @@ static void __exit s3c_nand_exit(void)
 {
     del_mtd_partitions(s3c_mtd_info);
     kfree(s3c_mtd_info);
-    //clk_disable(clk);
-    iounmap(s3c_nand_regs);
+    s3c_nand_hw_release();
     kfree(s3c_nand_chip);
 }
 
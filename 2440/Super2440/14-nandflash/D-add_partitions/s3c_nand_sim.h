@@ -0,0 +1,551 @@
+
+/*
+ *  RAM backed model of the S3C2440 NAND controller and a large page chip
+ *
+ *  Included by s3c_nand.c and used when it is loaded with simulate=1. The
+ *  driver keeps writing NFCMD/NFADDR/NFCONT and reading NFSTAT/NFDATA/
+ *  NFMECC0 of its struct s3c2440_nand_regs, every access just ends up here
+ *  instead of on the bus. The chip answers READID, READ0/READSTART,
+ *  RNDOUT, SEQIN/RNDIN/PAGEPROG, ERASE1/ERASE2, STATUS and RESET, and the
+ *  main area ECC is computed like the controller does, so hardware ECC
+ *  generation and correction run for real.
+ *
+ *  Bad blocks are marked in the OOB of their first page at load time and
+ *  fail program/erase. Bit flips are injected into the page register on
+ *  reads, the flash contents stay intact.
+ *
+ *  Program and erase keep R/nB low for sim_tprog_us/sim_tbers_us. The
+ *  rising edge sets NFSTAT[2] and, with NFCONT[9] set, calls back into
+ *  the driver from an hrtimer like the NFCON interrupt would.
+ */
+
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+
+
+/* 0xF1: 128MiB, 0xDA: 256MiB, 0xDC: 512MiB (K9F4G08) */
+static int sim_chip_id = 0xF1;
+module_param(sim_chip_id, int, S_IRUGO);
+
+/* 1024, 2048, 4096 or 8192 */
+static int sim_page_size = 2048;
+module_param(sim_page_size, int, S_IRUGO);
+
+/* OOB bytes per 512 data bytes, 8 or 16 */
+static int sim_oob_per_512 = 16;
+module_param(sim_oob_per_512, int, S_IRUGO);
+
+/* 64, 128, 256 or 512 KiB */
+static int sim_block_size = 128 * 1024;
+module_param(sim_block_size, int, S_IRUGO);
+
+/* Factory bad blocks, by block number */
+static int sim_bad_blocks[16];
+static int sim_nr_bad_blocks;
+module_param_array(sim_bad_blocks, int, &sim_nr_bad_blocks, S_IRUGO);
+
+/* Flip one random data bit every N page reads, 0: never */
+static int sim_bitflip_every = 0;
+module_param(sim_bitflip_every, int, S_IRUGO | S_IWUSR);
+
+/* Busy time of page program and block erase, K9F1G08 typical values */
+static int sim_tprog_us = 200;
+module_param(sim_tprog_us, int, S_IRUGO | S_IWUSR);
+
+static int sim_tbers_us = 1500;
+module_param(sim_tbers_us, int, S_IRUGO | S_IWUSR);
+
+
+#define SIM_MAKER_ID        0xEC        /* Samsung */
+#define SIM_REG(name)       (offsetof(struct s3c2440_nand_regs, name) / sizeof(unsigned long))
+
+enum {
+    SIM_IDLE,
+    SIM_READID,
+    SIM_STATUS,
+    SIM_READ,
+    SIM_PROG,
+};
+
+struct s3c_nand_sim {
+    struct s3c2440_nand_regs *regs;     /* the register file the driver sees */
+    u8 *flash;                          /* page + oob for every page */
+    u8 *buf;                            /* the chip's page register */
+    u8 id[5];
+
+    unsigned int page_size;
+    unsigned int oob_size;
+    unsigned int full_size;             /* page + oob */
+    unsigned int pages_per_block;
+    unsigned int nr_pages;
+
+    int state;
+    u8 cmd;                             /* last command */
+    u8 addr[5];
+    unsigned int nr_addr;
+    unsigned int pos;                   /* data port position */
+    u8 status;
+
+    /* Main area ECC of the bytes through NFDATA since NFCONT[4] */
+    unsigned int ecc_count;
+    u8 ecc_col;                         /* XOR of all bytes */
+    u32 ecc_line;                       /* XOR of the index of every odd parity byte */
+    u8 ecc_odd;                         /* number of odd parity bytes, mod 2 */
+
+    struct hrtimer busy_timer;          /* ends tPROG/tBERS */
+    void (*rnb_edge)(void);             /* the driver's NFCON interrupt handler */
+
+    unsigned long reads;
+    unsigned long programs;
+    unsigned long erases;
+    unsigned long flips;
+    unsigned long failures;
+};
+
+static struct s3c_nand_sim *nand_sim;
+
+
+static unsigned int s3c_nand_sim_chipsize(int id)
+{
+    switch (id) {
+    case 0xF1:  return 128;
+    case 0xDA:  return 256;
+    case 0xDC:  return 512;
+    default:    return 0;
+    }
+}
+
+static u32 s3c_nand_sim_col(struct s3c_nand_sim *sim)
+{
+    return sim->addr[0] | (sim->addr[1] << 8);
+}
+
+static u32 s3c_nand_sim_row(struct s3c_nand_sim *sim, int first)
+{
+    return sim->addr[first] | (sim->addr[first + 1] << 8) | (sim->addr[first + 2] << 16);
+}
+
+static void s3c_nand_sim_ecc_add(struct s3c_nand_sim *sim, u8 v)
+{
+    unsigned int idx = sim->ecc_count++ & 511;
+
+    /* NFCONT [5] 1: Lock main data area ECC generation */
+    if (sim->regs->NFCONT & (1<<5))
+        return;
+
+    sim->ecc_col ^= v;
+    if (hweight8(v) & 1) {
+        sim->ecc_line ^= idx;
+        sim->ecc_odd ^= 1;
+    }
+}
+
+/*
+ *  Line and column parities in the layout s3c2440_nand_correct_data()
+ *  decodes: every address bit of the data bit gets an odd/even pair,
+ *  byte address bits 0-3 in ECC0, 4-7 in ECC1, 8 in ECC2[1:0], bit
+ *  address bits 0-2 in ECC2[7:2]. Stored inverted, so erased data has
+ *  an all ones ECC like erased OOB.
+ */
+static u32 s3c_nand_sim_ecc(struct s3c_nand_sim *sim)
+{
+    static const u8 col_mask[3] = { 0xAA, 0xCC, 0xF0 };
+    u32 ecc = 0, odd, even;
+    int k;
+
+    for (k = 0; k < 9; k++) {
+        odd = (sim->ecc_line >> k) & 1;
+        even = odd ^ sim->ecc_odd;
+        ecc |= ((odd << 1) | even) << (k < 8 ? 2 * k : 16);
+    }
+
+    for (k = 0; k < 3; k++) {
+        odd = hweight8(sim->ecc_col & col_mask[k]) & 1;
+        even = hweight8(sim->ecc_col & ~col_mask[k]) & 1;
+        ecc |= ((odd << 1) | even) << (16 + 2 * k + 2);
+    }
+
+    return ~ecc & 0xFFFFFF;
+}
+
+static void s3c_nand_sim_load(struct s3c_nand_sim *sim)
+{
+    u32 page = s3c_nand_sim_row(sim, 2);
+    unsigned int bit;
+
+    sim->state = SIM_READ;
+    sim->pos = s3c_nand_sim_col(sim);
+
+    if (page >= sim->nr_pages) {
+        memset(sim->buf, 0xFF, sim->full_size);
+        return;
+    }
+
+    memcpy(sim->buf, sim->flash + (size_t)page * sim->full_size, sim->full_size);
+    sim->reads++;
+
+    if (sim_bitflip_every > 0 && sim->reads % sim_bitflip_every == 0) {
+        bit = random32() % (sim->page_size * 8);
+        sim->buf[bit / 8] ^= 1 << (bit % 8);
+        sim->flips++;
+    }
+}
+
+static int s3c_nand_sim_is_bad(struct s3c_nand_sim *sim, u32 block)
+{
+    int i;
+
+    for (i = 0; i < sim_nr_bad_blocks; i++)
+        if (sim_bad_blocks[i] == block)
+            return 1;
+    return 0;
+}
+
+/* R/nB rising edge: NFSTAT [2] 1: transition detected, NFCONT [9] 1: interrupt */
+static enum hrtimer_restart s3c_nand_sim_ready(struct hrtimer *timer)
+{
+    struct s3c_nand_sim *sim = container_of(timer, struct s3c_nand_sim, busy_timer);
+    unsigned long *nfstat = &sim->regs->NFSTAT;
+
+    sim->status |= NAND_STATUS_READY;
+    set_bit(0, nfstat);
+    set_bit(2, nfstat);
+
+    if ((sim->regs->NFCONT & (1<<9)) && sim->rnb_edge)
+        sim->rnb_edge();
+
+    return HRTIMER_NORESTART;
+}
+
+/* Pull R/nB low for us microseconds, the array work is already done */
+static void s3c_nand_sim_busy(struct s3c_nand_sim *sim, int us)
+{
+    if (us <= 0) {
+        s3c_nand_sim_ready(&sim->busy_timer);
+        return;
+    }
+
+    sim->status &= ~NAND_STATUS_READY;
+    clear_bit(0, &sim->regs->NFSTAT);
+    hrtimer_start(&sim->busy_timer, ktime_set(0, us * 1000), HRTIMER_MODE_REL);
+}
+
+static void s3c_nand_sim_program(struct s3c_nand_sim *sim)
+{
+    u32 page = s3c_nand_sim_row(sim, 2);
+    u8 *dst;
+    unsigned int i;
+
+    sim->state = SIM_IDLE;
+    sim->status = NAND_STATUS_READY | NAND_STATUS_WP;
+
+    if (page >= sim->nr_pages || s3c_nand_sim_is_bad(sim, page / sim->pages_per_block)) {
+        sim->status |= NAND_STATUS_FAIL;
+        sim->failures++;
+        return;
+    }
+
+    /* Programming only clears bits */
+    dst = sim->flash + (size_t)page * sim->full_size;
+    for (i = 0; i < sim->full_size; i++)
+        dst[i] &= sim->buf[i];
+    sim->programs++;
+}
+
+static void s3c_nand_sim_erase(struct s3c_nand_sim *sim)
+{
+    u32 block = s3c_nand_sim_row(sim, 0) / sim->pages_per_block;
+
+    sim->state = SIM_IDLE;
+    sim->status = NAND_STATUS_READY | NAND_STATUS_WP;
+
+    if (block >= sim->nr_pages / sim->pages_per_block || s3c_nand_sim_is_bad(sim, block)) {
+        sim->status |= NAND_STATUS_FAIL;
+        sim->failures++;
+        return;
+    }
+
+    memset(sim->flash + (size_t)block * sim->pages_per_block * sim->full_size,
+           0xFF, sim->pages_per_block * sim->full_size);
+    sim->erases++;
+}
+
+static void s3c_nand_sim_command(struct s3c_nand_sim *sim, u8 cmd)
+{
+    switch (cmd) {
+    case NAND_CMD_RESET:
+        sim->state = SIM_IDLE;
+        sim->status = NAND_STATUS_READY | NAND_STATUS_WP;
+        break;
+    case NAND_CMD_READID:
+        sim->state = SIM_READID;
+        sim->pos = 0;
+        break;
+    case NAND_CMD_STATUS:
+        sim->state = SIM_STATUS;
+        break;
+    case NAND_CMD_READSTART:
+        s3c_nand_sim_load(sim);
+        break;
+    case NAND_CMD_RNDOUTSTART:
+        sim->state = SIM_READ;
+        sim->pos = s3c_nand_sim_col(sim);
+        break;
+    case NAND_CMD_SEQIN:
+        memset(sim->buf, 0xFF, sim->full_size);
+        sim->state = SIM_PROG;
+        break;
+    case NAND_CMD_PAGEPROG:
+        s3c_nand_sim_program(sim);
+        s3c_nand_sim_busy(sim, sim_tprog_us);
+        break;
+    case NAND_CMD_ERASE2:
+        s3c_nand_sim_erase(sim);
+        s3c_nand_sim_busy(sim, sim_tbers_us);
+        break;
+    default:
+        /* READ0, RNDOUT, RNDIN, ERASE1: only collect the address */
+        break;
+    }
+
+    /*  Every command starts a fresh address sequence, RNDIN keeps the row. 
+     *  A new page or block address clears the old cycles: ERASE1 sends only 
+     *  the row, 2 cycles on a 128MiB chip, and must not pick up the rest of 
+     *  the previous page address.
+     */
+    sim->cmd = cmd;
+    if (cmd != NAND_CMD_READSTART && cmd != NAND_CMD_RNDOUTSTART)
+        sim->nr_addr = 0;
+    if (cmd == NAND_CMD_READ0 || cmd == NAND_CMD_SEQIN || cmd == NAND_CMD_ERASE1)
+        memset(sim->addr, 0, sizeof(sim->addr));
+}
+
+static void s3c_nand_sim_address(struct s3c_nand_sim *sim, u8 addr)
+{
+    if (sim->nr_addr < ARRAY_SIZE(sim->addr))
+        sim->addr[sim->nr_addr++] = addr;
+
+    /* Data for SEQIN/RNDIN follows the column cycles right away */
+    if ((sim->cmd == NAND_CMD_SEQIN || sim->cmd == NAND_CMD_RNDIN) && sim->nr_addr <= 2)
+        sim->pos = s3c_nand_sim_col(sim);
+}
+
+/*  
+ *  Load time check of the address decoding: read a page whose low row byte 
+ *  is not 0, then erase a block with as many row cycles as nand_command_lp() 
+ *  sends (3 above 128MiB). The chip is still blank, nothing changes.
+ */
+static int s3c_nand_sim_check_erase(struct s3c_nand_sim *sim)
+{
+    int rows = (u64)sim->nr_pages * sim->page_size > (128 << 20) ? 3 : 2;
+    u32 block, page;
+    int i, ret;
+
+    for (block = 1; block < sim->nr_pages / sim->pages_per_block; block++)
+        if (!s3c_nand_sim_is_bad(sim, block))
+            break;
+    page = block * sim->pages_per_block + 1;
+
+    s3c_nand_sim_command(sim, NAND_CMD_READ0);
+    s3c_nand_sim_address(sim, 0);
+    s3c_nand_sim_address(sim, 0);
+    for (i = 0; i < rows; i++)
+        s3c_nand_sim_address(sim, (page >> (8 * i)) & 0xFF);
+    s3c_nand_sim_command(sim, NAND_CMD_READSTART);
+
+    s3c_nand_sim_command(sim, NAND_CMD_ERASE1);
+    for (i = 0; i < rows; i++)
+        s3c_nand_sim_address(sim, ((block * sim->pages_per_block) >> (8 * i)) & 0xFF);
+    s3c_nand_sim_erase(sim);    /* what ERASE2 does, without the busy time */
+
+    ret = (sim->status & NAND_STATUS_FAIL) ? -EIO : 0;
+
+    s3c_nand_sim_command(sim, NAND_CMD_RESET);
+    sim->reads = 0;
+    sim->erases = 0;
+    sim->flips = 0;
+    sim->failures = 0;
+    return ret;
+}
+
+static unsigned long s3c_nand_sim_readreg(unsigned int reg)
+{
+    struct s3c_nand_sim *sim = nand_sim;
+    unsigned long *regs = (unsigned long *)sim->regs;
+
+    switch (reg) {
+    case SIM_REG(NFMECC0):
+        regs[reg] = s3c_nand_sim_ecc(sim);
+        break;
+    }
+
+    return regs[reg];
+}
+
+static void s3c_nand_sim_writereg(unsigned int reg, unsigned long val)
+{
+    struct s3c_nand_sim *sim = nand_sim;
+    unsigned long *regs = (unsigned long *)sim->regs;
+
+    /* NFSTAT: R/nB is read only, the transition bits are write 1 to clear */
+    if (reg == SIM_REG(NFSTAT)) {
+        if (val & (1<<2))
+            clear_bit(2, &regs[reg]);
+        if (val & (1<<3))
+            clear_bit(3, &regs[reg]);
+        return;
+    }
+
+    regs[reg] = val;
+
+    switch (reg) {
+    case SIM_REG(NFCONT):
+        /* NFCONT [4] 1: Initialize main area ECC, self clearing */
+        if (val & (1<<4)) {
+            sim->ecc_count = 0;
+            sim->ecc_col = 0;
+            sim->ecc_line = 0;
+            sim->ecc_odd = 0;
+            regs[reg] &= ~(1<<4);
+        }
+        break;
+    case SIM_REG(NFCMD):
+        s3c_nand_sim_command(sim, val);
+        break;
+    case SIM_REG(NFADDR):
+        s3c_nand_sim_address(sim, val);
+        break;
+    }
+}
+
+static void s3c_nand_sim_read_data(u_char *buf, int len)
+{
+    struct s3c_nand_sim *sim = nand_sim;
+    u8 v;
+
+    while (len--) {
+        switch (sim->state) {
+        case SIM_READID:
+            v = sim->id[sim->pos++ % ARRAY_SIZE(sim->id)];
+            break;
+        case SIM_STATUS:
+            v = sim->status;
+            break;
+        case SIM_READ:
+            v = sim->pos < sim->full_size ? sim->buf[sim->pos++] : 0xFF;
+            s3c_nand_sim_ecc_add(sim, v);
+            break;
+        default:
+            v = 0xFF;
+            break;
+        }
+        *buf++ = v;
+    }
+}
+
+static void s3c_nand_sim_write_data(const u_char *buf, int len)
+{
+    struct s3c_nand_sim *sim = nand_sim;
+
+    while (len--) {
+        if (sim->state == SIM_PROG) {
+            if (sim->pos < sim->full_size)
+                sim->buf[sim->pos++] = *buf;
+            s3c_nand_sim_ecc_add(sim, *buf);
+        }
+        buf++;
+    }
+}
+
+static int s3c_nand_sim_init(struct s3c2440_nand_regs *regs, void (*rnb_edge)(void))
+{
+    struct s3c_nand_sim *sim;
+    unsigned int chipsize = s3c_nand_sim_chipsize(sim_chip_id);
+    unsigned int i, page;
+
+    if (!chipsize ||
+        !is_power_of_2(sim_page_size) || sim_page_size < 1024 || sim_page_size > 8192 ||
+        (sim_oob_per_512 != 8 && sim_oob_per_512 != 16) ||
+        !is_power_of_2(sim_block_size) || sim_block_size < 64 * 1024 ||
+        sim_block_size > 512 * 1024 || sim_block_size < sim_page_size) {
+        printk("s3c_nand_sim: bad geometry, chip 0x%x page %d oob/512 %d block %d\n",
+            sim_chip_id, sim_page_size, sim_oob_per_512, sim_block_size);
+        return -EINVAL;
+    }
+
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if (!sim)
+        return -ENOMEM;
+
+    sim->regs = regs;
+    sim->rnb_edge = rnb_edge;
+    hrtimer_init(&sim->busy_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sim->busy_timer.function = s3c_nand_sim_ready;
+    sim->page_size = sim_page_size;
+    sim->oob_size = sim_oob_per_512 * (sim_page_size / 512);
+    sim->full_size = sim->page_size + sim->oob_size;
+    sim->pages_per_block = sim_block_size / sim_page_size;
+    sim->nr_pages = (chipsize << 20) / sim_page_size;
+    sim->status = NAND_STATUS_READY | NAND_STATUS_WP;
+
+    /* The 4th ID byte carries the geometry, see nand_get_flash_type() */
+    sim->id[0] = SIM_MAKER_ID;
+    sim->id[1] = sim_chip_id;
+    sim->id[2] = 0x00;
+    sim->id[3] = ilog2(sim_page_size / 1024) |
+                 ((sim_oob_per_512 == 16) << 2) |
+                 (ilog2(sim_block_size / (64 * 1024)) << 4);
+    sim->id[4] = 0x00;
+
+    sim->buf = kmalloc(sim->full_size, GFP_KERNEL);
+    sim->flash = vmalloc((size_t)sim->nr_pages * sim->full_size);
+    if (!sim->buf || !sim->flash) {
+        kfree(sim->buf);
+        vfree(sim->flash);
+        kfree(sim);
+        return -ENOMEM;
+    }
+
+    /* A freshly erased chip, with the factory bad block markers */
+    memset(sim->flash, 0xFF, (size_t)sim->nr_pages * sim->full_size);
+    for (i = 0; i < sim_nr_bad_blocks; i++) {
+        if (sim_bad_blocks[i] < 0 || sim_bad_blocks[i] >= sim->nr_pages / sim->pages_per_block)
+            continue;
+        page = sim_bad_blocks[i] * sim->pages_per_block;
+        sim->flash[(size_t)page * sim->full_size + sim->page_size] = 0x00;
+    }
+
+    regs->NFSTAT = 1<<0;
+
+    if (s3c_nand_sim_check_erase(sim)) {
+        printk("s3c_nand_sim: erase after a page read decodes the wrong block\n");
+        vfree(sim->flash);
+        kfree(sim->buf);
+        kfree(sim);
+        return -EIO;
+    }
+
+    nand_sim = sim;
+
+    printk("s3c_nand_sim: %u MiB, %u+%u byte pages, %u pages per block, %d bad blocks\n",
+        chipsize, sim->page_size, sim->oob_size, sim->pages_per_block, sim_nr_bad_blocks);
+    return 0;
+}
+
+static void s3c_nand_sim_exit(void)
+{
+    struct s3c_nand_sim *sim = nand_sim;
+
+    hrtimer_cancel(&sim->busy_timer);
+
+    printk("s3c_nand_sim: %lu reads, %lu programs, %lu erases, %lu bit flips, %lu failures\n",
+        sim->reads, sim->programs, sim->erases, sim->flips, sim->failures);
+
+    vfree(sim->flash);
+    kfree(sim->buf);
+    kfree(sim);
+    nand_sim = NULL;
+}
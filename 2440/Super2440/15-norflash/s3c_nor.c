@@ -21,6 +21,7 @@
 static struct map_info *s3c_nor_map;
 static struct mtd_info *s3c_nor_mtd_info;
 
+#include "s3c_nor_ra.h"
 
 static struct mtd_partition s3c_nor_part[] = {
 	[0] = {
@@ -49,6 +50,8 @@ static int __init s3c_nor_init(void)
 	s3c_nor_map->virt = ioremap(s3c_nor_map->phys, s3c_nor_map->size);
 
     simple_map_init(s3c_nor_map);
+
+    s3c_nor_ra_init(s3c_nor_map);
     
     /* 3. Use(Apply): Invoking the functions from the Norflash protocol layer to identify */
     printk("Use cfi_probe!\n");
@@ -59,11 +62,14 @@ static int __init s3c_nor_init(void)
     }
 
     if (!s3c_nor_mtd_info) {
+        s3c_nor_ra_exit(s3c_nor_map);
         iounmap(s3c_nor_map->virt);
         kfree(s3c_nor_map);
         return -EIO;
     }
     
+    s3c_nor_page_mode(s3c_nor_map);
+
     /* 4. add_mtd_partitions */
     add_mtd_partitions(s3c_nor_mtd_info, s3c_nor_part, 2);
     
@@ -74,6 +80,9 @@ static int __init s3c_nor_init(void)
 static void __exit s3c_nor_exit(void)
 {
     del_mtd_partitions(s3c_nor_mtd_info);
+    map_destroy(s3c_nor_mtd_info);
+
+    s3c_nor_ra_exit(s3c_nor_map);
     iounmap(s3c_nor_map->virt);
     kfree(s3c_nor_map);
 }
@@ -0,0 +1,200 @@
+/*
+ *  Read path and page mode for the NOR flash on S3C2440 bank 0
+ *
+ *  Included by s3c_nor.c, B-partitions/s3c_nor.c and the Mini2440
+ *  mini2440_nor.c, each one a single module with its own map_info.
+ *  s3c_nor_ra_init() picks how array reads are done after simple_map_init():
+ *
+ *  0: uncached reads like before, memcpy_fromio does one bus cycle per byte
+ *  1: read-ahead window of ra_size bytes kept here
+ *  2: cacheable mapping for bulk reads, the D-cache does the read-ahead
+ *
+ *  Status and query reads always stay uncached, the command set calls
+ *  inval_cache before every write and erase.
+ */
+
+#include <linux/mtd/map.h>
+#include <linux/mtd/cfi.h>
+#include <linux/io.h>
+#include <asm/cacheflush.h>
+
+
+static int read_mode = 2;
+module_param(read_mode, int, S_IRUGO);
+
+/* Read-ahead window, a power of 2 from one cache line (32) to 4096 bytes */
+static int ra_size = 256;
+module_param(ra_size, int, S_IRUGO);
+
+/* 1: Use page mode reads on bank 0 when the CFI tables report a page size */
+static int page_mode = 1;
+module_param(page_mode, int, S_IRUGO);
+
+static unsigned long ra_hits;
+static unsigned long ra_misses;
+static unsigned long ra_bypass;
+static unsigned long ra_invals;
+module_param(ra_hits, ulong, S_IRUGO);
+module_param(ra_misses, ulong, S_IRUGO);
+module_param(ra_bypass, ulong, S_IRUGO);
+module_param(ra_invals, ulong, S_IRUGO);
+
+static u8 *s3c_nor_ra_buf;
+static unsigned long s3c_nor_ra_start = ~0UL;  /* flash offset of the window, ~0: empty */
+
+#define S3C_BANKCON0    0x48000004
+static void __iomem *s3c_nor_bankcon;
+static unsigned long s3c_nor_bankcon_saved;
+
+
+/*
+ *  32 bit loads where both sides are aligned, the memory controller turns
+ *  each into two 16 bit cycles (back to back page hits in page mode).
+ */
+static void s3c_nor_copy_fromio(void *to, const void __iomem *from, size_t len)
+{
+    u8 *dst = to;
+
+    if ((((unsigned long)dst | (unsigned long)from) & 3) == 0) {
+        for (; len >= 4; len -= 4, dst += 4, from += 4)
+            *(u32 *)dst = __raw_readl(from);
+    }
+
+    for (; len; len--)
+        *dst++ = __raw_readb(from++);
+}
+
+/* Array reads, called with the chip mutex held so the window needs no lock */
+static void s3c_nor_ra_copy_from(struct map_info *map, void *to, unsigned long from, ssize_t len)
+{
+    unsigned long start, off;
+    size_t n;
+
+    while (len > 0) {
+        start = from & ~(unsigned long)(ra_size - 1);
+        off = from - start;
+
+        if (start != s3c_nor_ra_start) {
+            /* Whole windows gain nothing from the copy, read them straight */
+            if (off == 0 && len >= ra_size) {
+                n = len & ~(ra_size - 1);
+                s3c_nor_copy_fromio(to, map->virt + from, n);
+                ra_bypass++;
+                to += n;
+                from += n;
+                len -= n;
+                continue;
+            }
+
+            s3c_nor_copy_fromio(s3c_nor_ra_buf, map->virt + start, ra_size);
+            s3c_nor_ra_start = start;
+            ra_misses++;
+        }else {
+            ra_hits++;
+        }
+
+        n = min_t(size_t, len, ra_size - off);
+        memcpy(to, s3c_nor_ra_buf + off, n);
+        to += n;
+        from += n;
+        len -= n;
+    }
+}
+
+/* INVALIDATE_CACHED_RANGE() of the command set, before program and erase */
+static void s3c_nor_inval_cache(struct map_info *map, unsigned long from, ssize_t len)
+{
+    if (map->cached)
+        flush_ioremap_region(map->phys, map->cached, from, len);
+
+    if (s3c_nor_ra_start != ~0UL &&
+        from < s3c_nor_ra_start + ra_size && from + len > s3c_nor_ra_start) {
+        s3c_nor_ra_start = ~0UL;
+        ra_invals++;
+    }
+}
+
+/*
+ *  BANKCON0 [1:0] PMC   - 01: 4 data page, 10: 8 data page
+ *  BANKCON0 [3:2] Tacp  - 10: 4 clocks for the page hits, 40ns at 101MHz
+ *  The S3C2440 has no synchronous burst on the SROM banks, page mode
+ *  reads are the fast path it offers for NOR.
+ */
+static void s3c_nor_page_mode(struct map_info *map)
+{
+    struct cfi_private *cfi = map->fldrv_priv;
+    struct cfi_pri_amdstd *extp;
+    unsigned long pmc;
+
+    if (!page_mode)
+        return;
+
+    if (cfi->cfi_mode != CFI_MODE_CFI || cfi->cfiq->P_ID != P_ID_AMD_STD || !cfi->cmdset_priv) {
+        printk("%s: page mode unknown for this chip, keep normal reads\n", map->name);
+        return;
+    }
+
+    /* PageMode: 0 - not supported, 1 - 4 word page, 2 - 8 word page */
+    extp = cfi->cmdset_priv;
+    switch (extp->PageMode) {
+    case 1:
+        pmc = 1;
+        break;
+    case 2:
+        pmc = 2;
+        break;
+    default:
+        printk("%s: chip has no page mode, keep normal reads\n", map->name);
+        return;
+    }
+
+    s3c_nor_bankcon = ioremap(S3C_BANKCON0, 4);
+    if (!s3c_nor_bankcon)
+        return;
+
+    s3c_nor_bankcon_saved = readl(s3c_nor_bankcon);
+    writel((s3c_nor_bankcon_saved & ~0xF) | (2<<2) | pmc, s3c_nor_bankcon);
+    printk("%s: %d word page mode reads\n", map->name, 4 << (pmc - 1));
+}
+
+/* After simple_map_init(), before the probe */
+static void s3c_nor_ra_init(struct map_info *map)
+{
+    /* The copy_from hook only exists with complex mappings */
+#ifndef CONFIG_MTD_COMPLEX_MAPPINGS
+    if (read_mode == 1) {
+        printk("%s: read_mode 1 needs CONFIG_MTD_COMPLEX_MAPPINGS, using 2\n", map->name);
+        read_mode = 2;
+    }
+#endif
+    if (read_mode == 1 &&
+        (ra_size < 32 || ra_size > 4096 || (ra_size & (ra_size - 1)) ||
+         !(s3c_nor_ra_buf = kmalloc(ra_size, GFP_KERNEL))))
+        read_mode = 2;
+    if (read_mode == 1)
+        map->copy_from = s3c_nor_ra_copy_from;
+    if (read_mode == 2)
+        map->cached = ioremap_cached(map->phys, map->size);
+    map->inval_cache = s3c_nor_inval_cache;
+    printk("%s: %s reads\n", map->name, s3c_nor_ra_buf ? "read-ahead" :
+        map->cached ? "cached" : "uncached");
+}
+
+/* Failed probe or unload, map->virt is still the driver's to unmap */
+static void s3c_nor_ra_exit(struct map_info *map)
+{
+    if (s3c_nor_bankcon) {
+        writel(s3c_nor_bankcon_saved, s3c_nor_bankcon);
+        iounmap(s3c_nor_bankcon);
+        s3c_nor_bankcon = NULL;
+    }
+
+    printk("%s: read-ahead %lu hits, %lu misses, %lu bypassed, %lu invalidated\n",
+        map->name, ra_hits, ra_misses, ra_bypass, ra_invals);
+    if (map->cached) {
+        iounmap(map->cached);
+        map->cached = NULL;
+    }
+    kfree(s3c_nor_ra_buf);
+    s3c_nor_ra_buf = NULL;
+}
@@ -14,24 +14,72 @@
 #include <linux/poll.h>
 #include <linux/types.h>
 #include <linux/dma-mapping.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/eventfd.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
 
 #include <asm/uaccess.h>
 #include <asm/io.h>  
 #include <asm/irq.h>
 
+#ifdef CONFIG_ARCH_S3C2410
 #include <mach/regs-gpio.h>
 #include <mach/hardware.h>
+#endif
 
 
 #define MEM_CPY_NO_DMA              (0)
 #define MEM_CPY_DMA                 (1)
+#define DMA_SUBMIT                  (2)     /* queue an array of s3c_dma_desc */
+#define DMA_REAP                    (3)     /* fetch an array of s3c_dma_done */
+#define DMA_SET_EVENTFD             (4)     /* signal an eventfd per completion, -1 to stop */
+#define DMA_ALLOC                   (5)     /* allocate a buffer, s3c_dma_alloc */
+#define DMA_FREE                    (6)     /* free a buffer by handle */
+#define DMA_BENCH                   (7)     /* size sweep, arg is iterations per size */
+#define DMA_GET_STATS               (8)     /* copy out struct s3c_dma_stats */
+#define DMA_RESET_STATS             (9)
 #define BUFF_SIZE                   (512*1024)
 
+/* 
+ *  The pool the descriptors point into, read()/write() reach it too.
+ *  The self test copies its first half to the second one.
+ */
+#define POOL_SIZE                   (2*BUFF_SIZE)
+
 #define DMA0_BASE_ADDRESS           (0x4B000000)
 #define DMA1_BASE_ADDRESS           (0x4B000040)
 #define DMA2_BASE_ADDRESS           (0x4B000080)
 #define DMA3_BASE_ADDRESS           (0x4B0000C0)
 
+#define DMA_NR_CHANNELS             (4)
+#define DMA_RING_SIZE               (64)        /* power of 2 */
+#define DMA_MAX_COUNT               (0xFFFFF)   /* DCON[19:0], in units of DSZ */
+
+/* 
+ *  Buffers of an open file. Handle 0 is the shared pool, handle h > 0 is 
+ *  mapped at offset h << DMA_MMAP_SHIFT of /dev/dma. 
+ */
+#define DMA_MAX_BUFS                (16)
+#define DMA_MAX_BUF_SIZE            (4*1024*1024)
+#define DMA_MMAP_SHIFT              (24)
+
+/* 
+ *  Latency statistics, per size class 64 B << n up to BUFF_SIZE. A transfer 
+ *  counts in the largest class not above its length. Bucket b of the 
+ *  histogram holds latencies in [2^(b-1), 2^b) ns. 
+ */
+#define DMA_MIN_SIZE_SHIFT          (6)
+#define DMA_NR_SIZES                (14)        /* 64 B .. 512 KB */
+#define DMA_HIST_BUCKETS            (32)
+#define DMA_BENCH_MAX_ITERS         (1000)
+
 
 struct s3c_dma_regs {
     unsigned long DISRC; 
@@ -45,31 +93,719 @@ struct s3c_dma_regs {
     unsigned long DMASKTRIG; 
 };
 
+/* One copy, as userspace describes it */
+struct s3c_dma_desc {
+    __u32 src_handle;           /* 0 for the pool, or from DMA_ALLOC */
+    __u32 src;                  /* offset in that buffer */
+    __u32 dst_handle;
+    __u32 dst;
+    __u32 len;                  /* bytes */
+    __u32 cookie;               /* handed back in s3c_dma_done */
+};
+
+/* DMA_ALLOC argument */
+struct s3c_dma_alloc {
+    __u32 size;                 /* in: bytes, rounded up to pages */
+    __u32 handle;               /* out */
+    __u64 offset;               /* out: mmap() offset */
+};
+
+struct s3c_dma_lat {
+    __u32 count;
+    __u32 min_ns;
+    __u32 max_ns;
+    __u32 pad;
+    __u64 sum_ns;
+    __u32 hist[DMA_HIST_BUCKETS];
+};
+
+/* DMA_GET_STATS */
+struct s3c_dma_stats {
+    __u32 nr_sizes;
+    __u32 crossover;            /* bytes from which DMA beats the CPU loop, 0: never */
+    struct s3c_dma_lat cpu[DMA_NR_SIZES];   /* byte loop, DMA_BENCH only */
+    struct s3c_dma_lat dma[DMA_NR_SIZES];   /* every request through the engine */
+    struct s3c_dma_lat bench[DMA_NR_SIZES]; /* DMA_BENCH, submit to return of each copy */
+};
+
+struct s3c_dma_buf {
+    char *virt;
+    dma_addr_t phys;
+    size_t size;                /* 0: slot unused */
+    unsigned int busy;          /* queued or running requests, under engine_lock */
+    atomic_t mapped;            /* live user mappings */
+};
+
+struct s3c_dma_done {
+    __u32 cookie;
+    __s32 status;               /* 0 or -errno */
+};
+
+/* DMA_SUBMIT/DMA_REAP argument */
+struct s3c_dma_batch {
+    __u64 ptr;                  /* user array of desc/done */
+    __u32 count;                /* in: array size, out: entries handled */
+    __u32 pad;
+};
+
+/* 
+ *  Per open file: finished requests wait here until DMA_REAP. A file never 
+ *  has more than DMA_RING_SIZE requests in flight plus unreaped, so the 
+ *  done ring can not overflow.
+ */
+struct s3c_dma_ctx {
+    struct s3c_dma_done done[DMA_RING_SIZE];
+    unsigned int done_head;
+    unsigned int done_tail;
+    unsigned int inflight;
+    wait_queue_head_t waitq;    /* completions */
+    struct eventfd_ctx *efd;
+    struct mutex buf_mutex;     /* alloc/free against each other and mmap */
+    struct s3c_dma_buf bufs[DMA_MAX_BUFS];  /* handle h is bufs[h - 1] */
+};
+
+struct s3c_dma_req {
+    struct s3c_dma_desc desc;
+    struct s3c_dma_buf *src_buf;
+    struct s3c_dma_buf *dst_buf;
+    struct s3c_dma_ctx *ctx;    /* owner, NULL for the self test */
+    struct completion *wait;    /* self test only */
+    ktime_t queued;
+};
+
+struct s3c_dma_chan {
+    int id;
+    int irq;
+    volatile struct s3c_dma_regs *regs;
+    int busy;
+    struct s3c_dma_req req;     /* the running request */
+    struct work_struct work;    /* memcpy backend */
+};
+
+/* 
+ *  The engine: submitters fill the ring, every idle channel takes the next 
+ *  request, and the channel interrupt finishes it and takes another. All 
+ *  of it is protected by engine_lock, taken from the interrupt handler too.
+ */
+static DEFINE_SPINLOCK(engine_lock);
+static struct s3c_dma_req engine_ring[DMA_RING_SIZE];
+static unsigned int engine_head;        /* next request to start */
+static unsigned int engine_tail;        /* next free slot */
+static DECLARE_WAIT_QUEUE_HEAD(engine_space_waitq);
+static struct s3c_dma_chan dma_chans[DMA_NR_CHANNELS];
+
+#ifdef CONFIG_ARCH_S3C2410
+static const unsigned long dma_base_address[DMA_NR_CHANNELS] = {
+    DMA0_BASE_ADDRESS, DMA1_BASE_ADDRESS, DMA2_BASE_ADDRESS, DMA3_BASE_ADDRESS,
+};
+
+static const int dma_irq[DMA_NR_CHANNELS] = {
+    IRQ_DMA0, IRQ_DMA1, IRQ_DMA2, IRQ_DMA3,
+};
+#endif
+
+/* 1: copy with memcpy from a workqueue, no controller needed */
+#ifdef CONFIG_ARCH_S3C2410
+static int use_memcpy = 0;
+#else
+static int use_memcpy = 1;
+#endif
+module_param(use_memcpy, int, S_IRUGO);
 
 static int major = 0;
 
-static char *src;
-static u32 src_phys;
-static char *dst;
-static u32 dst_phys;
+/* Handle 0, shared by every open file */
+static struct s3c_dma_buf dma_pool;
+
+/* dma[] is updated under engine_lock, cpu[] and bench[] only by the sweep under dma_bench_mutex */
+static struct s3c_dma_stats dma_stats;
+
+/* The self tests and the sweep all use the first and second pool halves */
+static DEFINE_MUTEX(dma_bench_mutex);
 
 static struct class *s3c_dma_cls;
 static struct device *s3c_dma_dev;
 
-static volatile struct s3c_dma_regs *dma_regs;
 
-static DECLARE_WAIT_QUEUE_HEAD(s3c_dma_waitq);
-static volatile int ev_dma;
+static inline unsigned int engine_ring_used(void)
+{
+    return engine_tail - engine_head;
+}
+
+static void s3c_dma_lat_add(struct s3c_dma_lat *lat, u32 len, s64 ns)
+{
+    int cls = ilog2(len) - DMA_MIN_SIZE_SHIFT;
+    u32 v = ns > 0xFFFFFFFFLL ? 0xFFFFFFFF : (u32)ns;
+
+    if (cls < 0)
+        cls = 0;
+    if (cls >= DMA_NR_SIZES)
+        cls = DMA_NR_SIZES - 1;
+    lat += cls;
+
+    if (!lat->count || v < lat->min_ns)
+        lat->min_ns = v;
+    if (v > lat->max_ns)
+        lat->max_ns = v;
+    lat->count++;
+    lat->sum_ns += v;
+    lat->hist[min(fls(v), DMA_HIST_BUCKETS - 1)]++;
+}
+
+#ifdef CONFIG_ARCH_S3C2410
+/* Program the channel registers for its request and trigger it */
+static void s3c_dma_chan_start_hw(struct s3c_dma_chan *chan)
+{
+    struct s3c_dma_desc *desc = &chan->req.desc;
+    unsigned long dsz = 0, count = desc->len;
+
+    /* Move words when everything is aligned, bytes otherwise */
+    if (!((desc->src | desc->dst | desc->len) & 3)) {
+        dsz = 2;
+        count = desc->len >> 2;
+    }
+
+    chan->regs->DISRC       = chan->req.src_buf->phys + desc->src;
+    chan->regs->DISRCC      = ((0<<1) | (0<<0));
+    chan->regs->DIDST       = chan->req.dst_buf->phys + desc->dst;
+    chan->regs->DIDSTC      = ((0<<2) | (0<<1) | (0<<0));
+    /* Whole service, software trigger, channel off at TC == 0 */
+    chan->regs->DCON        = ((1<<30) | (1<<29) | (0<<28) | (1<<27) | (0<<23) | 
+                               (1<<22) | (dsz<<20) | count);
+
+    /* Trigger the DMA channel */
+    chan->regs->DMASKTRIG   = ((1<<1) | (1<<0));
+}
+#endif
+
+/* Caller holds engine_lock */
+static void s3c_dma_chan_start(struct s3c_dma_chan *chan)
+{
+    if (use_memcpy) {
+        schedule_work(&chan->work);
+        return;
+    }
+
+#ifdef CONFIG_ARCH_S3C2410
+    s3c_dma_chan_start_hw(chan);
+#endif
+}
+
+/* Start queued requests on every idle channel, caller holds engine_lock */
+static void s3c_dma_kick(void)
+{
+    struct s3c_dma_chan *chan;
+    int i, started = 0;
+
+    for (i = 0; i < DMA_NR_CHANNELS && engine_head != engine_tail; i++) {
+        chan = &dma_chans[i];
+        if (chan->busy)
+            continue;
+
+        chan->req = engine_ring[engine_head & (DMA_RING_SIZE - 1)];
+        engine_head++;
+        chan->busy = 1;
+        s3c_dma_chan_start(chan);
+        started++;
+    }
+
+    if (started)
+        wake_up_interruptible(&engine_space_waitq);
+}
+
+/* The channel is done with its request, caller holds engine_lock */
+static void s3c_dma_finish(struct s3c_dma_chan *chan, int status)
+{
+    struct s3c_dma_req *req = &chan->req;
+    struct s3c_dma_ctx *ctx = req->ctx;
+    struct s3c_dma_done *done;
+
+    chan->busy = 0;
+    s3c_dma_lat_add(dma_stats.dma, req->desc.len, 
+        ktime_to_ns(ktime_sub(ktime_get(), req->queued)));
+    req->src_buf->busy--;
+    req->dst_buf->busy--;
+
+    if (req->wait) {
+        complete(req->wait);
+    } else if (ctx) {
+        done = &ctx->done[ctx->done_tail & (DMA_RING_SIZE - 1)];
+        done->cookie = req->desc.cookie;
+        done->status = status;
+        ctx->done_tail++;
+        ctx->inflight--;
+
+        wake_up(&ctx->waitq);       /* release() sleeps uninterruptibly */
+        if (ctx->efd)
+            eventfd_signal(ctx->efd, 1);
+    }
+
+    s3c_dma_kick();
+}
+
+#ifdef CONFIG_ARCH_S3C2410
+static irqreturn_t s3c_dma_irq(int irq, void *dev_id)
+{
+    struct s3c_dma_chan *chan = dev_id;
+
+    spin_lock(&engine_lock);
+    if (chan->busy)
+        s3c_dma_finish(chan, 0);
+    spin_unlock(&engine_lock);
+
+    return IRQ_HANDLED;
+}
+#endif
+
+static void s3c_dma_memcpy_work(struct work_struct *work)
+{
+    struct s3c_dma_chan *chan = container_of(work, struct s3c_dma_chan, work);
+    struct s3c_dma_desc *desc = &chan->req.desc;
+    unsigned long flags;
+
+    memcpy(chan->req.dst_buf->virt + desc->dst, chan->req.src_buf->virt + desc->src, desc->len);
+
+    spin_lock_irqsave(&engine_lock, flags);
+    s3c_dma_finish(chan, 0);
+    spin_unlock_irqrestore(&engine_lock, flags);
+}
+
+/* Handle to buffer, caller holds engine_lock or buf_mutex */
+static struct s3c_dma_buf *s3c_dma_lookup(struct s3c_dma_ctx *ctx, __u32 handle)
+{
+    if (handle == 0)
+        return &dma_pool;
+    if (!ctx || handle > DMA_MAX_BUFS || !ctx->bufs[handle - 1].size)
+        return NULL;
+    return &ctx->bufs[handle - 1];
+}
+
+static int s3c_dma_check(struct s3c_dma_desc *desc, struct s3c_dma_buf *sbuf, 
+    struct s3c_dma_buf *dbuf)
+{
+    if (!sbuf || !dbuf)
+        return -EBADF;
+
+    if (desc->len == 0 || desc->len > sbuf->size || desc->len > dbuf->size || 
+        desc->src > sbuf->size - desc->len || desc->dst > dbuf->size - desc->len)
+        return -EINVAL;
+
+    /* The controller copies forward only */
+    if (sbuf == dbuf && 
+        desc->src < desc->dst + desc->len && desc->dst < desc->src + desc->len)
+        return -EINVAL;
+
+    if (desc->len > DMA_MAX_COUNT && (desc->len > DMA_MAX_COUNT * 4 || 
+        ((desc->src | desc->dst | desc->len) & 3)))
+        return -EINVAL;
+
+    return 0;
+}
+
+/* Put one request on the ring, caller holds engine_lock */
+static int s3c_dma_queue(struct s3c_dma_ctx *ctx, struct s3c_dma_desc *desc, 
+    struct completion *wait)
+{
+    struct s3c_dma_buf *sbuf = s3c_dma_lookup(ctx, desc->src_handle);
+    struct s3c_dma_buf *dbuf = s3c_dma_lookup(ctx, desc->dst_handle);
+    struct s3c_dma_req *req;
+    int ret;
+
+    ret = s3c_dma_check(desc, sbuf, dbuf);
+    if (ret)
+        return ret;
+
+    if (engine_ring_used() >= DMA_RING_SIZE)
+        return -EAGAIN;
+
+    /* Room for the completion is reserved now */
+    if (ctx && ctx->inflight + (ctx->done_tail - ctx->done_head) >= DMA_RING_SIZE)
+        return -EBUSY;
+
+    req = &engine_ring[engine_tail & (DMA_RING_SIZE - 1)];
+    req->desc = *desc;
+    req->src_buf = sbuf;
+    req->dst_buf = dbuf;
+    req->ctx = ctx;
+    req->wait = wait;
+    req->queued = ktime_get();
+    engine_tail++;
+
+    /* DMA_FREE refuses buffers with requests on them */
+    sbuf->busy++;
+    dbuf->busy++;
+
+    if (ctx)
+        ctx->inflight++;
+
+    return 0;
+}
+
+static int s3c_dma_submit(struct file *filep, struct s3c_dma_ctx *ctx, 
+    struct s3c_dma_batch __user *ubatch)
+{
+    struct s3c_dma_desc __user *udesc;
+    struct s3c_dma_batch batch;
+    struct s3c_dma_desc desc;
+    unsigned long flags;
+    unsigned int i;
+    int ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    udesc = (struct s3c_dma_desc __user *)(unsigned long)batch.ptr;
+
+    for (i = 0; i < batch.count; i++) {
+        if (copy_from_user(&desc, udesc + i, sizeof(desc))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        spin_lock_irqsave(&engine_lock, flags);
+        ret = s3c_dma_queue(ctx, &desc, NULL);
+        /* Start what is queued so far before we might sleep */
+        if (ret)
+            s3c_dma_kick();
+        spin_unlock_irqrestore(&engine_lock, flags);
+
+        /* Engine ring full: wait for a channel to take something */
+        if (ret == -EAGAIN && !(filep->f_flags & O_NONBLOCK)) {
+            ret = wait_event_interruptible(engine_space_waitq, 
+                engine_ring_used() < DMA_RING_SIZE);
+            if (ret)
+                break;
+            i--;
+            continue;
+        }
+        if (ret)
+            break;
+    }
+
+    /* One doorbell for the whole batch */
+    spin_lock_irqsave(&engine_lock, flags);
+    s3c_dma_kick();
+    spin_unlock_irqrestore(&engine_lock, flags);
+
+    /* Partial success reports the count, the error only if nothing went */
+    if (i == 0 && ret)
+        return ret;
+
+    if (put_user(i, &ubatch->count))
+        return -EFAULT;
+    return 0;
+}
+
+static int s3c_dma_reap(struct file *filep, struct s3c_dma_ctx *ctx, 
+    struct s3c_dma_batch __user *ubatch)
+{
+    struct s3c_dma_done __user *udone;
+    struct s3c_dma_done done;
+    struct s3c_dma_batch batch;
+    unsigned long flags;
+    unsigned int i;
+    int ret;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    udone = (struct s3c_dma_done __user *)(unsigned long)batch.ptr;
+
+    /* Block for the first one only, and only if something is in flight */
+    if (batch.count && !(filep->f_flags & O_NONBLOCK)) {
+        ret = wait_event_interruptible(ctx->waitq, 
+            ctx->done_head != ctx->done_tail || !ACCESS_ONCE(ctx->inflight));
+        if (ret)
+            return ret;
+    }
+
+    for (i = 0; i < batch.count; i++) {
+        spin_lock_irqsave(&engine_lock, flags);
+        if (ctx->done_head == ctx->done_tail) {
+            spin_unlock_irqrestore(&engine_lock, flags);
+            break;
+        }
+        done = ctx->done[ctx->done_head & (DMA_RING_SIZE - 1)];
+        spin_unlock_irqrestore(&engine_lock, flags);
+
+        if (copy_to_user(udone + i, &done, sizeof(done)))
+            return -EFAULT;
+
+        /* Consume it only once userspace has it */
+        spin_lock_irqsave(&engine_lock, flags);
+        ctx->done_head++;
+        spin_unlock_irqrestore(&engine_lock, flags);
+    }
+
+    if (put_user(i, &ubatch->count))
+        return -EFAULT;
+    return 0;
+}
+
+static int s3c_dma_alloc_buf(struct s3c_dma_ctx *ctx, struct s3c_dma_alloc __user *uarg)
+{
+    struct s3c_dma_alloc arg;
+    struct s3c_dma_buf *buf = NULL;
+    unsigned long flags;
+    char *virt;
+    dma_addr_t phys;
+    size_t size;
+    int i;
+
+    if (copy_from_user(&arg, uarg, sizeof(arg)))
+        return -EFAULT;
+
+    size = PAGE_ALIGN(arg.size);
+    if (size == 0 || size > DMA_MAX_BUF_SIZE)
+        return -EINVAL;
+
+    mutex_lock(&ctx->buf_mutex);
+
+    for (i = 0; i < DMA_MAX_BUFS; i++)
+        if (!ctx->bufs[i].size) {
+            buf = &ctx->bufs[i];
+            break;
+        }
+    if (!buf) {
+        mutex_unlock(&ctx->buf_mutex);
+        return -ENOSPC;
+    }
+
+    /* WARNING: DO NOT use kmalloc to allocate */
+    virt = dma_alloc_writecombine(NULL, size, &phys, GFP_KERNEL);
+    if (NULL == virt) {
+        mutex_unlock(&ctx->buf_mutex);
+        return -ENOMEM;
+    }
+
+    /* Published under engine_lock, the submit path looks it up there */
+    spin_lock_irqsave(&engine_lock, flags);
+    buf->virt = virt;
+    buf->phys = phys;
+    buf->size = size;
+    buf->busy = 0;
+    atomic_set(&buf->mapped, 0);
+    spin_unlock_irqrestore(&engine_lock, flags);
+
+    mutex_unlock(&ctx->buf_mutex);
+
+    arg.handle = i + 1;
+    arg.offset = (__u64)arg.handle << DMA_MMAP_SHIFT;
+    if (copy_to_user(uarg, &arg, sizeof(arg)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int s3c_dma_free_buf(struct s3c_dma_ctx *ctx, __u32 handle)
+{
+    struct s3c_dma_buf *buf, old;
+    unsigned long flags;
+
+    if (handle == 0)
+        return -EINVAL;
+
+    mutex_lock(&ctx->buf_mutex);
+    spin_lock_irqsave(&engine_lock, flags);
+
+    buf = s3c_dma_lookup(ctx, handle);
+    if (!buf || buf->busy || atomic_read(&buf->mapped)) {
+        spin_unlock_irqrestore(&engine_lock, flags);
+        mutex_unlock(&ctx->buf_mutex);
+        return buf ? -EBUSY : -EBADF;
+    }
+    old = *buf;
+    buf->size = 0;
+
+    spin_unlock_irqrestore(&engine_lock, flags);
+    mutex_unlock(&ctx->buf_mutex);
+
+    dma_free_writecombine(NULL, old.size, old.virt, old.phys);
+    return 0;
+}
+
+static int s3c_dma_set_eventfd(struct s3c_dma_ctx *ctx, int fd)
+{
+    struct eventfd_ctx *efd = NULL, *old;
+    unsigned long flags;
+
+    if (fd >= 0) {
+        efd = eventfd_ctx_fdget(fd);
+        if (IS_ERR(efd))
+            return PTR_ERR(efd);
+    }
+
+    spin_lock_irqsave(&engine_lock, flags);
+    old = ctx->efd;
+    ctx->efd = efd;
+    spin_unlock_irqrestore(&engine_lock, flags);
+
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+/* Copy len bytes from the first pool half to the second, as one engine request */
+static int s3c_dma_copy_sync(u32 len)
+{
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct s3c_dma_desc desc = {
+        .src_handle = 0,
+        .src        = 0,
+        .dst_handle = 0,
+        .dst        = BUFF_SIZE,
+        .len        = len,
+    };
+    unsigned long flags;
+    int ret;
+
+    for (;;) {
+        spin_lock_irqsave(&engine_lock, flags);
+        ret = s3c_dma_queue(NULL, &desc, &done);
+        if (!ret)
+            s3c_dma_kick();
+        spin_unlock_irqrestore(&engine_lock, flags);
+
+        if (!ret)
+            break;
+        ret = wait_event_interruptible(engine_space_waitq, 
+            engine_ring_used() < DMA_RING_SIZE);
+        if (ret)
+            return ret;
+    }
+
+    /* The stack frame holds the completion, so no interruptible sleep here */
+    wait_for_completion(&done);
+    return 0;
+}
+
+/* The CPU side of the comparison, the byte loop of MEM_CPY_NO_DMA */
+static void s3c_dma_cpu_copy(u32 len)
+{
+    char *src = dma_pool.virt;
+    char *dst = dma_pool.virt + BUFF_SIZE;
+    u32 i;
+
+    for (i = 0; i < len; ++i)
+        dst[i] = src[i];
+}
+
+static void s3c_dma_reset_stats(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&engine_lock, flags);
+    memset(&dma_stats, 0, sizeof(dma_stats));
+    dma_stats.nr_sizes = DMA_NR_SIZES;
+    spin_unlock_irqrestore(&engine_lock, flags);
+}
+
+/* 
+ *  Smallest size class from which DMA is faster on average for it and every 
+ *  larger class measured. Means are compared as sum_a * count_b < sum_b * count_a. 
+ *  Only the sweep's own copies count, timed around the whole call like 
+ *  the CPU loop: dma[] also holds other clients' transfers and leaves out 
+ *  the interrupt and the wakeup a caller pays for.
+ */
+static u32 s3c_dma_crossover(struct s3c_dma_stats *st)
+{
+    u32 crossover = 0;
+    int i;
+
+    for (i = DMA_NR_SIZES - 1; i >= 0; i--) {
+        if (!st->cpu[i].count || !st->bench[i].count)
+            continue;
+        if (st->bench[i].sum_ns * st->cpu[i].count >= st->cpu[i].sum_ns * st->bench[i].count)
+            break;
+        crossover = 1 << (i + DMA_MIN_SIZE_SHIFT);
+    }
+
+    return crossover;
+}
+
+/* Time iters byte loops and iters DMA requests for every size class */
+static int s3c_dma_bench(unsigned long iters)
+{
+    u32 len;
+    ktime_t start;
+    unsigned long n;
+    int i, ret = 0;
+
+    if (iters == 0 || iters > DMA_BENCH_MAX_ITERS)
+        return -EINVAL;
+
+    mutex_lock(&dma_bench_mutex);
+    s3c_dma_reset_stats();
+    memset(dma_pool.virt, 0xAA, BUFF_SIZE);
+
+    for (i = 0; i < DMA_NR_SIZES && !ret; i++) {
+        len = 1 << (i + DMA_MIN_SIZE_SHIFT);
+
+        for (n = 0; n < iters; n++) {
+            start = ktime_get();
+            s3c_dma_cpu_copy(len);
+            s3c_dma_lat_add(dma_stats.cpu, len, ktime_to_ns(ktime_sub(ktime_get(), start)));
+        }
+
+        /* Submit, interrupt, wakeup and return, all of what a caller waits for */
+        for (n = 0; n < iters && !ret; n++) {
+            start = ktime_get();
+            ret = s3c_dma_copy_sync(len);
+            if (!ret)
+                s3c_dma_lat_add(dma_stats.bench, len, ktime_to_ns(ktime_sub(ktime_get(), start)));
+        }
+
+        if (signal_pending(current))
+            ret = -ERESTARTSYS;
+    }
+
+    dma_stats.crossover = s3c_dma_crossover(&dma_stats);
+    mutex_unlock(&dma_bench_mutex);
+
+    if (!ret && dma_stats.crossover)
+        printk("s3c_dma: DMA beats the CPU loop from %u bytes\n", dma_stats.crossover);
+    else if (!ret)
+        printk("s3c_dma: DMA never beats the CPU loop\n");
+
+    return ret;
+}
+
+static int s3c_dma_get_stats(struct s3c_dma_stats __user *ustats)
+{
+    struct s3c_dma_stats *st;
+    unsigned long flags;
+    int ret = 0;
+
+    st = kmalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+
+    spin_lock_irqsave(&engine_lock, flags);
+    *st = dma_stats;
+    spin_unlock_irqrestore(&engine_lock, flags);
+
+    st->nr_sizes = DMA_NR_SIZES;
+    st->crossover = s3c_dma_crossover(st);
+
+    if (copy_to_user(ustats, st, sizeof(*st)))
+        ret = -EFAULT;
+
+    kfree(st);
+    return ret;
+}
 
 static long s3c_dma_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 {
+    struct s3c_dma_ctx *ctx = filep->private_data;
+    char *src = dma_pool.virt;
+    char *dst = dma_pool.virt + BUFF_SIZE;
     int i;
 
-    memset(src, 0xAA, BUFF_SIZE);
-    memset(dst, 0xCC, BUFF_SIZE);
-    
     switch (cmd) {
         case MEM_CPY_NO_DMA: 
+            mutex_lock(&dma_bench_mutex);
+            memset(src, 0xAA, BUFF_SIZE);
+            memset(dst, 0xCC, BUFF_SIZE);
+
             for (i = 0; i < BUFF_SIZE; ++i)
                 dst[i] = src[i];
             
@@ -77,109 +813,323 @@ static long s3c_dma_ioctl(struct file *filep, unsigned int cmd, unsigned long ar
                 printk("MEM_CPY_NO_DMA is fine\n");
             else
                 printk("MEM_CPY_NO_DMA is error\n");
+            mutex_unlock(&dma_bench_mutex);
                 
             break;
         case MEM_CPY_DMA: 
-            ev_dma = 0;
-            dma_regs->DISRC         = src_phys;
-            dma_regs->DISRCC        = ((0<<1) | (0<<0));
-            dma_regs->DIDST         = dst_phys;
-            dma_regs->DIDSTC        = ((0<<2) | (0<<1) | (0<<0));
-            dma_regs->DCON          = ((1<<30) | (1<<29) | (0<<28) | (1<<27) | (0<<23) | (0<<20) | (BUFF_SIZE));
-
-            /* Trigger the DMA channel 0 */
-            dma_regs->DMASKTRIG     = ((1<<1) | (1<<0));
-
-            /* Sleep */
-            wait_event_interruptible(s3c_dma_waitq, ev_dma);
+            mutex_lock(&dma_bench_mutex);
+            memset(src, 0xAA, BUFF_SIZE);
+            memset(dst, 0xCC, BUFF_SIZE);
+
+            if (s3c_dma_copy_sync(BUFF_SIZE)) {
+                mutex_unlock(&dma_bench_mutex);
+                return -ERESTARTSYS;
+            }
             
             if (memcmp(src, dst, BUFF_SIZE) == 0)
                 printk("MEM_CPY_DMA is fine\n");
             else
                 printk("MEM_CPY_DMA is error\n");
+            mutex_unlock(&dma_bench_mutex);
 
             break;
+        case DMA_SUBMIT:
+            return s3c_dma_submit(filep, ctx, (struct s3c_dma_batch __user *)arg);
+        case DMA_REAP:
+            return s3c_dma_reap(filep, ctx, (struct s3c_dma_batch __user *)arg);
+        case DMA_SET_EVENTFD:
+            return s3c_dma_set_eventfd(ctx, (int)arg);
+        case DMA_ALLOC:
+            return s3c_dma_alloc_buf(ctx, (struct s3c_dma_alloc __user *)arg);
+        case DMA_FREE:
+            return s3c_dma_free_buf(ctx, (__u32)arg);
+        case DMA_BENCH:
+            return s3c_dma_bench(arg);
+        case DMA_GET_STATS:
+            return s3c_dma_get_stats((struct s3c_dma_stats __user *)arg);
+        case DMA_RESET_STATS:
+            s3c_dma_reset_stats();
+            break;
+        default:
+            return -EINVAL;
     }
     
     return 0;
 }
 
-static irqreturn_t s3c_dma_irq(int irq, void *dev_id)
+static unsigned int s3c_dma_poll(struct file *filep, poll_table *wait)
 {
-    ev_dma = 1;
-    wake_up_interruptible(&s3c_dma_waitq);
-    return IRQ_HANDLED;
+    struct s3c_dma_ctx *ctx = filep->private_data;
+    unsigned int mask = 0;
+    unsigned long flags;
+
+    poll_wait(filep, &ctx->waitq, wait);
+    poll_wait(filep, &engine_space_waitq, wait);
+
+    spin_lock_irqsave(&engine_lock, flags);
+    if (ctx->done_head != ctx->done_tail)
+        mask |= POLLIN | POLLRDNORM;
+    if (engine_ring_used() < DMA_RING_SIZE && 
+        ctx->inflight + (ctx->done_tail - ctx->done_head) < DMA_RING_SIZE)
+        mask |= POLLOUT | POLLWRNORM;
+    spin_unlock_irqrestore(&engine_lock, flags);
+
+    return mask;
+}
+
+/* read()/write() reach the pool, to fill sources and check results */
+static ssize_t s3c_dma_read(struct file *filep, char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned long p = *ppos;
+
+    if (p >= POOL_SIZE)
+        return 0;
+    if (count > POOL_SIZE - p)
+        count = POOL_SIZE - p;
+
+    if (copy_to_user(buf, dma_pool.virt + p, count))
+        return -EFAULT;
+
+    *ppos += count;
+    return count;
+}
+
+static ssize_t s3c_dma_write(struct file *filep, const char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned long p = *ppos;
+
+    if (p >= POOL_SIZE)
+        return count ? -ENOSPC : 0;
+    if (count > POOL_SIZE - p)
+        count = POOL_SIZE - p;
+
+    if (copy_from_user(dma_pool.virt + p, buf, count))
+        return -EFAULT;
+
+    *ppos += count;
+    return count;
+}
+
+/* 
+ *  Offset 0 maps the pool, offset h << DMA_MMAP_SHIFT buffer h. Mappings 
+ *  are write combined, like the kernel side, so the controller sees what 
+ *  userspace wrote without a cache flush.
+ */
+static void s3c_dma_vma_open(struct vm_area_struct *vma)
+{
+    struct s3c_dma_buf *buf = vma->vm_private_data;
+
+    atomic_inc(&buf->mapped);
+}
+
+static void s3c_dma_vma_close(struct vm_area_struct *vma)
+{
+    struct s3c_dma_buf *buf = vma->vm_private_data;
+
+    atomic_dec(&buf->mapped);
+}
+
+/* Counts the mappings, DMA_FREE must not pull the pages from under them */
+static const struct vm_operations_struct s3c_dma_vm_ops = {
+    .open       = s3c_dma_vma_open,
+    .close      = s3c_dma_vma_close,
+};
+
+static int s3c_dma_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    struct s3c_dma_ctx *ctx = filep->private_data;
+    unsigned long handle = vma->vm_pgoff >> (DMA_MMAP_SHIFT - PAGE_SHIFT);
+    unsigned long size = vma->vm_end - vma->vm_start;
+    struct s3c_dma_buf *buf;
+    int ret;
+
+    if (vma->vm_pgoff & ((1UL << (DMA_MMAP_SHIFT - PAGE_SHIFT)) - 1))
+        return -EINVAL;
+
+    mutex_lock(&ctx->buf_mutex);
+    buf = s3c_dma_lookup(ctx, handle);
+    if (!buf || size > buf->size) {
+        mutex_unlock(&ctx->buf_mutex);
+        return -EINVAL;
+    }
+
+    /* dma_mmap_writecombine() maps from the start of the buffer */
+    vma->vm_pgoff = 0;
+    ret = dma_mmap_writecombine(NULL, vma, buf->virt, buf->phys, size);
+    if (!ret) {
+        vma->vm_ops = &s3c_dma_vm_ops;
+        vma->vm_private_data = buf;
+        s3c_dma_vma_open(vma);
+    }
+    mutex_unlock(&ctx->buf_mutex);
+
+    return ret;
+}
+
+static int s3c_dma_open(struct inode *inode, struct file *filep)
+{
+    struct s3c_dma_ctx *ctx;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+
+    init_waitqueue_head(&ctx->waitq);
+    mutex_init(&ctx->buf_mutex);
+    filep->private_data = ctx;
+
+    return 0;
+}
+
+static int s3c_dma_release(struct inode *inode, struct file *filep)
+{
+    struct s3c_dma_ctx *ctx = filep->private_data;
+    int i;
+
+    /* The channels still point at ctx until its requests are finished */
+    wait_event(ctx->waitq, !ACCESS_ONCE(ctx->inflight));
+
+    /* No mapping is left either, it would hold a reference on filep */
+    for (i = 0; i < DMA_MAX_BUFS; i++)
+        if (ctx->bufs[i].size)
+            dma_free_writecombine(NULL, ctx->bufs[i].size, 
+                ctx->bufs[i].virt, ctx->bufs[i].phys);
+
+    if (ctx->efd)
+        eventfd_ctx_put(ctx->efd);
+    kfree(ctx);
+
+    return 0;
 }
 
 static struct file_operations s3c_dma_fops = {
     .owner              = THIS_MODULE,
+    .open               = s3c_dma_open,
+    .release            = s3c_dma_release,
+    .read               = s3c_dma_read,
+    .write              = s3c_dma_write,
+    .poll               = s3c_dma_poll,
+    .mmap               = s3c_dma_mmap,
     .unlocked_ioctl     = s3c_dma_ioctl,
 };
 
+static void s3c_dma_release_chans(int nr)
+{
+    while (nr--) {
+        if (use_memcpy) {
+            flush_work(&dma_chans[nr].work);
+            continue;
+        }
+#ifdef CONFIG_ARCH_S3C2410
+        free_irq(dma_chans[nr].irq, &dma_chans[nr]);
+        iounmap(dma_chans[nr].regs);
+#endif
+    }
+}
+
+static int s3c_dma_setup_chans(void)
+{
+    struct s3c_dma_chan *chan;
+    int i;
+
+    for (i = 0; i < DMA_NR_CHANNELS; i++) {
+        chan = &dma_chans[i];
+        chan->id = i;
+        INIT_WORK(&chan->work, s3c_dma_memcpy_work);
+
+        if (use_memcpy)
+            continue;
+
+#ifdef CONFIG_ARCH_S3C2410
+        chan->irq = dma_irq[i];
+        chan->regs = ioremap(dma_base_address[i], sizeof(struct s3c_dma_regs));
+        if (NULL == chan->regs) {
+            printk(KERN_ERR "s3c_dma: ioremap of channel %d failed\n", i);        
+            goto fail;
+        }
+
+        if (request_irq(chan->irq, s3c_dma_irq, 0, "s3c_dma", chan) < 0) {
+            printk(KERN_ERR "s3c_dma: interrupt request of channel %d failed.\n", i);        
+            iounmap(chan->regs);
+            goto fail;
+        }
+#endif
+    }
+
+    return 0;
+
+#ifdef CONFIG_ARCH_S3C2410
+fail:
+    s3c_dma_release_chans(i);
+    return -EBUSY;
+#endif
+}
+
 static int __init s3c_dma_init(void)
 {
+    int ret;
 
-    /* Allocate SRC, DST buffers, WARNING: DO NOT use kmalloc to allocate */
-    src = dma_alloc_writecombine(NULL, BUFF_SIZE, &src_phys, GFP_KERNEL);
-    if (NULL == src) {
-        printk("dma_alloc_writecombine for src failed\n");
-        return -ENOMEM;
+#ifndef CONFIG_ARCH_S3C2410
+    if (!use_memcpy) {
+        printk("s3c_dma: no S3C2440 DMA controller in this kernel, using memcpy\n");
+        use_memcpy = 1;
     }
-    
-    dst = dma_alloc_writecombine(NULL, BUFF_SIZE, &dst_phys, GFP_KERNEL);
-    if (NULL == dst) {
-        dma_free_writecombine(NULL, BUFF_SIZE, src, src_phys);
-        printk("dma_alloc_writecombine for dst failed\n");
+#endif
+
+    /* Allocate the pool, WARNING: DO NOT use kmalloc to allocate */
+    dma_pool.size = POOL_SIZE;
+    dma_pool.virt = dma_alloc_writecombine(NULL, POOL_SIZE, &dma_pool.phys, GFP_KERNEL);
+    if (NULL == dma_pool.virt) {
+        printk("dma_alloc_writecombine for pool failed\n");
         return -ENOMEM;
     }
 
 	if ((major = register_chrdev(0, "s3c_dma", &s3c_dma_fops)) < 0) {
 		printk(KERN_ERR "unable to register major device number %d\n", major);
-		return -EIO;
+        ret = -EIO;
+        goto fail_chrdev;
 	}
 
 	s3c_dma_cls = class_create(THIS_MODULE, "s3c_dma");
-	if(IS_ERR(s3c_dma_cls))
-		return PTR_ERR(s3c_dma_cls);
+	if(IS_ERR(s3c_dma_cls)) {
+        ret = PTR_ERR(s3c_dma_cls);
+        goto fail_class;
+    }
 
 	s3c_dma_dev = device_create(s3c_dma_cls, NULL, MKDEV(major, 0), NULL, "dma"); 
-	if(IS_ERR(s3c_dma_dev))
-		return PTR_ERR(s3c_dma_dev);
-
-    dma_regs = ioremap(DMA0_BASE_ADDRESS, sizeof(struct s3c_dma_regs));
-    if (NULL== dma_regs) {
-        printk(KERN_ERR "s3c_dma: ioremap failed\n");        
-        device_destroy(s3c_dma_cls, MKDEV(major, 0));
-        class_destroy(s3c_dma_cls);
-        unregister_chrdev(major, "s3c_dma");
-        dma_free_writecombine(NULL, BUFF_SIZE, src, src_phys);
-        dma_free_writecombine(NULL, BUFF_SIZE, dst, dst_phys);
-        return -EIO;
-    }
-
-	if (request_irq(IRQ_DMA0, s3c_dma_irq, 0, "s3c_dma", NULL) < 0) {
-		printk(KERN_ERR "s3c_dma: interrupt request failed.\n");        
-        iounmap(dma_regs);
-        device_destroy(s3c_dma_cls, MKDEV(major, 0));
-        class_destroy(s3c_dma_cls);
-        unregister_chrdev(major, "s3c_dma");
-        dma_free_writecombine(NULL, BUFF_SIZE, src, src_phys);
-        dma_free_writecombine(NULL, BUFF_SIZE, dst, dst_phys);
-		return -EBUSY;
-	}
-        
+	if(IS_ERR(s3c_dma_dev)) {
+        ret = PTR_ERR(s3c_dma_dev);
+        goto fail_device;
+    }
+
+    dma_stats.nr_sizes = DMA_NR_SIZES;
+
+    ret = s3c_dma_setup_chans();
+    if (ret)
+        goto fail_chans;
+
+    printk("s3c_dma: %d channels, %s backend\n", DMA_NR_CHANNELS, 
+        use_memcpy ? "memcpy" : "controller");
     return 0;
+
+fail_chans:
+    device_destroy(s3c_dma_cls, MKDEV(major, 0));
+fail_device:
+    class_destroy(s3c_dma_cls);
+fail_class:
+    unregister_chrdev(major, "s3c_dma");
+fail_chrdev:
+    dma_free_writecombine(NULL, POOL_SIZE, dma_pool.virt, dma_pool.phys);
+    return ret;
 }
 
 static void __exit s3c_dma_exit(void)
 {
-    free_irq(IRQ_DMA0, NULL);
-    iounmap(dma_regs);
+    s3c_dma_release_chans(DMA_NR_CHANNELS);
     device_destroy(s3c_dma_cls, MKDEV(major, 0));
     class_destroy(s3c_dma_cls);
     unregister_chrdev(major, "s3c_dma");
-    dma_free_writecombine(NULL, BUFF_SIZE, src, src_phys);
-    dma_free_writecombine(NULL, BUFF_SIZE, dst, dst_phys);
+    dma_free_writecombine(NULL, POOL_SIZE, dma_pool.virt, dma_pool.phys);
 }
 
 module_init(s3c_dma_init);
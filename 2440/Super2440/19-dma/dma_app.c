@@ -2,31 +2,344 @@
 /*
  *  Usage:  ./dma_app nodma
  *          ./dma_app dma
+ *          ./dma_app engine [count] [len]
+ *          ./dma_app bench
+ *          ./dma_app sweep [iters]
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <linux/types.h>
 
 
 #define MEM_CPY_NO_DMA              (0)
 #define MEM_CPY_DMA                 (1)
+#define DMA_SUBMIT                  (2)
+#define DMA_REAP                    (3)
+#define DMA_SET_EVENTFD             (4)
+#define DMA_ALLOC                   (5)
+#define DMA_FREE                    (6)
+#define DMA_BENCH                   (7)
+#define DMA_GET_STATS               (8)
+#define DMA_RESET_STATS             (9)
+
+#define POOL_SIZE                   (1024*1024)
+#define DMA_RING_SIZE               (64)
+
+#define BENCH_MIN_SIZE              (64)
+#define BENCH_MAX_SIZE              (512*1024)
+#define BENCH_BYTES                 (4*1024*1024)   /* moved per size and method */
+
+struct s3c_dma_desc {
+    __u32 src_handle;
+    __u32 src;
+    __u32 dst_handle;
+    __u32 dst;
+    __u32 len;
+    __u32 cookie;
+};
+
+#define DMA_MIN_SIZE_SHIFT          (6)
+#define DMA_NR_SIZES                (14)
+#define DMA_HIST_BUCKETS            (32)
+
+struct s3c_dma_lat {
+    __u32 count;
+    __u32 min_ns;
+    __u32 max_ns;
+    __u32 pad;
+    __u64 sum_ns;
+    __u32 hist[DMA_HIST_BUCKETS];
+};
+
+struct s3c_dma_stats {
+    __u32 nr_sizes;
+    __u32 crossover;
+    struct s3c_dma_lat cpu[DMA_NR_SIZES];
+    struct s3c_dma_lat dma[DMA_NR_SIZES];
+    struct s3c_dma_lat bench[DMA_NR_SIZES];
+};
+
+struct s3c_dma_alloc {
+    __u32 size;
+    __u32 handle;
+    __u64 offset;
+};
+
+struct s3c_dma_done {
+    __u32 cookie;
+    __s32 status;
+};
+
+struct s3c_dma_batch {
+    __u64 ptr;
+    __u32 count;
+    __u32 pad;
+};
 
 
 void print_usage(char *name)
 {
     printf("Usage:\n");
     printf("%s <nodma | dma>\n", name);
+    printf("%s engine [count] [len]\n", name);
+    printf("%s bench\n", name);
+    printf("%s sweep [iters]\n", name);
+}
+
+static double now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/* 
+ *  Copy count chunks of len bytes from the first half of the pool to the 
+ *  second one through the descriptor engine, then check the result. 
+ */
+static int engine_test(int fd, int count, int len)
+{
+    struct s3c_dma_desc desc[DMA_RING_SIZE];
+    struct s3c_dma_done done[DMA_RING_SIZE];
+    struct s3c_dma_batch batch;
+    struct pollfd pfd;
+    struct timeval start, end;
+    char *src, *dst;
+    int i, n, submitted = 0, reaped = 0, errors = 0;
+    double usec;
+
+    if (count <= 0 || len <= 0 || (long)count * len > POOL_SIZE / 2) {
+        printf("count * len has to fit in %d bytes\n", POOL_SIZE / 2);
+        return -1;
+    }
+
+    src = malloc(count * len);
+    dst = malloc(count * len);
+    if (!src || !dst)
+        return -1;
+
+    for (i = 0; i < count * len; i++)
+        src[i] = i * 7 + 3;
+    pwrite(fd, src, count * len, 0);
+
+    pfd.fd = fd;
+    gettimeofday(&start, NULL);
+
+    while (reaped < count) {
+        /* Fill the ring as far as it goes */
+        for (n = 0; submitted + n < count && n < DMA_RING_SIZE; n++) {
+            desc[n].src_handle  = 0;
+            desc[n].src         = (submitted + n) * len;
+            desc[n].dst_handle  = 0;
+            desc[n].dst         = POOL_SIZE / 2 + (submitted + n) * len;
+            desc[n].len         = len;
+            desc[n].cookie      = submitted + n;
+        }
+        if (n) {
+            batch.ptr = (unsigned long)desc;
+            batch.count = n;
+            if (ioctl(fd, DMA_SUBMIT, &batch) == 0)
+                submitted += batch.count;
+        }
+
+        /* Wait for completions, then take them all */
+        pfd.events = POLLIN;
+        poll(&pfd, 1, 1000);
+
+        batch.ptr = (unsigned long)done;
+        batch.count = DMA_RING_SIZE;
+        if (ioctl(fd, DMA_REAP, &batch) < 0) {
+            printf("DMA_REAP failed\n");
+            return -1;
+        }
+        for (i = 0; i < (int)batch.count; i++)
+            if (done[i].status)
+                errors++;
+        reaped += batch.count;
+    }
+
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+
+    pread(fd, dst, count * len, POOL_SIZE / 2);
+    if (memcmp(src, dst, count * len))
+        errors++;
+
+    printf("engine: %d x %d bytes in %.0f us, %.2f MB/s, %s\n", count, len, usec, 
+        (double)count * len / usec, errors ? "error" : "fine");
+
+    free(src);
+    free(dst);
+    return errors ? -1 : 0;
+}
+
+/* Copy count chunks of size bytes from buffer hs to hd, count <= DMA_RING_SIZE */
+static int dma_copy_batch(int fd, int hs, int hd, int size, int count)
+{
+    struct s3c_dma_desc desc[DMA_RING_SIZE];
+    struct s3c_dma_done done[DMA_RING_SIZE];
+    struct s3c_dma_batch batch;
+    int i, reaped = 0;
+
+    for (i = 0; i < count; i++) {
+        desc[i].src_handle  = hs;
+        desc[i].src         = 0;
+        desc[i].dst_handle  = hd;
+        desc[i].dst         = 0;
+        desc[i].len         = size;
+        desc[i].cookie      = i;
+    }
+
+    batch.ptr = (unsigned long)desc;
+    batch.count = count;
+    if (ioctl(fd, DMA_SUBMIT, &batch) < 0 || (int)batch.count != count)
+        return -1;
+
+    while (reaped < count) {
+        batch.ptr = (unsigned long)done;
+        batch.count = count - reaped;
+        if (ioctl(fd, DMA_REAP, &batch) < 0)
+            return -1;
+        for (i = 0; i < (int)batch.count; i++)
+            if (done[i].status)
+                return -1;
+        reaped += batch.count;
+    }
+
+    return 0;
+}
+
+/* 
+ *  CPU memcpy between malloc'd buffers, what applications do today, 
+ *  against DMA between mapped DMA buffers, for sizes 64 B .. 512 KB. 
+ */
+static int bench(int fd)
+{
+    struct s3c_dma_alloc as, ad;
+    char *cpu_src, *cpu_dst, *map_src, *map_dst;
+    int size, iters, i, n, ret = 0;
+    double t, cpu_usec, dma_usec;
+
+    as.size = ad.size = BENCH_MAX_SIZE;
+    if (ioctl(fd, DMA_ALLOC, &as) < 0 || ioctl(fd, DMA_ALLOC, &ad) < 0) {
+        printf("DMA_ALLOC failed\n");
+        return -1;
+    }
+
+    map_src = mmap(NULL, BENCH_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, as.offset);
+    map_dst = mmap(NULL, BENCH_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, ad.offset);
+    cpu_src = malloc(BENCH_MAX_SIZE);
+    cpu_dst = malloc(BENCH_MAX_SIZE);
+    if (map_src == MAP_FAILED || map_dst == MAP_FAILED || !cpu_src || !cpu_dst) {
+        printf("buffer setup failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < BENCH_MAX_SIZE; i++)
+        cpu_src[i] = map_src[i] = i * 7 + 3;
+
+    printf("%10s %12s %12s\n", "size", "cpu MB/s", "dma MB/s");
+
+    for (size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+        iters = BENCH_BYTES / size;
+
+        t = now_usec();
+        for (i = 0; i < iters; i++)
+            memcpy(cpu_dst, cpu_src, size);
+        cpu_usec = now_usec() - t;
+
+        memset(map_dst, 0, size);
+        t = now_usec();
+        for (i = 0; i < iters; i += n) {
+            n = iters - i < DMA_RING_SIZE ? iters - i : DMA_RING_SIZE;
+            if (dma_copy_batch(fd, as.handle, ad.handle, size, n)) {
+                printf("dma copy of %d bytes failed\n", size);
+                ret = -1;
+                goto out;
+            }
+        }
+        dma_usec = now_usec() - t;
+
+        if (memcmp(map_src, map_dst, size)) {
+            printf("dma copy of %d bytes is error\n", size);
+            ret = -1;
+        }
+
+        printf("%10d %12.2f %12.2f\n", size, 
+            (double)iters * size / cpu_usec, (double)iters * size / dma_usec);
+    }
+
+out:
+    munmap(map_src, BENCH_MAX_SIZE);
+    munmap(map_dst, BENCH_MAX_SIZE);
+    ioctl(fd, DMA_FREE, as.handle);
+    ioctl(fd, DMA_FREE, ad.handle);
+    free(cpu_src);
+    free(cpu_dst);
+    return ret;
+}
+
+static void print_lat(const char *name, struct s3c_dma_lat *lat)
+{
+    int b;
+
+    if (!lat->count)
+        return;
+
+    printf("    %-4s mean %9.1f us  min %9.1f us  max %9.1f us\n", name, 
+        (double)lat->sum_ns / lat->count / 1000, lat->min_ns / 1000.0, lat->max_ns / 1000.0);
+
+    /* Bucket b holds [2^(b-1), 2^b) ns */
+    for (b = 0; b < DMA_HIST_BUCKETS; b++)
+        if (lat->hist[b])
+            printf("        < %10u ns: %u\n", 1u << b, lat->hist[b]);
+}
+
+/* Let the driver time the CPU byte loop and DMA for 64 B .. 512 KB */
+static int sweep(int fd, int iters)
+{
+    struct s3c_dma_stats st;
+    int i;
+
+    if (ioctl(fd, DMA_BENCH, iters) < 0) {
+        printf("DMA_BENCH failed\n");
+        return -1;
+    }
+    if (ioctl(fd, DMA_GET_STATS, &st) < 0) {
+        printf("DMA_GET_STATS failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < (int)st.nr_sizes && i < DMA_NR_SIZES; i++) {
+        printf("%u bytes:\n", 1u << (i + DMA_MIN_SIZE_SHIFT));
+        print_lat("cpu", &st.cpu[i]);
+        print_lat("dma", &st.bench[i]);
+    }
+
+    if (st.crossover)
+        printf("DMA beats the CPU loop from %u bytes\n", st.crossover);
+    else
+        printf("DMA never beats the CPU loop\n");
+
+    return 0;
 }
 
 int main(int argc, char **argv)
 {    
     int fd;
     
-    if (argc != 2) {
+    if (argc < 2) {
         print_usage(argv[0]);
         return -1;
     }
@@ -46,6 +359,13 @@ int main(int argc, char **argv)
         while (1) {
             ioctl(fd, MEM_CPY_DMA);
         }
+    } else if (0 == strcmp(argv[1], "sweep")) {
+        return sweep(fd, argc > 2 ? atoi(argv[2]) : 100);
+    } else if (0 == strcmp(argv[1], "bench")) {
+        return bench(fd);
+    } else if (0 == strcmp(argv[1], "engine")) {
+        return engine_test(fd, argc > 2 ? atoi(argv[2]) : 128, 
+            argc > 3 ? atoi(argv[3]) : 4096);
     } else {        
         print_usage(argv[0]);
         return -1;
@@ -12,6 +12,9 @@
 #include <linux/gpio.h>
 #include <linux/poll.h>
 #include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/time.h>
 
 #include <asm/uaccess.h>
 #include <asm/io.h>  
@@ -25,16 +28,39 @@ static struct fasync_struct *button_async_queue;
 
 static DECLARE_WAIT_QUEUE_HEAD(button_waitq);
 
-/* ж¼־, жϷ1button_irq_read0 */
-static volatile int ev_press = 0;
+/*
+ * One debounced key change. read() of 1 byte still returns the bare
+ * key_val, a larger read returns as many whole events as fit.
+ */
+struct button_event {
+	__u32 sec;			/* time of the first edge */
+	__u32 usec;
+	__u8  key_val;			/* bit 7: released */
+	__u8  pad[3];
+};
+
+#define BUTTON_RING_LEN		64	/* events, power of 2 */
+
+/*
+ * Every event goes into one ring and every open file reads it through
+ * its own cursor, so any number of processes see all the keys. A reader
+ * more than BUTTON_RING_LEN events behind loses its oldest ones, the
+ * other readers are not affected.
+ */
+static struct button_event button_ring[BUTTON_RING_LEN];
+static unsigned long button_head;		/* events ever queued */
+static DEFINE_SPINLOCK(button_ring_lock);
+
+struct button_reader {
+	unsigned long tail;			/* next event for this file */
+	unsigned long lost;			/* overwritten before they were read */
+};
 
 
 int major;
 static struct class *button_irq_class;
 static struct device *button_irq_dev;
 
-static struct timer_list button_timer;
-
 
 //static volatile unsigned long *rGPFCON = NULL;
 //static volatile unsigned long *rGPFDAT = NULL;
@@ -43,59 +69,84 @@ static struct timer_list button_timer;
 struct pin_desc {
 	unsigned int pin;
 	unsigned int key_val;
+	unsigned int irq;
+	const char *name;
+	struct timer_list timer;	/* debounce, one per key */
+	struct timeval stamp;		/* first edge of the current bounce */
+	int bouncing;
 };
 
 
 struct pin_desc pins_desc[6] = {
-	{ S3C2410_GPF(0), 0x04},  	// K5
-	{ S3C2410_GPF(1), 0x01},  	// K2
-	{ S3C2410_GPF(2), 0x05}, 	// K6
-	{ S3C2410_GPF(3), 0x02},  	// K3
-	{ S3C2410_GPF(4), 0x06}, 	// K7
-	{ S3C2410_GPF(5), 0x03},  	// K4	
+	{ S3C2410_GPF(0), 0x04, IRQ_EINT0, "K5" },  	// K5
+	{ S3C2410_GPF(1), 0x01, IRQ_EINT1, "K2" },  	// K2
+	{ S3C2410_GPF(2), 0x05, IRQ_EINT2, "K6" }, 	// K6
+	{ S3C2410_GPF(3), 0x02, IRQ_EINT3, "K3" },  	// K3
+	{ S3C2410_GPF(4), 0x06, IRQ_EINT4, "K7" }, 	// K7
+	{ S3C2410_GPF(5), 0x03, IRQ_EINT5, "K4" },  	// K4	
 };
 
-static unsigned char keyval;
-
-static struct pin_desc *irq_dev;
-
 //static atomic_t isOpen = ATOMIC_INIT(1);
-static DEFINE_SEMAPHORE(button_lock);
 
 
 static irqreturn_t buttons_irq(int irq, void *dev_id)
 {
-    irq_dev = (struct pin_desc *)dev_id;
-    /* start the timer after 10ms */
-	mod_timer(&button_timer, jiffies+HZ/100);  // HZ = 1s; HZ/100 = 10ms
+	struct pin_desc *pindesc = (struct pin_desc *)dev_id;
+
+	/* the event is stamped with the first edge, not the end of the bounce */
+	if(!pindesc->bouncing) {
+		do_gettimeofday(&pindesc->stamp);
+		pindesc->bouncing = 1;
+	}
+
+	/* (re)start this key's timer after 10ms, other keys are not affected */
+	mod_timer(&pindesc->timer, jiffies+HZ/100);  // HZ = 1s; HZ/100 = 10ms
 	return IRQ_RETVAL(IRQ_HANDLED);
 }
 
 
-static int button_irq_open(struct inode *inode, struct file *file)
+/* Move up to n events of this reader to ev, returns how many */
+static int button_take(struct button_reader *reader, struct button_event *ev, int n)
 {
-# if 0
-	if(!atomic_dec_and_test(&isOpen))
-	{
-		atomic_add(1, &isOpen);
-		return -EBUSY;
-	}
-# endif
+	unsigned long flags;
+	int i;
 
-	if(file->f_flags & O_NONBLOCK) {
-        if(down_trylock(&button_lock))
-            return -EBUSY;
-	}else {
-    	down(&button_lock);
+	spin_lock_irqsave(&button_ring_lock, flags);
+
+	if(button_head - reader->tail > BUTTON_RING_LEN) {
+		reader->lost += button_head - reader->tail - BUTTON_RING_LEN;
+		reader->tail = button_head - BUTTON_RING_LEN;
 	}
-	
-    /* request_irq will set irq mode automatically */
-    request_irq(IRQ_EINT1, buttons_irq, IRQ_TYPE_EDGE_BOTH, "K2", &pins_desc[1]);
-    request_irq(IRQ_EINT3, buttons_irq, IRQ_TYPE_EDGE_BOTH, "K3", &pins_desc[3]);
-    request_irq(IRQ_EINT5, buttons_irq, IRQ_TYPE_EDGE_BOTH, "K4", &pins_desc[5]);
-    request_irq(IRQ_EINT0, buttons_irq, IRQ_TYPE_EDGE_BOTH, "K5", &pins_desc[0]);
-    request_irq(IRQ_EINT2, buttons_irq, IRQ_TYPE_EDGE_BOTH, "K6", &pins_desc[2]);
-    request_irq(IRQ_EINT4, buttons_irq, IRQ_TYPE_EDGE_BOTH, "K7", &pins_desc[4]);
+
+	for(i = 0; i < n && reader->tail != button_head; i++, reader->tail++)
+		ev[i] = button_ring[reader->tail & (BUTTON_RING_LEN - 1)];
+
+	spin_unlock_irqrestore(&button_ring_lock, flags);
+
+	return i;
+}
+
+static int button_pending(struct button_reader *reader)
+{
+	return ACCESS_ONCE(button_head) != reader->tail;
+}
+
+
+/* The IRQs belong to the module, open only sets up a cursor */
+static int button_irq_open(struct inode *inode, struct file *file)
+{
+	struct button_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if(!reader)
+		return -ENOMEM;
+
+	/* a new reader starts with the next event */
+	spin_lock_irq(&button_ring_lock);
+	reader->tail = button_head;
+	spin_unlock_irq(&button_ring_lock);
+
+	file->private_data = reader;
 	
 	return 0;
 }
@@ -103,35 +154,65 @@ static int button_irq_open(struct inode *inode, struct file *file)
 
 static ssize_t button_irq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos)
 {
-	if(size != 1)
+	struct button_reader *reader = file->private_data;
+	struct button_event ev[16];
+	size_t done = 0;
+	int n;
+
+	if(size != 1 && size < sizeof(struct button_event))
 		return -EINVAL;
 
+retry:
 	if(file->f_flags & O_NONBLOCK) {
-        if(!ev_press)
+        if(!button_pending(reader))
             return -EAGAIN;
     }else {
-    	/* if no interrupt occurs, wait */
-    	wait_event_interruptible(button_waitq, ev_press);
+    	/* if no key event is queued for this file, wait */
+    	if(wait_event_interruptible(button_waitq, button_pending(reader)))
+			return -ERESTARTSYS;
     }
 
-    /* if interrupt occurs, copy keyval to user in user space */
-	copy_to_user(buf, &keyval, 1);
-	ev_press = 0;
+	if(size == 1) {
+		/* old interface: the key_val of the oldest event */
+		if(!button_take(reader, ev, 1))
+			goto retry;
+		if(copy_to_user(buf, &ev[0].key_val, 1))
+			return -EFAULT;
+		return 1;
+	}
+
+	/* as many whole events as are queued and fit, 16 at a time */
+	while(done + sizeof(struct button_event) <= size) {
+		n = min_t(size_t, ARRAY_SIZE(ev), (size - done) / sizeof(struct button_event));
+		n = button_take(reader, ev, n);
+		if(!n)
+			break;
+
+		if(copy_to_user(buf + done, ev, n * sizeof(struct button_event)))
+			return done ? done : -EFAULT;
+		done += n * sizeof(struct button_event);
+	}
+
+	/* another thread of this file took them first */
+	if(!done)
+		goto retry;
 	
-	return 1;
+	return done;
 }
 
 
+static int button_fasync(int fd, struct file *filp, int on);
+
 static int button_irq_release(struct inode *inode, struct file *file) 
 {
+	struct button_reader *reader = file->private_data;
+
 	//atomic_add(1, &isOpen);
-	free_irq(IRQ_EINT1, &pins_desc[1]);	// K2
-	free_irq(IRQ_EINT3, &pins_desc[3]);	// K3
-	free_irq(IRQ_EINT5, &pins_desc[5]);	// K4
-	free_irq(IRQ_EINT0, &pins_desc[0]);	// K5
-	free_irq(IRQ_EINT2, &pins_desc[2]);	// K6
-	free_irq(IRQ_EINT4, &pins_desc[4]);	// K7
-	up(&button_lock);
+	button_fasync(-1, file, 0);
+
+	if(reader->lost)
+		printk("button_final: %lu key events lost, reader too slow\n", reader->lost);
+	kfree(reader);
 	
 	return 0;
 }
@@ -142,7 +223,7 @@ static unsigned int button_irq_poll(struct file *file, poll_table *wait)
 	unsigned int mask = 0;
 	poll_wait(file, &button_waitq, wait);
 	
-	if(ev_press)
+	if(button_pending(file->private_data))
 		mask |= POLLIN | POLLRDNORM;
 
 	return mask;
@@ -151,18 +232,17 @@ static unsigned int button_irq_poll(struct file *file, poll_table *wait)
 
 static int button_fasync(int fd, struct file *filp, int on)
 {
-	printk("fasync_helper function is invoked!\n");
+	//printk("fasync_helper function is invoked!\n");
 	return fasync_helper(fd, filp, on, &button_async_queue);
 }
 
 static void button_timer_handler(unsigned long data)
 {
-    struct pin_desc *pindesc = irq_dev;
+    struct pin_desc *pindesc = (struct pin_desc *)data;
+	struct button_event ev;
+	unsigned long flags;
 	unsigned int pinval;
 
-    if(!pindesc)
-        return;
-
 	//printk("pindesc->pin = %d\n", pindesc->pin);
 	
 	pinval = s3c2410_gpio_getpin(pindesc->pin);
@@ -172,13 +252,22 @@ static void button_timer_handler(unsigned long data)
 
 	if(pinval) {
 		/* key is not pressed down */
-		keyval = 0x80 | pindesc->key_val;
+		ev.key_val = 0x80 | pindesc->key_val;
 	}else {
 		/* key is pressed down */
-		keyval = pindesc->key_val;
+		ev.key_val = pindesc->key_val;
 	}
 
-	ev_press = 1;                  			/* ʾжϷ */
+	ev.sec = pindesc->stamp.tv_sec;
+	ev.usec = pindesc->stamp.tv_usec;
+	pindesc->bouncing = 0;
+
+	/* slow readers notice the overwrite through their own cursor */
+	spin_lock_irqsave(&button_ring_lock, flags);
+	button_ring[button_head & (BUTTON_RING_LEN - 1)] = ev;
+	button_head++;
+	spin_unlock_irqrestore(&button_ring_lock, flags);
+                  			/* ʾжϷ */
     wake_up_interruptible(&button_waitq);   /* ߵĽ */
 
 	kill_fasync(&button_async_queue, SIGIO, POLL_IN);
@@ -196,32 +285,67 @@ static struct file_operations button_irq_fops = {
 
 static int button_irq_init(void)
 {
-	init_timer(&button_timer);
-	button_timer.function = button_timer_handler;
-	add_timer(&button_timer);
+	int i, ret;
+
+	for(i = 0; i < ARRAY_SIZE(pins_desc); i++)
+		setup_timer(&pins_desc[i].timer, button_timer_handler, (unsigned long)&pins_desc[i]);
+
+	/* once for the module, not on every open */
+	for(i = 0; i < ARRAY_SIZE(pins_desc); i++) {
+		/* request_irq will set irq mode automatically */
+		ret = request_irq(pins_desc[i].irq, buttons_irq, IRQ_TYPE_EDGE_BOTH, 
+						  pins_desc[i].name, &pins_desc[i]);
+		if(ret) {
+			printk(KERN_ERR "button_final: unable to get the irq of %s\n", pins_desc[i].name);
+			goto err_irq;
+		}
+	}
     
 	if((major = register_chrdev(0, "button_final", &button_irq_fops)) < 0) {
 		printk(KERN_ERR "unable to register major device number %d\n", major);
-		return -EIO;
+		ret = -EIO;
+		goto err_irq;
 	}
 
 	button_irq_class = class_create(THIS_MODULE, "button_final");
-	if(IS_ERR(button_irq_class))
-		return PTR_ERR(button_irq_class);
+	if(IS_ERR(button_irq_class)) {
+		ret = PTR_ERR(button_irq_class);
+		goto err_chrdev;
+	}
 
 	button_irq_dev = device_create(button_irq_class, NULL, MKDEV(major, 0), NULL, "buttonFinal"); 
-	if(IS_ERR(button_irq_dev))
-		return PTR_ERR(button_irq_dev);
+	if(IS_ERR(button_irq_dev)) {
+		ret = PTR_ERR(button_irq_dev);
+		goto err_class;
+	}
 
 	//rGPFCON = (volatile unsigned long *)ioremap(0x56000050, 16);
 	//rGPFDAT = rGPFCON + 1;
 	
 	return 0;
+
+err_class:
+	class_destroy(button_irq_class);
+err_chrdev:
+	unregister_chrdev(major, "button_final");
+err_irq:
+	while(--i >= 0) {
+		free_irq(pins_desc[i].irq, &pins_desc[i]);
+		del_timer_sync(&pins_desc[i].timer);
+	}
+	return ret;
 }
 
 
 static void button_irq_exit(void)
 {
+	int i;
+
+	for(i = 0; i < ARRAY_SIZE(pins_desc); i++) {
+		free_irq(pins_desc[i].irq, &pins_desc[i]);
+		del_timer_sync(&pins_desc[i].timer);
+	}
+
 	unregister_chrdev(major, "button_final");
 	device_destroy(button_irq_class, MKDEV(major, 0));
 	class_destroy(button_irq_class);
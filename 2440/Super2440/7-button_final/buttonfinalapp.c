@@ -7,6 +7,15 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
+
+/* Must match the driver */
+struct button_event {
+	unsigned int sec;
+	unsigned int usec;
+	unsigned char key_val;		/* bit 7: released */
+	unsigned char pad[3];
+};
 
 int fd;
 #if 0
@@ -18,13 +27,22 @@ void my_signal_func(int signum)
 }
 #endif
 
+/*
+ * Usage: buttonfinalapp [1]
+ *   no argument: read every queued event in one call, with timestamps
+ *   1:           old interface, one key_val byte per read
+ */
 int main(int argc, char **argv)
 {
 	//int oflags;
 	
 	//signal(SIGIO, my_signal_func); 
-    int ret;
+    int ret, i, legacy = 0;
 	unsigned char key_val;
+	struct button_event ev[16];
+
+	if(argc > 1)
+		legacy = atoi(argv[1]);
 
 	fd = open("/dev/buttonFinal", O_RDWR);
 	if(fd < 0) {
@@ -32,11 +50,24 @@ int main(int argc, char **argv)
 		return -1;
 	}
 	
-	while(1) {
+	while(legacy) {
 		ret = read(fd, &key_val, 1);
 	    printf("key_val = 0x%x, ret = %d\n", key_val, ret);
         //sleep(5);
 	}
+
+	while(1) {
+		ret = read(fd, ev, sizeof(ev));
+		if(ret < 0) {
+			printf("read failed!\n");
+			return -1;
+		}
+
+		for(i = 0; i < ret / (int)sizeof(ev[0]); i++)
+			printf("[%u.%06u] key_val = 0x%x (%s)\n", ev[i].sec, ev[i].usec,
+				ev[i].key_val, (ev[i].key_val & 0x80) ? "up" : "down");
+		printf("%d events in one read\n", ret / (int)sizeof(ev[0]));
+	}
 	
 	return 0;
 }
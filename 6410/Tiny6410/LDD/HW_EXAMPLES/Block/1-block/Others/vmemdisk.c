@@ -13,6 +13,10 @@
 #include <linux/blk_types.h>            /* bio_vec structure */
 #include <linux/hdreg.h>                /* hd_geometry structure */
 #include <linux/fs.h>                   /* block_device structure */
+#include <linux/radix-tree.h>           /* sparse backing store */
+#include <linux/rcupdate.h>             /* rcu_read_lock/synchronize_rcu */
+#include <linux/gfp.h>                  /* alloc_page */
+#include <linux/device.h>               /* DEVICE_ATTR */
 
 
 #define VMEMDISK_MINOR              16
@@ -31,8 +35,10 @@ module_param(nsectors, int, 0);
 
 
 struct vmemdisk_dev {
-    int size;                       /* The device size in sectors */
-    u8 *data;                       /* The data array */
+    int size;                       /* The device size in bytes */
+    struct radix_tree_root pages;   /* Backing pages, indexed by offset >> PAGE_SHIFT */
+    spinlock_t pages_lock;          /* Protects insertions/deletions in pages */
+    unsigned long nr_pages;         /* Pages currently allocated */
     short users;                    /* How many users */
     short media_change;             /* Media change flag? */
     spinlock_t lock;                /* For mutual exclusion */
@@ -53,6 +59,9 @@ static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
 
 
+static void vmemdisk_free_store(struct vmemdisk_dev *dev);
+
+
 static int vmemdisk_open(struct block_device *bdev, fmode_t mode)
 {
     struct vmemdisk_dev *dev = bdev->bd_disk->private_data;
@@ -92,7 +101,8 @@ static int vmemdisk_revalidate(struct gendisk *gdisk)
 
     if (dev->media_change) {
         dev->media_change = 0;
-        memset(dev->data, 0, dev->size);
+        /* A new medium, give back every page of the old one */
+        vmemdisk_free_store(dev);
     }
     
     return 0;
@@ -124,7 +134,7 @@ static void vmemdisk_invalidate(unsigned long ldev)
 
     spin_lock(&dev->lock);
 
-    if (dev->users || !dev->data)
+    if (dev->users)
         printk(KERN_WARNING "[DRIVER]vmemdisk: timer checks failed!\n");
     else 
         dev->media_change = 1;
@@ -133,7 +143,182 @@ static void vmemdisk_invalidate(unsigned long ldev)
 }
 
 
-static void vmemdisk_transfer(struct vmemdisk_dev *dev, unsigned long sector, 
+/*
+ *  Sparse backing store
+ *
+ *  A page is allocated on the first write to it and a sector without a
+ *  page reads back as zeros, so an idle disk costs no memory. All the
+ *  transfers run with a kmap_atomic mapping or the queue lock held, so
+ *  nothing here may sleep. Lookups run under RCU, insertions and
+ *  deletions under pages_lock.
+ */
+static struct page *vmemdisk_insert_page(struct vmemdisk_dev *dev, pgoff_t idx)
+{
+    struct page *page;
+    unsigned long flags;
+
+    page = alloc_page(GFP_ATOMIC | __GFP_ZERO);
+    if (!page)
+        return NULL;
+
+    page->index = idx;
+    spin_lock_irqsave(&dev->pages_lock, flags);
+    if (radix_tree_insert(&dev->pages, idx, page)) {
+        /* Somebody else was first, or no memory for the tree node */
+        __free_page(page);
+        page = radix_tree_lookup(&dev->pages, idx);
+    } else {
+        dev->nr_pages++;
+    }
+    spin_unlock_irqrestore(&dev->pages_lock, flags);
+
+    return page;
+}
+
+static void vmemdisk_copy_from_store(struct vmemdisk_dev *dev, char *dst, 
+    unsigned long offset, unsigned long len)
+{
+    unsigned long off, chunk;
+    struct page *page;
+
+    while (len) {
+        off = offset & ~PAGE_MASK;
+        chunk = min_t(unsigned long, len, PAGE_SIZE - off);
+
+        rcu_read_lock();
+        page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+        if (page)
+            memcpy(dst, page_address(page) + off, chunk);
+        else
+            memset(dst, 0, chunk);
+        rcu_read_unlock();
+
+        dst += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+static int vmemdisk_copy_to_store(struct vmemdisk_dev *dev, const char *src, 
+    unsigned long offset, unsigned long len)
+{
+    unsigned long off, chunk;
+    struct page *page;
+
+    while (len) {
+        off = offset & ~PAGE_MASK;
+        chunk = min_t(unsigned long, len, PAGE_SIZE - off);
+
+        rcu_read_lock();
+        page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+        if (page)
+            memcpy(page_address(page) + off, src, chunk);
+        rcu_read_unlock();
+
+        if (!page) {
+            /* First write to this page, allocate it and look again */
+            if (!vmemdisk_insert_page(dev, offset >> PAGE_SHIFT))
+                return -ENOMEM;
+            continue;
+        }
+
+        src += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ *  Discard frees the whole pages in the range and zeroes the partial
+ *  ones at both ends. Only reached from vmemdisk_make_request(), which
+ *  may sleep, so readers still holding a page under RCU are waited for.
+ */
+static int vmemdisk_discard(struct vmemdisk_dev *dev, unsigned long sector, 
+    unsigned long nbytes)
+{
+    unsigned long offset = sector * KERNEL_SECTOR_SIZE;
+    unsigned long off, chunk, flags;
+    struct page *page, *next;
+    LIST_HEAD(freed);
+
+    if ((offset + nbytes) > dev->size) {
+        printk(KERN_NOTICE "[DRIVER]Beyond-end discard (%ld %ld)!\n", offset, nbytes);
+        return -EIO;
+    }
+
+    while (nbytes) {
+        off = offset & ~PAGE_MASK;
+        chunk = min_t(unsigned long, nbytes, PAGE_SIZE - off);
+
+        spin_lock_irqsave(&dev->pages_lock, flags);
+        page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+        if (page && chunk == PAGE_SIZE) {
+            radix_tree_delete(&dev->pages, page->index);
+            dev->nr_pages--;
+            list_add(&page->lru, &freed);
+        } else if (page) {
+            memset(page_address(page) + off, 0, chunk);
+        }
+        spin_unlock_irqrestore(&dev->pages_lock, flags);
+
+        offset += chunk;
+        nbytes -= chunk;
+    }
+
+    synchronize_rcu();
+    list_for_each_entry_safe(page, next, &freed, lru)
+        __free_page(page);
+
+    return 0;
+}
+
+/*
+ *  Free every page. vmemdisk_revalidate() runs at open while other openers
+ *  may have I/O in flight, and RM_NOQUEUE looks pages up under RCU only, so
+ *  like vmemdisk_discard() the pages are unlinked under pages_lock and only
+ *  freed after a grace period.
+ */
+static void vmemdisk_free_store(struct vmemdisk_dev *dev)
+{
+    struct page *pages[16], *page, *next;
+    unsigned long flags;
+    pgoff_t pos = 0;
+    LIST_HEAD(freed);
+    int i, nr;
+
+    do {
+        spin_lock_irqsave(&dev->pages_lock, flags);
+        nr = radix_tree_gang_lookup(&dev->pages, (void **)pages, pos, ARRAY_SIZE(pages));
+        for (i = 0; i < nr; i++) {
+            pos = pages[i]->index;
+            radix_tree_delete(&dev->pages, pos);
+            dev->nr_pages--;
+            list_add(&pages[i]->lru, &freed);
+        }
+        spin_unlock_irqrestore(&dev->pages_lock, flags);
+        pos++;
+    } while (nr == ARRAY_SIZE(pages));
+
+    synchronize_rcu();
+    list_for_each_entry_safe(page, next, &freed, lru)
+        __free_page(page);
+}
+
+/* /sys/block/vmemdiskX/mem_used: bytes of RAM backing the disk */
+static ssize_t vmemdisk_mem_used_show(struct device *d, 
+    struct device_attribute *attr, char *buf)
+{
+    struct vmemdisk_dev *dev = dev_to_disk(d)->private_data;
+
+    return sprintf(buf, "%lu\n", dev->nr_pages << PAGE_SHIFT);
+}
+
+static DEVICE_ATTR(mem_used, S_IRUGO, vmemdisk_mem_used_show, NULL);
+
+
+static int vmemdisk_transfer(struct vmemdisk_dev *dev, unsigned long sector, 
     unsigned long nsect, char *buffer, int write)
 {
     unsigned long offset = sector * KERNEL_SECTOR_SIZE;
@@ -141,29 +326,36 @@ static void vmemdisk_transfer(struct vmemdisk_dev *dev, unsigned long sector,
 
     if ((offset + nbytes) > dev->size) {
         printk(KERN_NOTICE "[DRIVER]Beyond-end write (%ld %ld)!\n", offset, nbytes);
-        return;
+        return -EIO;
     }
 
     if (write)
-        memcpy(dev->data + offset, buffer, nbytes);
-    else
-        memcpy(buffer, dev->data + offset, nbytes);
+        return vmemdisk_copy_to_store(dev, buffer, offset, nbytes);
+
+    vmemdisk_copy_from_store(dev, buffer, offset, nbytes);
+    return 0;
 }
 
 
 /* Helper method to transfer a single BIO */
 static int vmemdisk_xfer_bio(struct vmemdisk_dev *dev, struct bio *bio)
 {
-    int i;
+    int i, status;
     struct bio_vec *bvec;
     sector_t sector = bio->bi_sector;
 
+    /* Discard carries no data, it only gives the pages back */
+    if (bio->bi_rw & REQ_DISCARD)
+        return vmemdisk_discard(dev, sector, bio->bi_size);
+
     /* Do each segment independently */
     bio_for_each_segment(bvec, bio, i) {
         char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-        vmemdisk_transfer(dev, sector, (bio_cur_bytes(bio)>>9), buffer, bio_data_dir(bio) == WRITE);
-        sector += (bio_cur_bytes(bio)>>9);
+        status = vmemdisk_transfer(dev, sector, (bvec->bv_len>>9), buffer, bio_data_dir(bio) == WRITE);
+        sector += (bvec->bv_len>>9);
         __bio_kunmap_atomic(bio, KM_USER0);
+        if (status)
+            return status;
     }
     
     return 0;
@@ -185,43 +377,46 @@ static int vmemdisk_make_request(struct request_queue *q, struct bio *bio)
 static int vmemdisk_xfer_request(struct vmemdisk_dev *dev, struct request *req)
 {
     struct req_iterator iter;
-    int nsect = 0;
+    int status = 0;
     struct bio_vec *bvec;
+    sector_t sector = blk_rq_pos(req);
 
     rq_for_each_segment(bvec, req, iter) {
         char *buffer = __bio_kmap_atomic(iter.bio, iter.i, KM_USER0);
-        sector_t sector = iter.bio->bi_sector;
-        vmemdisk_transfer(dev, sector, (bio_cur_bytes(iter.bio)>>9), buffer, 
+        status = vmemdisk_transfer(dev, sector, (bvec->bv_len>>9), buffer, 
             bio_data_dir(iter.bio) == WRITE);
-        sector += (bio_cur_bytes(iter.bio)>>9);
+        sector += (bvec->bv_len>>9);
         __bio_kunmap_atomic(iter.bio, KM_USER0);
-        nsect += iter.bio->bi_size / KERNEL_SECTOR_SIZE;
+        if (status)
+            break;
     }
 
-    return nsect;
+    return status;
 }
 
 static void vmemdisk_full_request(struct request_queue *q)
 {
     struct request *req;
-    int sectors_xferred;
     struct vmemdisk_dev *dev = q->queuedata;
 
     while ((req = blk_fetch_request(q)) != NULL) {
-        sectors_xferred = vmemdisk_xfer_request(dev, req);
-        __blk_end_request_cur(req, 1);
+        __blk_end_request_all(req, vmemdisk_xfer_request(dev, req));
     } 
 }
 
 static void vmemdisk_simple_request(struct request_queue *q)
 {
     struct request *req;
+    int err;
 
-    while ((req = blk_fetch_request(q)) != NULL) {
+    req = blk_fetch_request(q);
+    while (req) {
         struct vmemdisk_dev *dev = req->rq_disk->private_data;
-        vmemdisk_transfer(dev, req->__sector, req->__data_len, req->buffer, 
+        err = vmemdisk_transfer(dev, blk_rq_pos(req), blk_rq_cur_sectors(req), req->buffer, 
             rq_data_dir(req));
-        __blk_end_request_cur(req, 1);
+        /* Keep the request until all of its chunks are done */
+        if (!__blk_end_request_cur(req, err))
+            req = blk_fetch_request(q);
     }
 }
 
@@ -231,14 +426,13 @@ static void setup_vmemdisk_device(struct vmemdisk_dev *dev, int which)
 {
     memset(dev, 0, sizeof(struct vmemdisk_dev));
     dev->size = nsectors * hardsect_size;
-    dev->data = vmalloc(dev->size);
-    if (!dev->data) {
-        printk(KERN_NOTICE "vmalloc failure!\n");
-        return;
-    }
 
     /*  Initialize spinlock */
     spin_lock_init(&dev->lock);
+    spin_lock_init(&dev->pages_lock);
+
+    /*  Empty backing store, node allocations must not sleep */
+    INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC);
 
     /*  Use the timer to simulate the invalidate device */
     init_timer(&dev->timer);
@@ -256,6 +450,12 @@ static void setup_vmemdisk_device(struct vmemdisk_dev *dev, int which)
             goto out;
 
         blk_queue_make_request(dev->queue, vmemdisk_make_request);
+
+        /*  Discard (TRIM) gives pages back, only this path can wait for RCU */
+        dev->queue->limits.discard_granularity = PAGE_SIZE;
+        dev->queue->limits.discard_zeroes_data = 1;
+        blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+        queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, dev->queue);
         break;
 
     case RM_FULL:
@@ -296,11 +496,14 @@ static void setup_vmemdisk_device(struct vmemdisk_dev *dev, int which)
     snprintf(dev->gd->disk_name, 32, "vmemdisk%c", which + 'a');
     set_capacity(dev->gd, nsectors * (hardsect_size / KERNEL_SECTOR_SIZE));
     add_disk(dev->gd);
+
+    /*  Memory footprint, cat /sys/block/vmemdiskX/mem_used */
+    if (device_create_file(disk_to_dev(dev->gd), &dev_attr_mem_used))
+        printk(KERN_NOTICE "[DRIVER]creating mem_used attribute is failed!\n");
     return;
 
 out:
-    if (dev->data)
-        vfree(dev->data);
+    printk(KERN_NOTICE "[DRIVER]vmemdisk%c setup failure!\n", which + 'a');
 }
 
 static int __init vmemdisk_init(void)
@@ -338,6 +541,7 @@ static void __exit vmemdisk_exit(void)
         struct vmemdisk_dev *dev = vmemdisk_devices + i;
         del_timer_sync(&dev->timer);
         if (dev->gd) {
+            device_remove_file(disk_to_dev(dev->gd), &dev_attr_mem_used);
             del_gendisk(dev->gd);
             put_disk(dev->gd);
         }
@@ -349,8 +553,7 @@ static void __exit vmemdisk_exit(void)
                 blk_cleanup_queue(dev->queue);
         }
 
-        if (dev->data)
-            vfree(dev->data);
+        vmemdisk_free_store(dev);
     }
 
     /* unregister block device */
@@ -10,17 +10,91 @@
 #include <linux/cdev.h>
 #include <linux/init.h>
 #include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/bitops.h>
+#include <linux/workqueue.h>
 
 //#define AT24CXX_DBG  printk
 #define AT24CXX_DBG(...)
 
+/*
+ * Geometry of the supported parts. The address byte only covers 256
+ * bytes, bigger parts answer on addr + 1, + 2, ... for the next blocks.
+ */
+struct at24cxx_chip {
+    unsigned int size;
+    unsigned int page_size;
+};
+
+static const struct at24cxx_chip at24cxx_chips[] = {
+    { 256,  8 },    /* at24c02 */
+    { 512,  16 },   /* at24c04 */
+    { 1024, 16 },   /* at24c08 */
+    { 2048, 16 },   /* at24c16 */
+};
+
+#define AT24CXX_BLOCK_SIZE      256
+#define AT24CXX_MAX_BLOCKS      8
+#define AT24CXX_MAX_PAGES       128     /* 2048 / 16 */
+
+/* Largest single i2c transfer, a read never gets split more than needed */
+static unsigned int io_limit = 128;
+module_param(io_limit, uint, S_IRUGO);
+MODULE_PARM_DESC(io_limit, "Maximum bytes per I2C transfer (default 128)");
+
+/* The chip NAKs its address while a write cycle runs, tWR is 5-10ms */
+static unsigned int write_timeout = 25;
+module_param(write_timeout, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_timeout, "ms to wait for a write cycle to end (default 25)");
+
+static unsigned int poll_us = 200;
+module_param(poll_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_us, "Delay between two ACK polls in us (default 200)");
+
+/* 1 = old interface: read buf[0] = addr -> data, write buf[0] = addr, buf[1] = data */
+static int byte_abi;
+module_param(byte_abi, int, S_IRUGO);
+MODULE_PARM_DESC(byte_abi, "Use the old one byte per syscall interface");
+
+/*
+ * Write-back mirror of the whole EEPROM. Reads are served from RAM,
+ * writes only dirty pages in RAM; the dirty pages go out as page writes
+ * flush_delay ms after the first one got dirty, on fsync() or on remove.
+ * Rewriting a page before the deadline costs no extra write cycle.
+ */
+static int cache = 1;
+module_param(cache, int, S_IRUGO);
+MODULE_PARM_DESC(cache, "0 = write-through, 1 = mirror filled on demand (default), 2 = mirror filled at probe");
+
+static unsigned int flush_delay = 1000;
+module_param(flush_delay, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(flush_delay, "ms from the first dirty page to the flush (default 1000)");
+
 struct at24cxx_i2c {
     struct cdev cdev;
     struct class *cls;
-    struct i2c_client *client;
-    unsigned char addr;
-    unsigned char data;
-    unsigned char kernel_buf[2];
+    struct i2c_client *client[AT24CXX_MAX_BLOCKS];
+    const struct at24cxx_chip *chip;
+    struct mutex lock;      /* one transfer on the bus at a time */
+    unsigned char *buf;     /* address byte + io_limit bytes */
+
+    /* Mirror, NULL with cache=0. Protected by lock like the bus */
+    unsigned char *mirror;
+    unsigned int nr_pages;
+    unsigned int nr_dirty;
+    DECLARE_BITMAP(valid, AT24CXX_MAX_PAGES);
+    DECLARE_BITMAP(dirty, AT24CXX_MAX_PAGES);
+    struct delayed_work flush_work;
+
+    unsigned long hits;         /* pages read from the mirror */
+    unsigned long misses;       /* pages that had to be read from the chip */
+    unsigned long fills;        /* sequential reads issued to fill misses */
+    unsigned long unchanged;    /* page writes dropped, same data */
+    unsigned long flushes;
+    unsigned long pages_flushed;
+    unsigned long flush_errors;
 };
 
 static int at24cxx_driver_major;
@@ -32,73 +106,477 @@ static int at24cxx_open(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/*
+ * ACK polling: while a write cycle runs the chip does not acknowledge
+ * its address, so the transfer is retried until it goes through. This
+ * both waits for the previous write and starts the next access, there
+ * is no fixed delay anywhere.
+ */
+static int at24cxx_transfer(struct i2c_client *client, struct i2c_msg *msgs,
+        int num)
+{
+    unsigned long timeout = jiffies + msecs_to_jiffies(write_timeout);
+    int ret;
+
+    for (;;) {
+        ret = i2c_transfer(client->adapter, msgs, num);
+        if (ret == num)
+            return 0;
+        if (time_after(jiffies, timeout))
+            break;
+        usleep_range(poll_us, poll_us * 2);
+    }
+
+    AT24CXX_DBG("[at24cxx_driver]transfer at 0x%02x failed: %d\n", client->addr, ret);
+    return ret < 0 ? ret : -EIO;
+}
+
+/* Sequential read of up to one block, count <= io_limit */
+static int at24cxx_read_chunk(struct at24cxx_i2c *drv, unsigned int off,
+        unsigned char *buf, unsigned int count)
+{
+    struct i2c_client *client = drv->client[off / AT24CXX_BLOCK_SIZE];
+    unsigned char addr = off % AT24CXX_BLOCK_SIZE;
+    struct i2c_msg msgs[2] = {
+        { .addr = client->addr, .flags = 0,        .len = 1,     .buf = &addr },
+        { .addr = client->addr, .flags = I2C_M_RD, .len = count, .buf = buf },
+    };
+
+    return at24cxx_transfer(client, msgs, 2);
+}
+
+/*
+ * Page write of the count bytes at drv->buf + 1. The data must not cross
+ * a page, the chip wraps the address inside the page.
+ */
+static int at24cxx_write_chunk(struct at24cxx_i2c *drv, unsigned int off,
+        unsigned int count)
+{
+    struct i2c_client *client = drv->client[off / AT24CXX_BLOCK_SIZE];
+    struct i2c_msg msg = {
+        .addr = client->addr, .flags = 0, .len = count + 1, .buf = drv->buf,
+    };
+
+    drv->buf[0] = off % AT24CXX_BLOCK_SIZE;
+
+    return at24cxx_transfer(client, &msg, 1);
+}
+
+static unsigned int at24cxx_read_len(struct at24cxx_i2c *drv, unsigned int off,
+        size_t count)
+{
+    unsigned int len = AT24CXX_BLOCK_SIZE - off % AT24CXX_BLOCK_SIZE;
+
+    if (len > io_limit)
+        len = io_limit;
+    return count < len ? count : len;
+}
+
+static unsigned int at24cxx_write_len(struct at24cxx_i2c *drv, unsigned int off,
+        size_t count)
+{
+    unsigned int len = drv->chip->page_size - off % drv->chip->page_size;
+
+    if (len > io_limit)
+        len = io_limit;
+    return count < len ? count : len;
+}
+
+/*
+ * Make [off, off + count) valid in the mirror. Runs of missing pages are
+ * read with one sequential read each, up to io_limit bytes and never
+ * across a block.
+ */
+static int at24cxx_cache_fill(struct at24cxx_i2c *drv, unsigned int off,
+        unsigned int count)
+{
+    unsigned int ps = drv->chip->page_size;
+    unsigned int page = off / ps, last = (off + count - 1) / ps, end;
+    int ret;
+
+    if (!count)
+        return 0;
+
+    while (page <= last) {
+        if (test_bit(page, drv->valid)) {
+            drv->hits++;
+            page++;
+            continue;
+        }
+
+        for (end = page + 1; end <= last && !test_bit(end, drv->valid); end++)
+            if ((end * ps) % AT24CXX_BLOCK_SIZE == 0 ||
+                (end + 1 - page) * ps > io_limit)
+                break;
+
+        ret = at24cxx_read_chunk(drv, page * ps, drv->mirror + page * ps,
+                (end - page) * ps);
+        if (ret)
+            return ret;
+
+        drv->fills++;
+        drv->misses += end - page;
+        for (; page < end; page++)
+            set_bit(page, drv->valid);
+    }
+
+    return 0;
+}
+
+/* Write every dirty page back, the failed ones stay dirty */
+static int at24cxx_cache_flush(struct at24cxx_i2c *drv)
+{
+    unsigned int ps = drv->chip->page_size;
+    int page, ret, err = 0;
+
+    if (!drv->nr_dirty)
+        return 0;
+
+    for_each_set_bit(page, drv->dirty, drv->nr_pages) {
+        memcpy(drv->buf + 1, drv->mirror + page * ps, ps);
+        ret = at24cxx_write_chunk(drv, page * ps, ps);
+        if (ret) {
+            drv->flush_errors++;
+            err = ret;
+            continue;
+        }
+        clear_bit(page, drv->dirty);
+        drv->nr_dirty--;
+        drv->pages_flushed++;
+    }
+    drv->flushes++;
+
+    AT24CXX_DBG("[at24cxx_driver]flush done, %u pages left dirty\n", drv->nr_dirty);
+    return err;
+}
+
+static void at24cxx_flush_work(struct work_struct *work)
+{
+    struct at24cxx_i2c *drv = container_of(work, struct at24cxx_i2c,
+            flush_work.work);
+
+    mutex_lock(&drv->lock);
+    if (at24cxx_cache_flush(drv))
+        schedule_delayed_work(&drv->flush_work, msecs_to_jiffies(flush_delay));
+    mutex_unlock(&drv->lock);
+}
+
+static ssize_t at24cxx_cache_read(struct at24cxx_i2c *drv, char __user *buf,
+        unsigned int off, size_t count)
+{
+    int ret;
+
+    mutex_lock(&drv->lock);
+    ret = at24cxx_cache_fill(drv, off, count);
+    if (!ret && copy_to_user(buf, drv->mirror + off, count))
+        ret = -EFAULT;
+    mutex_unlock(&drv->lock);
+
+    return ret ? ret : count;
+}
+
+static ssize_t at24cxx_cache_write(struct at24cxx_i2c *drv, const char __user *buf,
+        unsigned int off, size_t count)
+{
+    unsigned int ps = drv->chip->page_size, page, len;
+    ssize_t done = 0;
+    int ret = 0;
+
+    mutex_lock(&drv->lock);
+    while (count) {
+        len = at24cxx_write_len(drv, off, count);
+        page = off / ps;
+
+        /* A partial page needs the rest of it before it can be flushed */
+        if (len < ps && !test_bit(page, drv->valid)) {
+            ret = at24cxx_cache_fill(drv, off, len);
+            if (ret)
+                break;
+        }
+
+        if (copy_from_user(drv->buf, buf + done, len)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (test_bit(page, drv->valid) && !memcmp(drv->mirror + off, drv->buf, len)) {
+            drv->unchanged++;
+        } else {
+            memcpy(drv->mirror + off, drv->buf, len);
+            set_bit(page, drv->valid);
+            if (!test_and_set_bit(page, drv->dirty))
+                drv->nr_dirty++;
+        }
+
+        off += len;
+        done += len;
+        count -= len;
+    }
+
+    /* Already pending: the deadline stays the one of the first dirty page */
+    if (drv->nr_dirty)
+        schedule_delayed_work(&drv->flush_work, msecs_to_jiffies(flush_delay));
+    mutex_unlock(&drv->lock);
+
+    return done ? done : ret;
+}
+
 /* 
  *  input:   buf[0] = addr
  *  output:  buf[0] = data
  */
+static ssize_t at24cxx_read_byte_abi(struct at24cxx_i2c *drv, char __user *buf)
+{
+    unsigned char addr;
+    int ret;
+
+    if (copy_from_user(&addr, buf, 1))
+        return -EFAULT;
+
+    mutex_lock(&drv->lock);
+    ret = at24cxx_read_chunk(drv, addr, drv->buf, 1);
+    if (!ret && copy_to_user(buf, drv->buf, 1))
+        ret = -EFAULT;
+    mutex_unlock(&drv->lock);
+
+    return ret ? ret : 1;
+}
+
+/* @param buf[0] = addr, buf[1] = data */
+static ssize_t at24cxx_write_byte_abi(struct at24cxx_i2c *drv, const char __user *buf)
+{
+    unsigned char kernel_buf[2];
+    int ret;
+
+    if (copy_from_user(kernel_buf, buf, 2))
+        return -EFAULT;
+
+    AT24CXX_DBG("[at24cxx_driver]addr = 0x%02x, data = 0x%02x\n", kernel_buf[0], kernel_buf[1]);
+
+    mutex_lock(&drv->lock);
+    drv->buf[1] = kernel_buf[1];
+    ret = at24cxx_write_chunk(drv, kernel_buf[0], 1);
+    mutex_unlock(&drv->lock);
+
+    return ret ? ret : 2;
+}
+
+/*
+ * read(count) at *ppos: one sequential read per block (or per io_limit
+ * bytes) instead of one smbus transaction per byte.
+ */
 static ssize_t at24cxx_read(struct file *filp, char __user *buf, size_t count, 
         loff_t *ppos)
 {
     struct at24cxx_i2c *drv = filp->private_data;
+    unsigned int off = *ppos, len;
+    ssize_t done = 0;
+    int ret = 0;
 
-    if (copy_from_user(&drv->addr, buf, 1))
-        return -EFAULT;
+    if (byte_abi)
+        return at24cxx_read_byte_abi(drv, buf);
 
-    AT24CXX_DBG("[at24cxx_driver]addr is %u\n", drv->addr);
+    if (*ppos >= drv->chip->size)
+        return 0;
+    if (count > drv->chip->size - off)
+        count = drv->chip->size - off;
 
-    drv->data = i2c_smbus_read_byte_data(drv->client, drv->addr);
+    if (drv->mirror) {
+        done = at24cxx_cache_read(drv, buf, off, count);
+        if (done > 0)
+            *ppos = off + done;
+        return done;
+    }
 
-    AT24CXX_DBG("[at24cxx_driver]data is %u\n", drv->data);
+    mutex_lock(&drv->lock);
+    while (count) {
+        len = at24cxx_read_len(drv, off, count);
+
+        ret = at24cxx_read_chunk(drv, off, drv->buf, len);
+        if (ret)
+            break;
+        if (copy_to_user(buf + done, drv->buf, len)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        AT24CXX_DBG("[at24cxx_driver]read %u bytes at %u\n", len, off);
+        off += len;
+        done += len;
+        count -= len;
+    }
+    mutex_unlock(&drv->lock);
 
-    if (copy_to_user(buf, &drv->data, 1))
-        return -EFAULT;
-    
-    return 1;
+    *ppos = off;
+    return done ? done : ret;
 }
 
-/* @param buf[0] = addr, buf[1] = data */
+/* write(count) at *ppos, split on page boundaries */
 static ssize_t at24cxx_write(struct file *filp, const char __user *buf, size_t count, 
         loff_t *ppos)
 {
     struct at24cxx_i2c *drv = filp->private_data;
+    unsigned int off = *ppos, len;
+    ssize_t done = 0;
+    int ret = 0;
 
-    if (copy_from_user(drv->kernel_buf, buf, 2))
-        return -EFAULT;
+    if (byte_abi)
+        return at24cxx_write_byte_abi(drv, buf);
+
+    if (*ppos >= drv->chip->size)
+        return count ? -ENOSPC : 0;
+    if (count > drv->chip->size - off)
+        count = drv->chip->size - off;
+
+    if (drv->mirror) {
+        done = at24cxx_cache_write(drv, buf, off, count);
+        if (done > 0)
+            *ppos = off + done;
+        return done;
+    }
+
+    mutex_lock(&drv->lock);
+    while (count) {
+        len = at24cxx_write_len(drv, off, count);
+
+        if (copy_from_user(drv->buf + 1, buf + done, len)) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = at24cxx_write_chunk(drv, off, len);
+        if (ret)
+            break;
+
+        AT24CXX_DBG("[at24cxx_driver]wrote %u bytes at %u\n", len, off);
+        off += len;
+        done += len;
+        count -= len;
+    }
+    mutex_unlock(&drv->lock);
+
+    *ppos = off;
+    return done ? done : ret;
+}
+
+/* Push the dirty pages to the chip now */
+static int at24cxx_fsync(struct file *filp, int datasync)
+{
+    struct at24cxx_i2c *drv = filp->private_data;
+    int ret;
 
-    AT24CXX_DBG("[at24cxx_driver]kernel_buf[0] = %u\n", (drv->kernel_buf)[0]);
-    AT24CXX_DBG("[at24cxx_driver]kernel_buf[1] = %u\n", (drv->kernel_buf)[1]);
+    if (!drv->mirror)
+        return 0;
 
-    drv->addr = (drv->kernel_buf)[0];
-    drv->data = (drv->kernel_buf)[1];
+    mutex_lock(&drv->lock);
+    ret = at24cxx_cache_flush(drv);
+    mutex_unlock(&drv->lock);
 
-	AT24CXX_DBG("[at24cxx_driver]addr = 0x%02x, data = 0x%02x\n", drv->addr, drv->data);
+    return ret;
+}
 
-    if (!i2c_smbus_write_byte_data(drv->client, drv->addr, drv->data))
-        return 2;
-    else 
-        return -EIO;
+static loff_t at24cxx_llseek(struct file *filp, loff_t offset, int orig)
+{
+    struct at24cxx_i2c *drv = filp->private_data;
+    loff_t pos;
+
+    switch (orig) {
+    case 0:     /* SEEK_SET */
+        pos = offset;
+        break;
+    case 1:     /* SEEK_CUR */
+        pos = filp->f_pos + offset;
+        break;
+    case 2:     /* SEEK_END */
+        pos = drv->chip->size + offset;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (pos < 0 || pos > drv->chip->size)
+        return -EINVAL;
+
+    filp->f_pos = pos;
+    return pos;
 }
 
 static struct file_operations at24cxx_fops = {
     .owner      = THIS_MODULE,
     .open       = at24cxx_open,
+    .llseek     = at24cxx_llseek,
     .read       = at24cxx_read,
     .write      = at24cxx_write,
+    .fsync      = at24cxx_fsync,
+};
+
+/* /sys/bus/i2c/devices/<bus>-<addr>/cache/ */
+#define AT24CXX_STAT(name)                                                  \
+static ssize_t at24cxx_show_##name(struct device *dev,                      \
+        struct device_attribute *attr, char *buf)                           \
+{                                                                           \
+    struct at24cxx_i2c *drv = i2c_get_clientdata(to_i2c_client(dev));       \
+                                                                            \
+    return sprintf(buf, "%lu\n", (unsigned long)drv->name);                 \
+}                                                                           \
+static DEVICE_ATTR(name, S_IRUGO, at24cxx_show_##name, NULL)
+
+AT24CXX_STAT(hits);
+AT24CXX_STAT(misses);
+AT24CXX_STAT(fills);
+AT24CXX_STAT(unchanged);
+AT24CXX_STAT(flushes);
+AT24CXX_STAT(pages_flushed);
+AT24CXX_STAT(flush_errors);
+AT24CXX_STAT(nr_dirty);
+
+/* Writing anything flushes now, like fsync() */
+static ssize_t at24cxx_store_flush(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct at24cxx_i2c *drv = i2c_get_clientdata(to_i2c_client(dev));
+    int ret;
+
+    mutex_lock(&drv->lock);
+    ret = at24cxx_cache_flush(drv);
+    mutex_unlock(&drv->lock);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR(flush, S_IWUSR, NULL, at24cxx_store_flush);
+
+static struct attribute *at24cxx_cache_attrs[] = {
+    &dev_attr_hits.attr,
+    &dev_attr_misses.attr,
+    &dev_attr_fills.attr,
+    &dev_attr_unchanged.attr,
+    &dev_attr_flushes.attr,
+    &dev_attr_pages_flushed.attr,
+    &dev_attr_flush_errors.attr,
+    &dev_attr_nr_dirty.attr,
+    &dev_attr_flush.attr,
+    NULL,
+};
+
+static const struct attribute_group at24cxx_cache_group = {
+    .name   = "cache",
+    .attrs  = at24cxx_cache_attrs,
 };
 
 
 static const struct i2c_device_id at24cxx_id_table[] = {
-	{ "at24c08", 0 },
+	{ "at24c02", 0 },
+	{ "at24c04", 1 },
+	{ "at24c08", 2 },
+	{ "at24c16", 3 },
+	{ }
 };
+MODULE_DEVICE_TABLE(i2c, at24cxx_id_table);
 
-static int at24cxx_driver_rest_setup(struct at24cxx_i2c *drv, 
-        struct i2c_client *client, int minor)
+static int at24cxx_driver_rest_setup(struct at24cxx_i2c *drv, int minor)
 {
     int ret = 0;
     int err, devno = MKDEV(at24cxx_driver_major, minor);
 
-    drv->client = client;
-
     cdev_init(&drv->cdev, &at24cxx_fops);
     drv->cdev.owner = THIS_MODULE;
     err = cdev_add(&drv->cdev, devno, 1);
@@ -118,8 +596,6 @@ static int at24cxx_driver_rest_setup(struct at24cxx_i2c *drv,
     
     device_create(drv->cls, NULL, MKDEV(at24cxx_driver_major, 0), NULL, "at24c08"); /* /dev/at24c08 */    
     
-    memset(drv->kernel_buf, 0, sizeof(drv->kernel_buf));
-
     /* Save at24cxx_driver structure to the atapter's algo_data */
     //drv->client->adapter->algo_data = drv;  /* Adding this line gets error, why? */
     return ret;
@@ -129,7 +605,7 @@ static int __devinit at24cxx_probe(struct i2c_client *client,
 				  const struct i2c_device_id *id)
 {
     //printk("[at24cxx_driver.c]In function %s, at line %d\n", __FUNCTION__, __LINE__);
-    int result;
+    int result, i;
     dev_t devno = MKDEV(at24cxx_driver_major, 0);
 
     /* register device number */
@@ -150,11 +626,61 @@ static int __devinit at24cxx_probe(struct i2c_client *client,
     }
 
     memset(at24cxx_driverp, 0, sizeof(struct at24cxx_i2c));
+    mutex_init(&at24cxx_driverp->lock);
+
+    at24cxx_driverp->chip = &at24cxx_chips[id->driver_data];
+    at24cxx_driverp->nr_pages = at24cxx_driverp->chip->size / at24cxx_driverp->chip->page_size;
+    INIT_DELAYED_WORK(&at24cxx_driverp->flush_work, at24cxx_flush_work);
+    i2c_set_clientdata(client, at24cxx_driverp);
+
+    /* The mirror is filled and flushed in whole pages */
+    if (io_limit < at24cxx_driverp->chip->page_size)
+        io_limit = at24cxx_driverp->chip->page_size;
+    if (io_limit > AT24CXX_BLOCK_SIZE)
+        io_limit = AT24CXX_BLOCK_SIZE;
+
+    at24cxx_driverp->buf = kmalloc(io_limit + 1, GFP_KERNEL);
+    if (!at24cxx_driverp->buf) {
+        result = -ENOMEM;
+        goto fail_clients;
+    }
+
+    /* Block 0 is the probed client, the others get dummy clients */
+    at24cxx_driverp->client[0] = client;
+    for (i = 1; i < at24cxx_driverp->chip->size / AT24CXX_BLOCK_SIZE; i++) {
+        at24cxx_driverp->client[i] = i2c_new_dummy(client->adapter, client->addr + i);
+        if (!at24cxx_driverp->client[i]) {
+            dev_err(&client->dev, "address 0x%02x unavailable\n", client->addr + i);
+            result = -EADDRINUSE;
+            goto fail_clients;
+        }
+    }
 
-    result = at24cxx_driver_rest_setup(at24cxx_driverp, client, 0);
+    if (cache && !byte_abi) {
+        at24cxx_driverp->mirror = kmalloc(at24cxx_driverp->chip->size, GFP_KERNEL);
+        if (!at24cxx_driverp->mirror) {
+            result = -ENOMEM;
+            goto fail_clients;
+        }
+
+        if (cache == 2) {
+            result = at24cxx_cache_fill(at24cxx_driverp, 0, at24cxx_driverp->chip->size);
+            if (result < 0)
+                goto fail_clients;
+        }
+
+        result = sysfs_create_group(&client->dev.kobj, &at24cxx_cache_group);
+        if (result < 0)
+            goto fail_clients;
+    }
+
+    result = at24cxx_driver_rest_setup(at24cxx_driverp, 0);
     if (result < 0)
         goto fail_setup;
-    
+
+    dev_info(&client->dev, "%s, %u bytes, %u byte pages, %s\n", id->name,
+            at24cxx_driverp->chip->size, at24cxx_driverp->chip->page_size,
+            at24cxx_driverp->mirror ? "write-back cache" : "no cache");
     return 0;
 
 fail_malloc:
@@ -162,6 +688,14 @@ fail_malloc:
     return result;
 
 fail_setup:
+    if (at24cxx_driverp->mirror)
+        sysfs_remove_group(&client->dev.kobj, &at24cxx_cache_group);
+fail_clients:
+    for (i = 1; i < AT24CXX_MAX_BLOCKS; i++)
+        if (at24cxx_driverp->client[i])
+            i2c_unregister_device(at24cxx_driverp->client[i]);
+    kfree(at24cxx_driverp->mirror);
+    kfree(at24cxx_driverp->buf);
     kfree(at24cxx_driverp);
     unregister_chrdev_region(devno, 1);
     return result;
@@ -169,10 +703,27 @@ fail_setup:
 
 static int __devexit at24cxx_remove(struct i2c_client *client)
 {
+    int i;
+
     //printk("[at24cxx_driver.c]In function %s, at line %d\n", __FUNCTION__, __LINE__);
     device_destroy(at24cxx_driverp->cls, MKDEV(at24cxx_driver_major, 0));
     class_destroy(at24cxx_driverp->cls);
     cdev_del(&at24cxx_driverp->cdev);
+
+    if (at24cxx_driverp->mirror) {
+        sysfs_remove_group(&client->dev.kobj, &at24cxx_cache_group);
+        cancel_delayed_work_sync(&at24cxx_driverp->flush_work);
+        mutex_lock(&at24cxx_driverp->lock);
+        if (at24cxx_cache_flush(at24cxx_driverp))
+            dev_err(&client->dev, "%u dirty pages lost\n", at24cxx_driverp->nr_dirty);
+        mutex_unlock(&at24cxx_driverp->lock);
+    }
+
+    for (i = 1; i < AT24CXX_MAX_BLOCKS; i++)
+        if (at24cxx_driverp->client[i])
+            i2c_unregister_device(at24cxx_driverp->client[i]);
+    kfree(at24cxx_driverp->mirror);
+    kfree(at24cxx_driverp->buf);
     kfree(at24cxx_driverp);
     unregister_chrdev_region(MKDEV(at24cxx_driver_major, 0), 1);
     return 0;
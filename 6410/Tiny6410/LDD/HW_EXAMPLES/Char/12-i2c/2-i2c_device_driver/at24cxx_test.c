@@ -10,18 +10,35 @@
 //#define AT24CXX_USER_DBG    printf
 #define AT24CXX_USER_DBG(...)
 
+#define AT24CXX_MAX_SIZE    2048
+
 void printUsage(char *fileName)
 {
-	printf("[USER]%s read addr\n", fileName);
-	printf("[USER]%s write addr val\n", fileName);
+	printf("[USER]%s read addr [count]\n", fileName);
+	printf("[USER]%s write addr val [val ...]\n", fileName);
+	printf("[USER]%s dump file\n", fileName);
+	printf("[USER]%s load file\n", fileName);
+}
+
+static void hexdump(unsigned int addr, unsigned char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i % 16 == 0)
+			printf("%s%04x:", i ? "\n" : "", addr + i);
+		printf(" %02x", buf[i]);
+	}
+	printf("\n");
 }
 
 int main(int argc, char **argv)
 {
-	int fd;
-	unsigned char buf[2];
+	int fd, file, i, len;
+	unsigned int addr;
+	unsigned char buf[AT24CXX_MAX_SIZE];
 	
-	if ((argc != 3) && (argc != 4)) {
+	if (argc < 3) {
 		printUsage(argv[0]);
 		return -1;
 	}
@@ -34,21 +51,56 @@ int main(int argc, char **argv)
 
 	if (strcmp(argv[1], "read") == 0) {
         AT24CXX_USER_DBG("read\n");
-		buf[0] = strtoul(argv[2], NULL, 0);
-		read(fd, buf, 1);
-		printf("\n[USER]dataValue is char[%c], int[%d], hex[0x%2x]\n\n", buf[0], buf[0], buf[0]);
-	}else if ((strcmp(argv[1], "write") == 0) && (argc == 4)) {
+		addr = strtoul(argv[2], NULL, 0);
+		len = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+		if (len <= 0 || len > AT24CXX_MAX_SIZE) {
+			printUsage(argv[0]);
+			return -1;
+		}
+		lseek(fd, addr, SEEK_SET);
+		len = read(fd, buf, len);
+		if (len < 0) {
+			printf("\n[USER]Failed to read, addr = 0x%02x\n\n", addr);
+			return -1;
+		}
+		if (len == 1)
+			printf("\n[USER]dataValue is char[%c], int[%d], hex[0x%2x]\n\n", buf[0], buf[0], buf[0]);
+		else
+			hexdump(addr, buf, len);
+	}else if ((strcmp(argv[1], "write") == 0) && (argc >= 4)) {
         AT24CXX_USER_DBG("write\n");
-		buf[0] = strtoul(argv[2], NULL, 0);
-		buf[1] = strtoul(argv[3], NULL, 0);
-		if (write(fd, buf, 2) != 2) {          
-			printf("\n[USER]Failed to write, addr = 0x%02x, data = 0x%02x\n\n", buf[0], buf[1]);
+		addr = strtoul(argv[2], NULL, 0);
+		for (i = 3, len = 0; i < argc && len < AT24CXX_MAX_SIZE; i++)
+			buf[len++] = strtoul(argv[i], NULL, 0);
+		lseek(fd, addr, SEEK_SET);
+		/* fsync: don't wait for the driver's write-back deadline */
+		if (write(fd, buf, len) != len || fsync(fd) < 0) {          
+			printf("\n[USER]Failed to write, addr = 0x%02x, data = 0x%02x\n\n", addr, buf[0]);
+		}
+	}else if (strcmp(argv[1], "dump") == 0) {
+		/* The whole chip in one read() */
+		len = read(fd, buf, sizeof(buf));
+		file = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (len < 0 || file < 0 || write(file, buf, len) != len) {
+			printf("\n[USER]Failed to dump to %s\n\n", argv[2]);
+			return -1;
 		}
+		printf("[USER]%d bytes saved to %s\n", len, argv[2]);
+		close(file);
+	}else if (strcmp(argv[1], "load") == 0) {
+		file = open(argv[2], O_RDONLY);
+		len = file < 0 ? -1 : read(file, buf, sizeof(buf));
+		if (len < 0 || write(fd, buf, len) != len || fsync(fd) < 0) {
+			printf("\n[USER]Failed to load %s\n\n", argv[2]);
+			return -1;
+		}
+		printf("[USER]%d bytes written from %s\n", len, argv[2]);
+		close(file);
 	}else {
 		printUsage(argv[0]);
 		return -1;
 	}
 	
+	close(fd);
 	return 0;
 }
-
@@ -12,15 +12,18 @@ void printUsage(char *fileName)
 {
     printf("[USER]%s </dev/i2c/0> <devAddr> read addr\n", fileName);
     printf("[USER]%s </dev/i2c/0> <devAddr> write addr dataValue\n", fileName);
+    printf("[USER]%s </dev/i2c/0> <devAddr> readblock addr count\n", fileName);
+    printf("[USER]%s </dev/i2c/0> <devAddr> writeblock addr dataValue...\n", fileName);
 }
 
 int main(int argc, char **argv)
 {
     int fd;
     unsigned char addr, dataValue;
-    int devAddr;
+    unsigned char block[I2C_SMBUS_BLOCK_MAX];
+    int devAddr, count, i;
 
-    if ((argc != 5) && (argc != 6)) {
+    if (argc < 5) {
         printUsage(argv[0]);
         return -1;
     }
@@ -46,6 +49,31 @@ int main(int argc, char **argv)
         addr = strtoul(argv[4], NULL, 0);
         dataValue = strtoul(argv[5], NULL, 0);
         i2c_smbus_write_byte_data(fd, addr, dataValue);
+    }else if ((strcmp(argv[3], "readblock") == 0) && (argc == 6)) {
+        /* One combined write + repeated start + read, up to 32 bytes */
+        addr = strtoul(argv[4], NULL, 0);
+        count = strtoul(argv[5], NULL, 0);
+        if (count > I2C_SMBUS_BLOCK_MAX)
+            count = I2C_SMBUS_BLOCK_MAX;
+        count = i2c_smbus_read_i2c_block_data(fd, addr, count, block);
+        if (count < 0) {
+            printf("\n[USER]Failed to read block at 0x%02x\n\n", addr);
+            return -1;
+        }
+        for (i = 0; i < count; i++)
+            printf("%02x%c", block[i], (i % 16 == 15 || i == count - 1) ? '\n' : ' ');
+    }else if ((strcmp(argv[3], "writeblock") == 0) && (argc >= 6)) {
+        /* Don't cross a page of the EEPROM, it wraps inside the page */
+        addr = strtoul(argv[4], NULL, 0);
+        count = argc - 5;
+        if (count > I2C_SMBUS_BLOCK_MAX)
+            count = I2C_SMBUS_BLOCK_MAX;
+        for (i = 0; i < count; i++)
+            block[i] = strtoul(argv[5 + i], NULL, 0);
+        if (i2c_smbus_write_i2c_block_data(fd, addr, count, block) < 0) {
+            printf("\n[USER]Failed to write block at 0x%02x\n\n", addr);
+            return -1;
+        }
     }else {
         printUsage(argv[0]);
         return -1;
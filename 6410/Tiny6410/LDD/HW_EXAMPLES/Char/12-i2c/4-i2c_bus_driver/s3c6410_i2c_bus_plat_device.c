@@ -24,6 +24,19 @@
 #include <asm/mach-types.h>
 
 
+/*
+ * bus1=1     also registers IIC1 (GPB2/GPB3) as "i2c_s3c6410.1"
+ * loopback=1 also registers "i2c_s3c6410_loop", the driver then runs its
+ *            built-in controller + AT24C08 stand-in, no hardware needed
+ */
+static int bus1;
+module_param(bus1, int, S_IRUGO);
+MODULE_PARM_DESC(bus1, "register the second controller IIC1 too (default 0)");
+
+static int loopback;
+module_param(loopback, int, S_IRUGO);
+MODULE_PARM_DESC(loopback, "register a loopback adapter with a simulated AT24C08 (default 0)");
+
 static struct resource s3c6410_i2c_bus_plat_dev_resource[] = {
 	[0] = {
 		.start = S3C64XX_PA_IIC0,
@@ -51,14 +64,74 @@ static struct platform_device s3c6410_i2c_bus_plat_dev = {
 };
 
 
+static struct resource s3c6410_i2c_bus1_plat_dev_resource[] = {
+	[0] = {
+		.start = S3C64XX_PA_IIC1,
+		.end   = S3C64XX_PA_IIC1 + 16 - 1,
+		.flags = IORESOURCE_MEM,
+	},
+	[1] = {
+		.start = IRQ_IIC1,
+		.flags = IORESOURCE_IRQ,
+	},
+};
+
+static struct platform_device s3c6410_i2c_bus1_plat_dev = {
+	.name		= "i2c_s3c6410",
+	.id		    = 1,
+	.num_resources	= ARRAY_SIZE(s3c6410_i2c_bus1_plat_dev_resource),
+	.resource	= s3c6410_i2c_bus1_plat_dev_resource,
+	.dev        = {
+		.release = s3c6410_i2c_bus_plat_dev_release,
+	},
+};
+
+/* No resources: the driver picks the stand-in by the name */
+static struct platform_device s3c6410_i2c_loop_plat_dev = {
+	.name		= "i2c_s3c6410_loop",
+	.id		    = -1,
+	.dev        = {
+		.release = s3c6410_i2c_bus_plat_dev_release,
+	},
+};
+
+
 static int __init s3c6410_i2c_bus_plat_device_init(void)
 {
-    platform_device_register(&s3c6410_i2c_bus_plat_dev);
+    int ret;
+
+    ret = platform_device_register(&s3c6410_i2c_bus_plat_dev);
+    if (ret)
+        return ret;
+
+    if (bus1) {
+        ret = platform_device_register(&s3c6410_i2c_bus1_plat_dev);
+        if (ret)
+            goto fail_bus1;
+    }
+
+    if (loopback) {
+        ret = platform_device_register(&s3c6410_i2c_loop_plat_dev);
+        if (ret)
+            goto fail_loop;
+    }
+
     return 0;
+
+fail_loop:
+    if (bus1)
+        platform_device_unregister(&s3c6410_i2c_bus1_plat_dev);
+fail_bus1:
+    platform_device_unregister(&s3c6410_i2c_bus_plat_dev);
+    return ret;
 }
 
 static void __exit s3c6410_i2c_bus_plat_device_exit(void)
 {
+    if (loopback)
+        platform_device_unregister(&s3c6410_i2c_loop_plat_dev);
+    if (bus1)
+        platform_device_unregister(&s3c6410_i2c_bus1_plat_dev);
     platform_device_unregister(&s3c6410_i2c_bus_plat_dev);
 }
 
@@ -1,4 +1,5 @@
 
+
 #include <linux/kernel.h>
 #include <linux/module.h>
 
@@ -17,6 +18,9 @@
 #include <linux/io.h>
 #include <linux/of_i2c.h>
 #include <linux/of_gpio.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <plat/gpio-cfg.h>
 #include <mach/regs-gpio.h>
 #include <mach/gpio-bank-b.h>
@@ -27,8 +31,10 @@
 #include <plat/regs-iic.h>
 #include <plat/iic.h>
 
+#include "s3c6410_i2c_sim.h"
+
 //#define AT24CXX_DBG   printk
-#define AT24CXX_DBG(...) 
+#define AT24CXX_DBG(...)
 
 enum s3c24xx_i2c_state {
 	STATE_IDLE,
@@ -38,292 +44,377 @@ enum s3c24xx_i2c_state {
 	STATE_STOP
 };
 
+/*
+ * IICCON while a transfer runs: ACK on, IICCLK = PCLK/16, IRQ on,
+ * Tx clock = IICCLK/16. IRQPEND is 0 in both, so writing either one
+ * also releases SCL for the next byte.
+ */
+#define S3C6410_IICCON_RUN	(S3C2410_IICCON_ACKEN | S3C2410_IICCON_TXDIV_16 | \
+				 S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK)
+/* The same without ACK, for the last byte of a read */
+#define S3C6410_IICCON_NACK	(S3C6410_IICCON_RUN & ~S3C2410_IICCON_ACKEN)
 
-struct s3c6410_i2c_xfer_data {
-	struct i2c_msg *msgs;
-	int msn_num;
-	int cur_msg;
-	int cur_ptr;
-	int state;
-	int err;
+#define S3C6410_I2C_LAT_BUCKETS	16	/* log2 of the transfer time in us */
+
+static unsigned int tx_setup = 50;
+module_param(tx_setup, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_setup, "ns between writing IICDS and releasing SCL (default 50)");
+
+static unsigned int timeout_ms = 20;
+module_param(timeout_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timeout_ms, "ms allowed on top of the wire time of a transfer (default 20)");
+
+/* One per controller, the adapter's algo_data */
+struct s3c6410_i2c {
+	struct i2c_adapter adap;
+	spinlock_t lock;
 	wait_queue_head_t wait;
-	struct resource	 *ioarea;
-    void __iomem *regs;
-    int irq_base;
-};
 
-static struct s3c6410_i2c_xfer_data s3c6410_i2c_xfer_data;
+	/* Transfer state, owned by the ISR between start and stop */
+	struct i2c_msg *msg;
+	struct i2c_msg *msg_last;
+	u8 *ptr;		/* next byte of msg->buf */
+	u8 *end;		/* msg->buf + msg->len */
+	int state;
+	int err;
 
+	struct resource *ioarea;
+	void __iomem *regs;
+	struct s3c6410_i2c_sim *sim;	/* loopback instead of regs */
+	struct clk *clk;
+	int irq;
+	unsigned int bus_khz;
+
+	/* Statistics, see the "stats" file of the platform device */
+	unsigned long xfers;
+	unsigned long msgs;
+	unsigned long bytes;
+	unsigned long irqs;
+	unsigned long nacks;
+	unsigned long arb_lost;
+	unsigned long timeouts;
+	unsigned long errors;
+	u64 lat_total_us;
+	u32 lat_max_us;
+	unsigned long lat_hist[S3C6410_I2C_LAT_BUCKETS];
+};
 
-static void s3c6410_i2c_start(void)
+/*
+ * Register access. On hardware the sim test is one well predicted
+ * branch; reg is a constant at every call site, so the byte/word choice
+ * is made at compile time.
+ */
+static inline u32 s3c6410_i2c_rd(struct s3c6410_i2c *i2c, int reg)
 {
-    unsigned char byte;
-    unsigned int i2cstat;
-	s3c6410_i2c_xfer_data.state = STATE_START;
-	
-	if (s3c6410_i2c_xfer_data.msgs->flags & I2C_M_RD) { /*  */ 
-        byte = s3c6410_i2c_xfer_data.msgs->addr << 1;
-        writeb(byte, s3c6410_i2c_xfer_data.regs + S3C2410_IICDS);
-		//s3c6410_i2c_regs->iicds		 = s3c6410_i2c_xfer_data.msgs->addr << 1;
-
-        /* i2cstat = 0xb0 */
-        i2cstat = S3C2410_IICSTAT_MASTER_RX | S3C2410_IICSTAT_START | S3C2410_IICSTAT_TXRXEN;
-        writel(i2cstat, s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-        //s3c6410_i2c_regs->iicstat 	 = 0xb0;	// գ
-	}else { /* д */
-        byte = s3c6410_i2c_xfer_data.msgs->addr << 1;
-        writeb(byte, s3c6410_i2c_xfer_data.regs + S3C2410_IICDS);
-		//s3c6410_i2c_regs->iicds		 = s3c6410_i2c_xfer_data.msgs->addr << 1;
-        
-        /* i2cstat = 0xf0 */
-        i2cstat = S3C2410_IICSTAT_MASTER_TX | S3C2410_IICSTAT_START | S3C2410_IICSTAT_TXRXEN;
-        writel(i2cstat, s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-        //s3c6410_i2c_regs->iicstat    = 0xf0; 		// ͣ
-	}
+	if (unlikely(i2c->sim))
+		return s3c6410_i2c_sim_read(i2c->sim, reg);
+	if (reg == S3C2410_IICDS || reg == S3C2410_IICADD)
+		return readb(i2c->regs + reg);
+	return readl(i2c->regs + reg);
 }
 
-static void s3c6410_i2c_stop(int err)
+static inline void s3c6410_i2c_wr(struct s3c6410_i2c *i2c, int reg, u32 val)
 {
-    unsigned int i2cstat;
-    unsigned long tmp;
-	s3c6410_i2c_xfer_data.state = STATE_STOP;
-	s3c6410_i2c_xfer_data.err   = err;
-
-	AT24CXX_DBG("STATE_STOP, err = %d\n", err);
-
-
-	if (s3c6410_i2c_xfer_data.msgs->flags & I2C_M_RD) { /*  */
-		// лָI2CPź
-		//s3c6410_i2c_regs->iicstat = 0x90;
-		i2cstat = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-		i2cstat = S3C2410_IICSTAT_MASTER_RX | S3C2410_IICSTAT_TXRXEN;
-        writel(i2cstat, s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-
-        tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-        /* tmp = 0xaf */
-        tmp = S3C2410_IICCON_ACKEN | S3C2410_IICCON_TXDIV_16 | S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK;  
-        writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-        //s3c6410_i2c_regs->iiccon  = 0xaf;
-		ndelay(50);  // ȴһʱԱPźѾ
-	}else { /* д */
-		// ָI2CPź
-		i2cstat = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-		i2cstat = S3C2410_IICSTAT_MASTER_TX | S3C2410_IICSTAT_TXRXEN;
-        writel(i2cstat, s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-        //s3c6410_i2c_regs->iicstat = 0xd0;
-
-        tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-        /* tmp = 0xaf */
-        tmp = S3C2410_IICCON_ACKEN | S3C2410_IICCON_TXDIV_16 | S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK;  
-        writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-        //s3c6410_i2c_regs->iiccon  = 0xaf;
-		ndelay(50);  // ȴһʱԱPźѾ
-	}
-
-	/*  */
-	wake_up(&s3c6410_i2c_xfer_data.wait);
+	if (unlikely(i2c->sim))
+		s3c6410_i2c_sim_write(i2c->sim, reg, val);
+	else if (reg == S3C2410_IICDS || reg == S3C2410_IICADD)
+		writeb(val, i2c->regs + reg);
+	else
+		writel(val, i2c->regs + reg);
 }
 
-static int s3c6410_i2c_xfer(struct i2c_adapter *adap,
-			struct i2c_msg *msgs, int num)
+/*
+ * S or Sr followed by the address byte. For a repeated start the
+ * controller still holds SCL low (IRQPEND), START goes out once the ISR
+ * clears it.
+ */
+static inline void s3c6410_i2c_start(struct s3c6410_i2c *i2c, struct i2c_msg *msg)
 {
-	unsigned long timeout;
-	
-	/* nummsgI2Cݷͳȥ/ */
-	s3c6410_i2c_xfer_data.msgs    = msgs;
-	s3c6410_i2c_xfer_data.msn_num = num;
-	s3c6410_i2c_xfer_data.cur_msg = 0;
-	s3c6410_i2c_xfer_data.cur_ptr = 0;
-	s3c6410_i2c_xfer_data.err     = -ENODEV;
-
-	s3c6410_i2c_start();
-
-	/*  */
-	timeout = wait_event_timeout(s3c6410_i2c_xfer_data.wait, (s3c6410_i2c_xfer_data.state == STATE_STOP), HZ * 5);
-	if (0 == timeout) {
-		printk("s3c6410_i2c_xfer time out\n");
-		return -ETIMEDOUT;
-	}else {
-		return s3c6410_i2c_xfer_data.err;
+	unsigned int addr = (msg->addr & 0x7f) << 1;
+	unsigned int i2cstat = S3C2410_IICSTAT_TXRXEN;
+
+	if (msg->flags & I2C_M_RD) { /*  */
+		i2cstat |= S3C2410_IICSTAT_MASTER_RX;
+		addr |= 1;
+	} else {
+		i2cstat |= S3C2410_IICSTAT_MASTER_TX;
 	}
+	if (msg->flags & I2C_M_REV_DIR_ADDR)
+		addr ^= 1;
+
+	i2c->state = STATE_START;
+
+	s3c6410_i2c_wr(i2c, S3C2410_IICSTAT, i2cstat);
+	s3c6410_i2c_wr(i2c, S3C2410_IICDS, addr);
+	ndelay(tx_setup);
+	s3c6410_i2c_wr(i2c, S3C2410_IICSTAT, i2cstat | S3C2410_IICSTAT_START);
 }
 
-static u32 s3c6410_i2c_func(struct i2c_adapter *adap)
+/* P goes out when the caller clears IRQPEND, lock held */
+static void s3c6410_i2c_stop(struct s3c6410_i2c *i2c, int err)
 {
-	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL | I2C_FUNC_PROTOCOL_MANGLING;
-}
+	unsigned int i2cstat;
 
+	AT24CXX_DBG("STATE_STOP, err = %d\n", err);
 
-static const struct i2c_algorithm s3c6410_i2c_algo = {
-	//.smbus_xfer     = s3c6410_smbus_xfer,
-	.master_xfer	= s3c6410_i2c_xfer,
-	.functionality	= s3c6410_i2c_func,
-};
+	/* Keep the mode, drop START/BUSY */
+	//s3c6410_i2c_regs->iicstat = 0x90;
+	i2cstat = s3c6410_i2c_rd(i2c, S3C2410_IICSTAT);
+	i2cstat = (i2cstat & S3C2410_IICSTAT_MODEMASK) | S3C2410_IICSTAT_TXRXEN;
+	s3c6410_i2c_wr(i2c, S3C2410_IICSTAT, i2cstat);
 
-/* 1. /i2c_adapter
- */
-static struct i2c_adapter s3c6410_i2c_adapter = {
-     .name			 = "s3c6410_i2cbus",
-     .algo			 = &s3c6410_i2c_algo,
-     .owner 		 = THIS_MODULE,
-};
+	i2c->state = STATE_STOP;
+	i2c->err   = err;
 
-static int isLastMsg(void)
-{
-	return (s3c6410_i2c_xfer_data.cur_msg == s3c6410_i2c_xfer_data.msn_num - 1);
+	/*  */
+	wake_up(&i2c->wait);
 }
 
-static int isEndData(void)
+/*
+ * One interrupt per byte on the bus. Everything on the byte path is
+ * inline: the message/buffer state is kept as pointers so there is no
+ * index arithmetic, and IICCON is written exactly once, at the end,
+ * which both sets the ACK for the next byte and clears IRQPEND.
+ */
+static irqreturn_t s3c6410_i2c_xfer_irq(int irq, void *dev_id)
 {
-	return (s3c6410_i2c_xfer_data.cur_ptr >= s3c6410_i2c_xfer_data.msgs->len);
-}
+	struct s3c6410_i2c *i2c = dev_id;
+	struct i2c_msg *msg;
+	unsigned int iicSt, con = S3C6410_IICCON_RUN;
 
-static int isLastData(void)
-{
-	return (s3c6410_i2c_xfer_data.cur_ptr == s3c6410_i2c_xfer_data.msgs->len - 1);
-}
+	spin_lock(&i2c->lock);
+	i2c->irqs++;
 
-static irqreturn_t s3c6410_i2c_xfer_irq(int irq, void *dev_id)
-{
-    unsigned char byte;
-    unsigned long tmp;
-	unsigned int iicSt = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-    //iicSt  = s3c6410_i2c_regs->iicstat; 
+	iicSt = s3c6410_i2c_rd(i2c, S3C2410_IICSTAT);
+	msg = i2c->msg;
 
-	if(iicSt & S3C2410_IICSTAT_ARBITR) 
-        printk("Bus arbitration failed\n\r");
+	if (unlikely(iicSt & S3C2410_IICSTAT_ARBITR)) {
+		i2c->arb_lost++;
+		if (i2c->state != STATE_STOP && i2c->state != STATE_IDLE)
+			s3c6410_i2c_stop(i2c, -EAGAIN);
+		goto out;
+	}
 
-	switch (s3c6410_i2c_xfer_data.state) {
-    case STATE_START : /* S豸ַ,ж */
-	{
+	switch (i2c->state) {
+	case STATE_START:
 		AT24CXX_DBG("Start\n");
-		/* ûACK, ش */
-		if (iicSt & S3C2410_IICSTAT_LASTBIT) {
-			s3c6410_i2c_stop(-ENODEV);
+		/* No ACK for the address: nobody there */
+		if ((iicSt & S3C2410_IICSTAT_LASTBIT) && !(msg->flags & I2C_M_IGNORE_NAK)) {
+			i2c->nacks++;
+			s3c6410_i2c_stop(i2c, -ENXIO);
 			break;
 		}
 
-		if (isLastMsg() && isEndData()) {
-			s3c6410_i2c_stop(0);
+		if (msg->flags & I2C_M_RD) {
+			i2c->state = STATE_READ;
+			if (i2c->ptr == i2c->end)
+				goto next_msg;
+			/* ACK every byte but the last, a block length is never the last */
+			if (i2c->end - i2c->ptr == 1 && !(msg->flags & I2C_M_RECV_LEN))
+				con = S3C6410_IICCON_NACK;
 			break;
 		}
 
-		/* һ״̬ */
-		if (s3c6410_i2c_xfer_data.msgs->flags & I2C_M_RD) { /*  */ 
-			s3c6410_i2c_xfer_data.state = STATE_READ;
-			goto next_read;
-		}else {
-			s3c6410_i2c_xfer_data.state = STATE_WRITE;
-		}	
-	}
+		i2c->state = STATE_WRITE;
+		goto write_byte;
 
-	case STATE_WRITE: {
+	case STATE_WRITE:
 		AT24CXX_DBG("STATE_WRITE\n");
-		/* ûACK, ش */
-		if (iicSt & S3C2410_IICSTAT_LASTBIT) {
-			s3c6410_i2c_stop(-ENODEV);
+		if ((iicSt & S3C2410_IICSTAT_LASTBIT) && !(msg->flags & I2C_M_IGNORE_NAK)) {
+			i2c->nacks++;
+			s3c6410_i2c_stop(i2c, -EIO);
 			break;
 		}
-
-		if (!isEndData()) { /* ǰmsgҪ */
-            byte = s3c6410_i2c_xfer_data.msgs->buf[s3c6410_i2c_xfer_data.cur_ptr];
-            writeb(byte, s3c6410_i2c_xfer_data.regs + S3C2410_IICDS);
-			//s3c6410_i2c_regs->iicds = s3c6410_i2c_xfer_data.msgs->buf[s3c6410_i2c_xfer_data.cur_ptr];
-			s3c6410_i2c_xfer_data.cur_ptr++;
-			
-			// дIICDSҪһʱܳSDA
-			ndelay(50);	
-
-            tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-            /* tmp = 0xaf */
-            tmp = S3C2410_IICCON_ACKEN | S3C2410_IICCON_TXDIV_16 | S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK;  
-            writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-			//s3c6410_i2c_regs->iiccon = 0xaf;		// ָI2C
-			break;				
-		}else if (!isLastMsg()) {
-			/* ʼһϢ */
-			s3c6410_i2c_xfer_data.msgs++;
-			s3c6410_i2c_xfer_data.cur_msg++;
-			s3c6410_i2c_xfer_data.cur_ptr = 0;
-			s3c6410_i2c_xfer_data.state = STATE_START;
-			/* STARTźźͷ豸ַ */
-			s3c6410_i2c_start();
+write_byte:
+		if (i2c->ptr < i2c->end) {
+			s3c6410_i2c_wr(i2c, S3C2410_IICDS, *i2c->ptr++);
+			/* SDA needs the data before SCL is released */
+			ndelay(tx_setup);
 			break;
-		}else {
-			/* һϢһ */
-			s3c6410_i2c_stop(0);
-			break;				
 		}
+		goto next_msg;
 
-		break;
-	}
-
-	case STATE_READ: {
+	case STATE_READ:
 		AT24CXX_DBG("STATE_READ\n");
-		/*  */
-		//s3c6410_i2c_xfer_data.msgs->buf[s3c6410_i2c_xfer_data.cur_ptr] = s3c6410_i2c_regs->iicds;			
-        byte = readb(s3c6410_i2c_xfer_data.regs + S3C2410_IICDS);
-        s3c6410_i2c_xfer_data.msgs->buf[s3c6410_i2c_xfer_data.cur_ptr] = byte;			
-		s3c6410_i2c_xfer_data.cur_ptr++;
-next_read:
-		if (!isEndData()) { /* ûд,  */
-			if (isLastData()) { /* һ, ack */
-                tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-                /* tmp = 0x2f */
-                tmp = S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK;
-                writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-                //s3c6410_i2c_regs->iiccon = 0x2f;   // ָI2C䣬յһʱACK
-			}else {
-                tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);                    
-                /* tmp = 0xaf */
-                tmp = S3C2410_IICCON_ACKEN | S3C2410_IICCON_TXDIV_16 | S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK;  
-                writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-				//s3c6410_i2c_regs->iiccon = 0xaf;   // ָI2C䣬յһʱACK
-			}				
-			break;
-		}else if (!isLastMsg()) {
-			/* ʼһϢ */
-			s3c6410_i2c_xfer_data.msgs++;
-			s3c6410_i2c_xfer_data.cur_msg++;
-			s3c6410_i2c_xfer_data.cur_ptr = 0;
-			s3c6410_i2c_xfer_data.state = STATE_START;
-			/* STARTźźͷ豸ַ */
-			s3c6410_i2c_start();
+		*i2c->ptr = s3c6410_i2c_rd(i2c, S3C2410_IICDS);
+
+		/* SMBus block read: the first byte says how many follow */
+		if (unlikely(msg->flags & I2C_M_RECV_LEN) && i2c->ptr == msg->buf) {
+			if (*i2c->ptr == 0 || *i2c->ptr > I2C_SMBUS_BLOCK_MAX) {
+				s3c6410_i2c_stop(i2c, -EPROTO);
+				break;
+			}
+			msg->len += *i2c->ptr;
+			i2c->end += *i2c->ptr;
+		}
+
+		if (++i2c->ptr < i2c->end) {
+			if (i2c->end - i2c->ptr == 1)
+				con = S3C6410_IICCON_NACK;
 			break;
-		}else {
-			/* һϢһ */
-			s3c6410_i2c_stop(0);
-			break;								
 		}
+		goto next_msg;
+
+	default:
+		/* Nothing running: a late interrupt after a timeout */
 		break;
 	}
+	goto out;
+
+next_msg:
+	i2c->bytes += msg->len;
+	if (msg == i2c->msg_last) {
+		s3c6410_i2c_stop(i2c, 0);
+		goto out;
+	}
 
-	default: break;
+	i2c->msg = ++msg;
+	i2c->ptr = msg->buf;
+	i2c->end = msg->buf + msg->len;
+
+	/* Checked in s3c6410_i2c_xfer(): only a write after a write */
+	if (msg->flags & I2C_M_NOSTART) {
+		i2c->state = STATE_WRITE;
+		goto write_byte;
 	}
 
+	/* Repeated start, no STOP in between */
+	s3c6410_i2c_start(i2c, msg);
+
+out:
 	/* ж */
-    tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-    writel(tmp & ~(S3C2410_IICCON_IRQPEND), s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-	//s3c6410_i2c_regs->iiccon &= ~(S3C2410_IICCON_IRQPEND);
+	s3c6410_i2c_wr(i2c, S3C2410_IICCON, con);
+	spin_unlock(&i2c->lock);
 
-	return IRQ_HANDLED;	
+	return IRQ_HANDLED;
 }
 
+/* P of the previous transfer may still be on its way */
+static int s3c6410_i2c_wait_idle(struct s3c6410_i2c *i2c)
+{
+	int tries;
+
+	for (tries = 0; tries < 400; tries++) {
+		if (!(s3c6410_i2c_rd(i2c, S3C2410_IICSTAT) & S3C2410_IICSTAT_BUSBUSY))
+			return 0;
+		udelay(1);
+	}
+
+	return -EAGAIN;
+}
+
+static void s3c6410_i2c_account(struct s3c6410_i2c *i2c, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = us > 0 ? ilog2(us) + 1 : 0;
+
+	if (bucket >= S3C6410_I2C_LAT_BUCKETS)
+		bucket = S3C6410_I2C_LAT_BUCKETS - 1;
+
+	i2c->xfers++;
+	i2c->lat_total_us += us;
+	if (us > i2c->lat_max_us)
+		i2c->lat_max_us = us;
+	i2c->lat_hist[bucket]++;
+}
+
+static int s3c6410_i2c_xfer(struct i2c_adapter *adap,
+			struct i2c_msg *msgs, int num)
+{
+	struct s3c6410_i2c *i2c = i2c_get_adapdata(adap);
+	unsigned long timeout, bytes = 0;
+	ktime_t start;
+	int i, ret;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & I2C_M_TEN)
+			return -EINVAL;
+		if ((msgs[i].flags & I2C_M_NOSTART) &&
+		    (i == 0 || (msgs[i].flags & I2C_M_RD) || (msgs[i - 1].flags & I2C_M_RD)))
+			return -EINVAL;
+		bytes += msgs[i].len + 1;
+		if (msgs[i].flags & I2C_M_RECV_LEN)
+			bytes += I2C_SMBUS_BLOCK_MAX;
+	}
+
+	ret = s3c6410_i2c_wait_idle(i2c);
+	if (ret) {
+		dev_err(&adap->dev, "bus busy\n");
+		return ret;
+	}
+
+	start = ktime_get();
+
+	spin_lock_irq(&i2c->lock);
+	i2c->msg      = msgs;
+	i2c->msg_last = msgs + num - 1;
+	i2c->ptr      = msgs->buf;
+	i2c->end      = msgs->buf + msgs->len;
+	i2c->err      = -EIO;
+	s3c6410_i2c_wr(i2c, S3C2410_IICCON, S3C6410_IICCON_RUN);
+	s3c6410_i2c_start(i2c, msgs);
+	spin_unlock_irq(&i2c->lock);
+
+	/* Wire time of the whole transfer, 9 clocks a byte, plus timeout_ms */
+	timeout = usecs_to_jiffies(bytes * 9000 / i2c->bus_khz) + msecs_to_jiffies(timeout_ms);
+	wait_event_timeout(i2c->wait, i2c->state == STATE_STOP, timeout);
+
+	spin_lock_irq(&i2c->lock);
+	if (i2c->state != STATE_STOP) {
+		/* Still running: send P and give the bus back */
+		dev_err(&adap->dev, "transfer timed out\n");
+		i2c->timeouts++;
+		s3c6410_i2c_stop(i2c, -ETIMEDOUT);
+		s3c6410_i2c_wr(i2c, S3C2410_IICCON, S3C6410_IICCON_RUN);
+	}
+	ret = i2c->err;
+	i2c->state = STATE_IDLE;
+
+	s3c6410_i2c_account(i2c, start);
+	if (ret)
+		i2c->errors++;
+	else
+		i2c->msgs += num;
+	spin_unlock_irq(&i2c->lock);
+
+	/* i2c_transfer() callers check for num, not 0 */
+	return ret ? ret : num;
+}
+
+static u32 s3c6410_i2c_func(struct i2c_adapter *adap)
+{
+	/*
+	 * SMBUS_EMUL includes the I2C block read/write (command write, Sr,
+	 * read), RECV_LEN gives the SMBus block read and block process call.
+	 */
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL | I2C_FUNC_SMBUS_I2C_BLOCK |
+		I2C_FUNC_SMBUS_READ_BLOCK_DATA | I2C_FUNC_SMBUS_BLOCK_PROC_CALL |
+		I2C_FUNC_PROTOCOL_MANGLING;
+}
+
+
+static const struct i2c_algorithm s3c6410_i2c_algo = {
+	//.smbus_xfer     = s3c6410_smbus_xfer,
+	.master_xfer	= s3c6410_i2c_xfer,
+	.functionality	= s3c6410_i2c_func,
+};
+
 
 /*
  * I2Cʼ
  */
-static void s3c6410_i2c_init(void)
+static void s3c6410_i2c_init(struct s3c6410_i2c *i2c, int bus)
 {
-	struct clk *clk;
-    unsigned long tmp;
-
-	clk = clk_get(NULL, "i2c");
-	clk_enable(clk);
-	
-    // ѡŹܣGPE15:IICSDA, GPE14:IICSCL
-	s3c_gpio_cfgpin(S3C64XX_GPB(5), S3C64XX_GPB5_I2C_SCL0);
-	s3c_gpio_cfgpin(S3C64XX_GPB(6), S3C64XX_GPB6_I2C_SDA0);
+	if (!i2c->sim) {
+		// ѡŹܣGPE15:IICSDA, GPE14:IICSCL
+		if (bus == 1) {
+			s3c_gpio_cfgpin(S3C64XX_GPB(2), S3C64XX_GPB2_I2C_SCL1);
+			s3c_gpio_cfgpin(S3C64XX_GPB(3), S3C64XX_GPB3_I2C_SDA1);
+		} else {
+			s3c_gpio_cfgpin(S3C64XX_GPB(5), S3C64XX_GPB5_I2C_SCL0);
+			s3c_gpio_cfgpin(S3C64XX_GPB(6), S3C64XX_GPB6_I2C_SDA0);
+		}
+	}
 
     /* bit[7] = 1, ʹACK
      * bit[6] = 0, IICCLK = PCLK/16
@@ -331,76 +422,228 @@ static void s3c6410_i2c_init(void)
      * bit[3:0] = 0xf, Tx clock = IICCLK/16
      * PCLK = 50MHz, IICCLK = 3.125MHz, Tx Clock = 0.195MHz
      */
-    tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
-    tmp = S3C2410_IICCON_ACKEN | S3C2410_IICCON_TXDIV_16 | S3C2410_IICCON_IRQEN | S3C2410_IICCON_SCALEMASK;  
-    writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICCON);
+    s3c6410_i2c_wr(i2c, S3C2410_IICCON, S3C6410_IICCON_RUN);
     //s3c6410_i2c_regs->iiccon = (1<<7) | (0<<6) | (1<<5) | (0xf);  // 0xaf
 
-    tmp = readb(s3c6410_i2c_xfer_data.regs + S3C2410_IICADD);
-    tmp = 0x10; /* slave_addr */
-    writeb(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICADD);
+    s3c6410_i2c_wr(i2c, S3C2410_IICADD, 0x10); /* slave_addr */
     //s3c6410_i2c_regs->iicadd  = 0x10;     // S3C24xx slave address = [7:1]
 
-    tmp = readl(s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
-    tmp = 0x10;
-    writel(tmp, s3c6410_i2c_xfer_data.regs + S3C2410_IICSTAT);
+    s3c6410_i2c_wr(i2c, S3C2410_IICSTAT, 0x10);
     //s3c6410_i2c_regs->iicstat = 0x10;     // I2Cʹ(Rx/Tx)
 }
 
 
+static ssize_t s3c6410_i2c_show_stats(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct s3c6410_i2c *i2c = platform_get_drvdata(to_platform_device(dev));
+	unsigned long per_byte = i2c->bytes ? i2c->irqs * 100 / i2c->bytes : 0;
+	u64 avg = i2c->lat_total_us;
+	int i, len;
+
+	if (i2c->xfers)
+		do_div(avg, i2c->xfers);
+
+	len = sprintf(buf,
+		"xfers:          %lu\n"
+		"msgs:           %lu\n"
+		"bytes:          %lu\n"
+		"irqs:           %lu\n"
+		"irqs_per_byte:  %lu.%02lu\n"
+		"nacks:          %lu\n"
+		"arb_lost:       %lu\n"
+		"timeouts:       %lu\n"
+		"errors:         %lu\n"
+		"latency_avg_us: %llu\n"
+		"latency_max_us: %u\n",
+		i2c->xfers, i2c->msgs, i2c->bytes, i2c->irqs,
+		per_byte / 100, per_byte % 100, i2c->nacks, i2c->arb_lost,
+		i2c->timeouts, i2c->errors, (unsigned long long)avg, i2c->lat_max_us);
+
+	for (i = 0; i < S3C6410_I2C_LAT_BUCKETS; i++)
+		if (i2c->lat_hist[i])
+			len += sprintf(buf + len, "  <%6u us: %lu\n", 1U << i, i2c->lat_hist[i]);
+
+	return len;
+}
+
+/* Writing anything clears the counters */
+static ssize_t s3c6410_i2c_store_stats(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct s3c6410_i2c *i2c = platform_get_drvdata(to_platform_device(dev));
+
+	i2c_lock_adapter(&i2c->adap);
+	spin_lock_irq(&i2c->lock);
+	i2c->xfers = i2c->msgs = i2c->bytes = i2c->irqs = 0;
+	i2c->nacks = i2c->arb_lost = i2c->timeouts = i2c->errors = 0;
+	i2c->lat_total_us = 0;
+	i2c->lat_max_us = 0;
+	memset(i2c->lat_hist, 0, sizeof(i2c->lat_hist));
+	spin_unlock_irq(&i2c->lock);
+	i2c_unlock_adapter(&i2c->adap);
+
+	return count;
+}
+
+static DEVICE_ATTR(stats, S_IRUGO | S_IWUSR, s3c6410_i2c_show_stats, s3c6410_i2c_store_stats);
+
+
 static int s3c6410_i2c_bus_probe(struct platform_device *pdev)
-{    
-    /* 2. Ӳص */
+{
+	const struct platform_device_id *id = platform_get_device_id(pdev);
+	struct s3c6410_i2c *i2c;
 	struct resource *res;
+	int ret;
+
+	i2c = kzalloc(sizeof(*i2c), GFP_KERNEL);
+	if (!i2c) {
+		printk("[s3c6410_i2c_bus]Error: Failed to allocate the adapter!\n");
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&i2c->lock);
+	init_waitqueue_head(&i2c->wait);
+	i2c->state = STATE_IDLE;
+
+	if (id->driver_data) {
+		/* Loopback stand-in, no controller and no EEPROM needed */
+		i2c->sim = kmalloc(sizeof(*i2c->sim), GFP_KERNEL);
+		if (!i2c->sim) {
+			ret = -ENOMEM;
+			goto fail_free;
+		}
+		s3c6410_i2c_sim_init(i2c->sim, s3c6410_i2c_xfer_irq, i2c);
+		i2c->bus_khz = 9000 / (sim_byte_us ? sim_byte_us : 1);
+		s3c6410_i2c_init(i2c, pdev->id);
+		goto add_adapter;
+	}
 
+    /* 2. Ӳص */
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
     if (!res) {
         printk("[s3c6410_i2c_bus]Error: Failed to get IORESOURCE_MEM!\n");
-        return -ENODEV;
+		ret = -ENODEV;
+		goto fail_free;
     }
 
-    s3c6410_i2c_xfer_data.ioarea = request_mem_region(res->start, resource_size(res), pdev->name);
-    if (s3c6410_i2c_xfer_data.ioarea == NULL) {        
+    i2c->ioarea = request_mem_region(res->start, resource_size(res), pdev->name);
+    if (i2c->ioarea == NULL) {
         printk("[s3c6410_i2c_bus]Error: Failed to request iomem!\n");
-        return -ENOMEM;
+		ret = -ENOMEM;
+		goto fail_free;
     }
 
-    s3c6410_i2c_xfer_data.regs = ioremap(res->start, resource_size(res));
-    if (s3c6410_i2c_xfer_data.regs == NULL) {
+    i2c->regs = ioremap(res->start, resource_size(res));
+    if (i2c->regs == NULL) {
         printk("[s3c6410_i2c_bus]Error: Failed to ioremap io regs!\n");
-        return -ENOMEM;
+		ret = -ENOMEM;
+		goto fail_region;
     }
-	
-	s3c6410_i2c_init();
 
-    s3c6410_i2c_xfer_data.irq_base = platform_get_irq(pdev, 0);
-    if (s3c6410_i2c_xfer_data.irq_base < 0) {
+	i2c->clk = clk_get(&pdev->dev, "i2c");
+	if (IS_ERR(i2c->clk)) {
+		printk("[s3c6410_i2c_bus]Error: Failed to get the i2c clock!\n");
+		ret = PTR_ERR(i2c->clk);
+		goto fail_unmap;
+	}
+	clk_enable(i2c->clk);
+
+	/* IICCLK = PCLK/16, Tx clock = IICCLK/16 */
+	i2c->bus_khz = clk_get_rate(i2c->clk) / 16 / 16 / 1000;
+	if (!i2c->bus_khz)
+		i2c->bus_khz = 1;
+
+	s3c6410_i2c_init(i2c, pdev->id);
+
+    i2c->irq = platform_get_irq(pdev, 0);
+    if (i2c->irq < 0) {
         printk("[s3c6410_i2c_bus]Error: Failed to get irq!\n");
-        return -ENODEV;
+		ret = -ENODEV;
+		goto fail_clk;
     }
 
-    if (request_irq(s3c6410_i2c_xfer_data.irq_base, s3c6410_i2c_xfer_irq, 0, "s3c6410-i2c", NULL)) {
-    	printk(KERN_ERR "[i2c_bus_s3c6410]cannot obtain IRQ %d\n", s3c6410_i2c_xfer_data.irq_base);
-        return -EBUSY;
+    if (request_irq(i2c->irq, s3c6410_i2c_xfer_irq, 0, dev_name(&pdev->dev), i2c)) {
+    	printk(KERN_ERR "[i2c_bus_s3c6410]cannot obtain IRQ %d\n", i2c->irq);
+		ret = -EBUSY;
+		goto fail_clk;
     }
 
-	init_waitqueue_head(&s3c6410_i2c_xfer_data.wait);
-	
+add_adapter:
 	/* 3. עi2c_adapter */
-	i2c_add_adapter(&s3c6410_i2c_adapter);
+	strlcpy(i2c->adap.name, i2c->sim ? "s3c6410_i2c_loop" : "s3c6410_i2cbus",
+		sizeof(i2c->adap.name));
+	i2c->adap.owner      = THIS_MODULE;
+	i2c->adap.algo       = &s3c6410_i2c_algo;
+	i2c->adap.retries    = 2;	/* for -EAGAIN, arbitration lost */
+	i2c->adap.dev.parent = &pdev->dev;
+	i2c_set_adapdata(&i2c->adap, i2c);
+	platform_set_drvdata(pdev, i2c);
+
+	ret = i2c_add_adapter(&i2c->adap);
+	if (ret) {
+		printk("[s3c6410_i2c_bus]Error: Failed to add the adapter!\n");
+		goto fail_irq;
+	}
+
+	if (device_create_file(&pdev->dev, &dev_attr_stats))
+		dev_warn(&pdev->dev, "no stats file\n");
 
+	dev_info(&pdev->dev, "%s is i2c-%d, %u kHz\n", i2c->adap.name,
+		 i2c->adap.nr, i2c->bus_khz);
     return 0;
+
+fail_irq:
+	if (i2c->sim) {
+		s3c6410_i2c_sim_exit(i2c->sim);
+		kfree(i2c->sim);
+		goto fail_free;
+	}
+	free_irq(i2c->irq, i2c);
+fail_clk:
+	clk_disable(i2c->clk);
+	clk_put(i2c->clk);
+fail_unmap:
+	iounmap(i2c->regs);
+fail_region:
+	release_mem_region(i2c->ioarea->start, resource_size(i2c->ioarea));
+fail_free:
+	kfree(i2c);
+	return ret;
 }
 
 static int s3c6410_i2c_bus_remove(struct platform_device *pdev)
-{    
-	i2c_del_adapter(&s3c6410_i2c_adapter);	
-	free_irq(s3c6410_i2c_xfer_data.irq_base, NULL);
-	iounmap(s3c6410_i2c_xfer_data.regs);
+{
+	struct s3c6410_i2c *i2c = platform_get_drvdata(pdev);
+
+	device_remove_file(&pdev->dev, &dev_attr_stats);
+	i2c_del_adapter(&i2c->adap);
+
+	if (i2c->sim) {
+		s3c6410_i2c_sim_exit(i2c->sim);
+		kfree(i2c->sim);
+	} else {
+		free_irq(i2c->irq, i2c);
+		clk_disable(i2c->clk);
+		clk_put(i2c->clk);
+		iounmap(i2c->regs);
+		release_mem_region(i2c->ioarea->start, resource_size(i2c->ioarea));
+	}
+
+	platform_set_drvdata(pdev, NULL);
+	kfree(i2c);
     return 0;
 }
 
 
+/* driver_data: 1 = loopback stand-in */
+static struct platform_device_id s3c6410_i2c_bus_ids[] = {
+	{ "i2c_s3c6410",      0 },
+	{ "i2c_s3c6410_loop", 1 },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, s3c6410_i2c_bus_ids);
+
 static struct platform_driver s3c6410_i2c_bus_plat_drv = {
 	.driver		= {
 		.name	= "i2c_s3c6410",
@@ -408,13 +651,13 @@ static struct platform_driver s3c6410_i2c_bus_plat_drv = {
 	},
 	.probe		= s3c6410_i2c_bus_probe,
 	.remove		= __devexit_p(s3c6410_i2c_bus_remove),
+	.id_table	= s3c6410_i2c_bus_ids,
 };
 
 
 static int i2c_bus_s3c6410_init(void)
-{    
-    platform_driver_register(&s3c6410_i2c_bus_plat_drv);
-	return 0;
+{
+    return platform_driver_register(&s3c6410_i2c_bus_plat_drv);
 }
 
 static void i2c_bus_s3c6410_exit(void)
@@ -0,0 +1,266 @@
+#ifndef _S3C6410_I2C_SIM_H
+#define _S3C6410_I2C_SIM_H
+
+/*
+ * Loopback stand-in for the S3C6410 I2C controller with an AT24C08 on
+ * its bus, so the adapter (and at24cxx_driver on top of it) can be
+ * exercised without the chip. It is used for the "i2c_s3c6410_loop"
+ * platform device, see loopback=1 in s3c6410_i2c_bus_plat_device.c.
+ *
+ * Only what the driver relies on is modelled:
+ *  - writing IICSTAT with START on an idle bus starts the address phase,
+ *    a START or STOP written while IRQPEND is set takes effect when
+ *    IRQPEND is cleared, like on the real controller
+ *  - clearing IRQPEND in master Tx/Rx mode moves one byte
+ *  - every phase takes sim_byte_us, then IRQPEND is set and the ISR is
+ *    called from the hrtimer, i.e. in hard irq context like from the VIC
+ *  - the EEPROM answers on 0x50-0x53, sequential reads wrap over 1 KB,
+ *    page writes wrap inside 16 bytes and the chip NAKs its address for
+ *    sim_twr_us after the STOP of a write
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+
+static unsigned int sim_byte_us = 20;
+module_param(sim_byte_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_byte_us, "loopback: duration of one 9 clock byte phase in us (default 20)");
+
+static unsigned int sim_twr_us = 3000;
+module_param(sim_twr_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_twr_us, "loopback: EEPROM write cycle time in us (default 3000)");
+
+#define SIM_EEPROM_ADDR     0x50
+#define SIM_EEPROM_BLOCKS   4
+#define SIM_EEPROM_SIZE     1024
+#define SIM_EEPROM_PAGE     16
+
+enum {
+	SIM_REQ_NONE,
+	SIM_REQ_START,
+	SIM_REQ_STOP,
+};
+
+enum {
+	SIM_PH_ADDR,
+	SIM_PH_TX,
+	SIM_PH_RX,
+};
+
+struct s3c6410_i2c_sim {
+	spinlock_t lock;
+	struct hrtimer timer;
+	irq_handler_t isr;
+	void *dev_id;
+
+	/* Controller */
+	u32 con, stat, add, ds, lc;
+	int busy;               /* between S and P */
+	int req;                /* START/STOP written while IRQPEND was set */
+	int phase;
+
+	/* EEPROM */
+	u8 mem[SIM_EEPROM_SIZE];
+	unsigned int ptr;       /* internal address counter */
+	int selected;           /* our address was ACKed */
+	int need_word;          /* next byte written is the word address */
+	int wrote;
+	ktime_t ready;          /* end of the write cycle */
+};
+
+static void s3c6410_i2c_sim_kick(struct s3c6410_i2c_sim *sim, int phase)
+{
+	sim->phase = phase;
+	hrtimer_start(&sim->timer, ktime_set(0, sim_byte_us * 1000), HRTIMER_MODE_REL);
+}
+
+/* One bus phase is over: move the byte, then raise the interrupt */
+static enum hrtimer_restart s3c6410_i2c_sim_timer(struct hrtimer *t)
+{
+	struct s3c6410_i2c_sim *sim = container_of(t, struct s3c6410_i2c_sim, timer);
+	unsigned long flags;
+	unsigned int dev;
+	int nak = 0;
+
+	spin_lock_irqsave(&sim->lock, flags);
+
+	switch (sim->phase) {
+	case SIM_PH_ADDR:
+		dev = (sim->ds >> 1) - SIM_EEPROM_ADDR;
+		sim->selected = dev < SIM_EEPROM_BLOCKS &&
+			ktime_to_ns(ktime_sub(ktime_get(), sim->ready)) >= 0;
+		if (sim->selected) {
+			/* The block bits of the device address select the 256 bytes */
+			sim->ptr = dev * 256 + (sim->ptr & 0xff);
+			sim->need_word = !(sim->ds & 1);
+		}
+		nak = !sim->selected;
+		break;
+
+	case SIM_PH_TX:
+		if (!sim->selected) {
+			nak = 1;
+		} else if (sim->need_word) {
+			sim->ptr = (sim->ptr & ~0xff) | sim->ds;
+			sim->need_word = 0;
+		} else {
+			sim->mem[sim->ptr] = sim->ds;
+			sim->ptr = (sim->ptr & ~(SIM_EEPROM_PAGE - 1)) |
+				((sim->ptr + 1) & (SIM_EEPROM_PAGE - 1));
+			sim->wrote = 1;
+		}
+		break;
+
+	case SIM_PH_RX:
+		if (sim->selected) {
+			sim->ds = sim->mem[sim->ptr];
+			sim->ptr = (sim->ptr + 1) % SIM_EEPROM_SIZE;
+		} else {
+			sim->ds = 0xff;
+		}
+		/* In Rx mode LASTBIT is the ACK the master just sent */
+		nak = !(sim->con & S3C2410_IICCON_ACKEN);
+		break;
+	}
+
+	sim->stat = (sim->stat & ~S3C2410_IICSTAT_LASTBIT) | (nak ? S3C2410_IICSTAT_LASTBIT : 0);
+	sim->con |= S3C2410_IICCON_IRQPEND;
+
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	if (sim->con & S3C2410_IICCON_IRQEN)
+		sim->isr(0, sim->dev_id);
+
+	return HRTIMER_NORESTART;
+}
+
+/* IRQPEND went from 1 to 0: the controller releases SCL, sim->lock held */
+static void s3c6410_i2c_sim_release(struct s3c6410_i2c_sim *sim)
+{
+	int req = sim->req;
+
+	sim->req = SIM_REQ_NONE;
+
+	if (req == SIM_REQ_STOP) {
+		if (sim->selected && sim->wrote)
+			sim->ready = ktime_add_us(ktime_get(), sim_twr_us);
+		sim->busy = 0;
+		sim->selected = 0;
+		sim->wrote = 0;
+		return;
+	}
+
+	if (req == SIM_REQ_START) {
+		if (sim->selected && sim->wrote)
+			sim->ready = ktime_add_us(ktime_get(), sim_twr_us);
+		sim->selected = 0;
+		sim->wrote = 0;
+		s3c6410_i2c_sim_kick(sim, SIM_PH_ADDR);
+		return;
+	}
+
+	if (!sim->busy)
+		return;
+
+	if ((sim->stat & S3C2410_IICSTAT_MODEMASK) == S3C2410_IICSTAT_MASTER_RX)
+		s3c6410_i2c_sim_kick(sim, SIM_PH_RX);
+	else
+		s3c6410_i2c_sim_kick(sim, SIM_PH_TX);
+}
+
+static u32 s3c6410_i2c_sim_read(struct s3c6410_i2c_sim *sim, int reg)
+{
+	unsigned long flags;
+	u32 val = 0;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	switch (reg) {
+	case S3C2410_IICCON:
+		val = sim->con;
+		break;
+	case S3C2410_IICSTAT:
+		val = (sim->stat & ~S3C2410_IICSTAT_BUSBUSY) |
+			(sim->busy ? S3C2410_IICSTAT_BUSBUSY : 0);
+		break;
+	case S3C2410_IICADD:
+		val = sim->add;
+		break;
+	case S3C2410_IICDS:
+		val = sim->ds;
+		break;
+	default:
+		val = sim->lc;
+		break;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return val;
+}
+
+static void s3c6410_i2c_sim_write(struct s3c6410_i2c_sim *sim, int reg, u32 val)
+{
+	unsigned long flags;
+	u32 pend;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	switch (reg) {
+	case S3C2410_IICCON:
+		/* IRQPEND is cleared by writing 0, writing 1 changes nothing */
+		pend = sim->con & val & S3C2410_IICCON_IRQPEND;
+		val = (val & ~S3C2410_IICCON_IRQPEND) | pend;
+		if ((sim->con & S3C2410_IICCON_IRQPEND) && !pend) {
+			sim->con = val;
+			s3c6410_i2c_sim_release(sim);
+		} else {
+			sim->con = val;
+		}
+		break;
+
+	case S3C2410_IICSTAT:
+		sim->stat = (sim->stat & 0x0f) | (val & 0xf0);
+		if (val & S3C2410_IICSTAT_START) {
+			if (!sim->busy) {
+				sim->busy = 1;
+				s3c6410_i2c_sim_kick(sim, SIM_PH_ADDR);
+			} else {
+				sim->req = SIM_REQ_START;
+			}
+		} else if (sim->busy) {
+			sim->req = SIM_REQ_STOP;
+		}
+		break;
+
+	case S3C2410_IICADD:
+		sim->add = val;
+		break;
+	case S3C2410_IICDS:
+		sim->ds = val & 0xff;
+		break;
+	default:
+		sim->lc = val;
+		break;
+	}
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static void s3c6410_i2c_sim_init(struct s3c6410_i2c_sim *sim, irq_handler_t isr,
+		void *dev_id)
+{
+	memset(sim, 0, sizeof(*sim));
+	memset(sim->mem, 0xff, sizeof(sim->mem));	/* erased EEPROM */
+	spin_lock_init(&sim->lock);
+	hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim->timer.function = s3c6410_i2c_sim_timer;
+	sim->isr = isr;
+	sim->dev_id = dev_id;
+	sim->ready = ktime_get();
+}
+
+static void s3c6410_i2c_sim_exit(struct s3c6410_i2c_sim *sim)
+{
+	hrtimer_cancel(&sim->timer);
+}
+
+#endif /* _S3C6410_I2C_SIM_H */
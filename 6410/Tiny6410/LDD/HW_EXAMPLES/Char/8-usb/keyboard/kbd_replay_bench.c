@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>       /* gettimeofday */
+
+#include "tiny6410_usbkbd_engine.h"
+
+
+/*
+ * Replay benchmark for the key report engine: feeds recorded HID reports
+ * through tiny6410_usbkbd_engine.h, the same code the driver runs, and
+ * prints the cost per report. Boot reports are also fed through a copy
+ * of the old memscan() loop of tiny6410_usbkbd_irq() for comparison.
+ *
+ *  usage: kbd_replay_bench [boot|array|bitmap] [report file] [loops]
+ *
+ * The report file holds one report per line as hex bytes, "#" starts a
+ * comment. usbmon text lines work too, everything after the "=" is the
+ * report data. Without a file a typing pattern is generated.
+ */
+
+#define MAX_REPORTS         100000
+#define DEFAULT_LOOPS       200
+#define SYNTH_REPORTS       20000
+#define SYNTH_LEN           32      /* array/bitmap synthetic report size */
+
+struct report {
+    int len;
+    u8 data[KBD_MAX_REPORT];
+};
+
+static struct report reports[MAX_REPORTS];
+static int nr_reports;
+
+/* Every emitted event lands here so the compiler can't drop the work */
+static volatile unsigned long sink;
+static unsigned long calls;
+
+static void count_event(void *ctx, unsigned int usage, int down)
+{
+    (void)ctx;
+    sink += usage + down;
+    calls++;
+}
+
+static double now_sec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int hexval(int c)
+{
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+static int load_reports(const char *name)
+{
+    char line[1024], *p;
+    struct report *r;
+    FILE *fp;
+
+    fp = fopen(name, "r");
+    if (!fp) {
+        printf("[USER]Error: can't open %s\n", name);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) && nr_reports < MAX_REPORTS) {
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        p = strchr(line, '=');
+        p = p ? p + 1 : line;
+
+        r = &reports[nr_reports];
+        r->len = 0;
+        while (*p && r->len < KBD_MAX_REPORT) {
+            if (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1])) {
+                r->data[r->len++] = hexval(p[0]) << 4 | hexval(p[1]);
+                p += 2;
+            } else {
+                p++;
+            }
+        }
+        if (r->len)
+            nr_reports++;
+    }
+
+    fclose(fp);
+    return nr_reports ? 0 : -1;
+}
+
+/* Random typing: one or two keys change per report, shift now and then */
+static void synth_reports(int format, int bitmap_off)
+{
+    unsigned char down[KBD_USAGES];
+    int max_keys, nr_down = 0;
+    int i, j, u, slot;
+    struct report *r;
+
+    memset(down, 0, sizeof(down));
+    max_keys = format == KBD_FMT_BOOT ? 6 :
+               format == KBD_FMT_ARRAY ? SYNTH_LEN - 2 : 64;
+    srand(6410);
+
+    for (i = 0; i < SYNTH_REPORTS; i++) {
+        for (j = 0; j < 1 + (rand() & 1); j++) {
+            if (nr_down && (nr_down == max_keys || rand() & 1)) {
+                /* release the n-th key that is down */
+                slot = rand() % nr_down;
+                for (u = 0; !down[u] || slot--; u++)
+                    ;
+                down[u] = 0;
+                nr_down--;
+            } else {
+                u = KBD_USAGE_FIRST_KEY + rand() % (0x65 - KBD_USAGE_FIRST_KEY);
+                if (!down[u]) {
+                    down[u] = 1;
+                    nr_down++;
+                }
+            }
+        }
+
+        r = &reports[nr_reports++];
+        memset(r->data, 0, sizeof(r->data));
+        r->len = format == KBD_FMT_BOOT ? KBD_BOOT_REPORT : SYNTH_LEN;
+        r->data[0] = (i / 16) & 1 ? 0x02 : 0;      /* left shift */
+
+        slot = format == KBD_FMT_BITMAP ? 0 : 2;
+        for (u = 0; u < KBD_USAGES; u++) {
+            if (!down[u])
+                continue;
+            if (format == KBD_FMT_BITMAP)
+                r->data[bitmap_off + u / 8] |= 1 << (u % 8);
+            else
+                r->data[slot++] = u;
+        }
+    }
+}
+
+/* The pre-engine tiny6410_usbkbd_irq() body, boot reports only */
+static void legacy_report(u8 *old, const u8 *new)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        count_event(NULL, i + 224, (new[0] >> i) & 1);
+
+    for (i = 2; i < 8; i++) {
+        if (old[i] > 3 && memchr(new + 2, old[i], 6) == NULL)
+            count_event(NULL, old[i], 0);
+        if (new[i] > 3 && memchr(old + 2, new[i], 6) == NULL)
+            count_event(NULL, new[i], 1);
+    }
+
+    memcpy(old, new, 8);
+}
+
+static void print_result(const char *name, double elapsed, unsigned long n)
+{
+    printf("[USER]%-7s: %lu reports in %.3f s, %.1f ns/report, %.2f events/report\n",
+        name, n, elapsed, elapsed * 1e9 / n, (double)calls / n);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *formats[KBD_FMT_NR] = { "boot", "array", "bitmap" };
+    struct kbd_engine engine;
+    int format = KBD_FMT_BOOT, bitmap_off = 1;
+    int loops = DEFAULT_LOOPS;
+    int i, l;
+    double start;
+    u8 old[KBD_BOOT_REPORT];
+
+    if (argc > 1) {
+        for (format = 0; format < KBD_FMT_NR; format++)
+            if (!strcmp(argv[1], formats[format]))
+                break;
+    }
+    if (argc > 3)
+        loops = atoi(argv[3]);
+    if (format == KBD_FMT_NR || loops <= 0) {
+        printf("Usage: %s [boot|array|bitmap] [report file] [loops]\n", argv[0]);
+        return -1;
+    }
+
+    if (argc > 2 && strcmp(argv[2], "-")) {
+        if (load_reports(argv[2]))
+            return -1;
+    } else {
+        synth_reports(format, bitmap_off);
+    }
+
+    printf("[USER]%d %s reports, %d loops\n", nr_reports, formats[format], loops);
+
+    kbd_engine_init(&engine, format, bitmap_off);
+    calls = 0;
+    start = now_sec();
+    for (l = 0; l < loops; l++)
+        for (i = 0; i < nr_reports; i++)
+            kbd_engine_report(&engine, reports[i].data, reports[i].len,
+                              count_event, NULL);
+    print_result("engine", now_sec() - start, (unsigned long)loops * nr_reports);
+
+    if (engine.rollovers || engine.dropped)
+        printf("[USER]%lu rollover reports, %lu dropped\n",
+            engine.rollovers / loops, engine.dropped / loops);
+
+    if (format != KBD_FMT_BOOT)
+        return 0;
+
+    /* The old code reports all 8 modifiers every time, input core filters them */
+    memset(old, 0, sizeof(old));
+    calls = 0;
+    start = now_sec();
+    for (l = 0; l < loops; l++)
+        for (i = 0; i < nr_reports; i++)
+            if (reports[i].len >= KBD_BOOT_REPORT)
+                legacy_report(old, reports[i].data);
+    print_result("memscan", now_sec() - start, (unsigned long)loops * nr_reports);
+
+    return 0;
+}
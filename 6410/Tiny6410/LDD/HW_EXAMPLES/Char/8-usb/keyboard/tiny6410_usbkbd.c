@@ -7,6 +7,22 @@
 #include <linux/usb/input.h>
 #include <linux/hid.h>
 
+#include "tiny6410_usbkbd_engine.h"
+
+/*
+ * Report layout, see tiny6410_usbkbd_engine.h. The boot protocol is what
+ * every keyboard bound through the boot interface class sends; NKRO
+ * keyboards exposing an array or bitmap report on such an interface
+ * can be driven with report_format=1/2.
+ */
+static int report_format = KBD_FMT_BOOT;
+module_param(report_format, int, S_IRUGO);
+MODULE_PARM_DESC(report_format, "0 = boot (default), 1 = long array, 2 = NKRO bitmap");
+
+static int bitmap_offset = 1;
+module_param(bitmap_offset, int, S_IRUGO);
+MODULE_PARM_DESC(bitmap_offset, "report_format=2: byte where the usage bitmap starts");
+
 
 static const unsigned char tiny6410_usbkbd_keycode[256] = {
 	  0,  0,  0,  0, 30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38,
@@ -30,7 +46,7 @@ static const unsigned char tiny6410_usbkbd_keycode[256] = {
 struct tiny6410_usbkbd {
 	struct input_dev *dev;
 	struct usb_device *usbdev;
-	unsigned char old[8];
+	struct kbd_engine engine;
 	struct urb *irq;
 	unsigned char newleds;
 	unsigned char *new;
@@ -38,11 +54,21 @@ struct tiny6410_usbkbd {
 	dma_addr_t leds_dma;
 };
 
+static void tiny6410_usbkbd_event(void *ctx, unsigned int usage, int down)
+{
+	struct tiny6410_usbkbd *kbd = ctx;
+
+	if (tiny6410_usbkbd_keycode[usage])
+		input_report_key(kbd->dev, tiny6410_usbkbd_keycode[usage], down);
+	else
+		hid_info(kbd->usbdev, "Unknown key (scancode %#x) %s.\n",
+			 usage, down ? "pressed" : "released");
+}
+
 static void tiny6410_usbkbd_irq(struct urb *urb)
 {
 	struct tiny6410_usbkbd *kbd = urb->context;
 	int i;
-    //static int cnt = 0;
 
 	switch (urb->status) {
 	case 0:			/* success */
@@ -56,44 +82,10 @@ static void tiny6410_usbkbd_irq(struct urb *urb)
 		goto resubmit;
 	}
 
-#if 0
-    printk("cnt = %d: ", ++cnt);
-    for (i = 0; i < 8; ++i) {
-        printk("tiny6410_usbkbd_keycode[%d] = %c, %d, 0x%x\n", i+224, tiny6410_usbkbd_keycode[i + 224], tiny6410_usbkbd_keycode[i + 224], tiny6410_usbkbd_keycode[i + 224]);
-        //printk("%02x ", kbd->new[0]);
-    }
-    printk("\n");
-#endif
-
-	for (i = 0; i < 8; i++)
-		input_report_key(kbd->dev, tiny6410_usbkbd_keycode[i + 224], (kbd->new[0] >> i) & 1);
-
-	for (i = 2; i < 8; i++) {
-
-		if (kbd->old[i] > 3 && memscan(kbd->new + 2, kbd->old[i], 6) == kbd->new + 8) {
-            //printk("\nkbd->old[%d] = %c, %d, 0x%x\n", i, tiny6410_usbkbd_keycode[kbd->old[i]], tiny6410_usbkbd_keycode[kbd->old[i]], tiny6410_usbkbd_keycode[kbd->old[i]]);
-			if (tiny6410_usbkbd_keycode[kbd->old[i]])
-				input_report_key(kbd->dev, tiny6410_usbkbd_keycode[kbd->old[i]], 0);
-			else
-				hid_info(urb->dev,
-					 "Unknown key (scancode %#x) released.\n",
-					 kbd->old[i]);
-		}
-
-		if (kbd->new[i] > 3 && memscan(kbd->old + 2, kbd->new[i], 6) == kbd->old + 8) {
-            //printk("\nkbd->new[%d] = %c, %d, 0x%x\n", i, tiny6410_usbkbd_keycode[kbd->new[i]], tiny6410_usbkbd_keycode[kbd->new[i]], tiny6410_usbkbd_keycode[kbd->new[i]]);
-			if (tiny6410_usbkbd_keycode[kbd->new[i]])
-				input_report_key(kbd->dev, tiny6410_usbkbd_keycode[kbd->new[i]], 1);
-			else
-				hid_info(urb->dev,
-					 "Unknown key (scancode %#x) released.\n",
-					 kbd->new[i]);
-		}
-	}
-
-	input_sync(kbd->dev);
-
-	memcpy(kbd->old, kbd->new, 8);
+	/* Only a report that changed something ends up as an input frame */
+	if (kbd_engine_report(&kbd->engine, kbd->new, urb->actual_length,
+			      tiny6410_usbkbd_event, kbd) > 0)
+		input_sync(kbd->dev);
 
 resubmit:
 	i = usb_submit_urb (urb, GFP_ATOMIC);
@@ -109,7 +101,7 @@ static int tiny6410_usbkbd_probe(struct usb_interface *iface,
 	struct usb_endpoint_descriptor *endpoint;
 	struct tiny6410_usbkbd *kbd;
 	struct input_dev *input_dev;
-	int i, pipe, maxp;
+	int i, pipe, maxp, len;
 	int error = -ENOMEM;
 
 	interface = iface->cur_altsetting;
@@ -132,12 +124,25 @@ static int tiny6410_usbkbd_probe(struct usb_interface *iface,
 	if (!(kbd->irq = usb_alloc_urb(0, GFP_KERNEL)))
 		goto fail2;
 
-    if (!(kbd->new = usb_alloc_coherent(dev, 8, GFP_ATOMIC, &kbd->new_dma)))
-		goto fail3;
+	if (!(kbd->new = usb_alloc_coherent(dev, KBD_MAX_REPORT, GFP_KERNEL, &kbd->new_dma)))
+		goto fail2;
 
 	kbd->usbdev = dev;
 	kbd->dev = input_dev;
 
+	if (report_format < 0 || report_format >= KBD_FMT_NR ||
+	    bitmap_offset < 1 || bitmap_offset >= KBD_MAX_REPORT) {
+		printk("[DRIVER]Error: bad report_format/bitmap_offset, using boot reports\n");
+		kbd_engine_init(&kbd->engine, KBD_FMT_BOOT, 1);
+	} else {
+		kbd_engine_init(&kbd->engine, report_format, bitmap_offset);
+	}
+
+	/* Boot reports are 8 bytes, the longer formats take the whole packet */
+	len = kbd->engine.format == KBD_FMT_BOOT ? KBD_BOOT_REPORT : KBD_MAX_REPORT;
+	if (maxp < len)
+		len = maxp;
+
 	input_set_drvdata(input_dev, kbd);
 
 	input_dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_LED) |
@@ -151,26 +156,32 @@ static int tiny6410_usbkbd_probe(struct usb_interface *iface,
 	clear_bit(0, input_dev->keybit);
 
 	usb_fill_int_urb(kbd->irq, dev, pipe,
-			 kbd->new, (maxp > 8 ? 8 : maxp),
+			 kbd->new, len,
 			 tiny6410_usbkbd_irq, kbd, endpoint->bInterval);
 	kbd->irq->transfer_dma = kbd->new_dma;
 	kbd->irq->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
 	error = input_register_device(kbd->dev);
 	if (error)
-		goto fail2;
+		goto fail3;
 
 	usb_set_intfdata(iface, kbd);
 
-    usb_submit_urb(kbd->irq, GFP_KERNEL);
-    
+	error = usb_submit_urb(kbd->irq, GFP_KERNEL);
+	if (error) {
+		usb_set_intfdata(iface, NULL);
+		input_unregister_device(kbd->dev);
+		input_dev = NULL;
+		goto fail3;
+	}
+
 	return 0;
 
-fail3:    
-	usb_free_coherent(dev, 8, kbd->new, kbd->new_dma);
-fail2:	    
+fail3:
+	usb_free_coherent(dev, KBD_MAX_REPORT, kbd->new, kbd->new_dma);
+fail2:
 	usb_free_urb(kbd->irq);
-fail1:	
+fail1:
 	input_free_device(input_dev);
 	kfree(kbd);
 	return error;
@@ -183,9 +194,12 @@ static void tiny6410_usbkbd_disconnect(struct usb_interface *intf)
 	usb_set_intfdata(intf, NULL);
 	if (kbd) {
 		usb_kill_urb(kbd->irq);
+		dev_info(&intf->dev, "%lu reports, %lu key events, %lu rollovers, %lu dropped\n",
+			 kbd->engine.reports, kbd->engine.events,
+			 kbd->engine.rollovers, kbd->engine.dropped);
 		input_unregister_device(kbd->dev);
-        usb_free_coherent(kbd->usbdev, 8, kbd->new, kbd->new_dma);
-        usb_free_urb(kbd->irq);
+		usb_free_coherent(kbd->usbdev, KBD_MAX_REPORT, kbd->new, kbd->new_dma);
+		usb_free_urb(kbd->irq);
 		kfree(kbd);
 	}
 }
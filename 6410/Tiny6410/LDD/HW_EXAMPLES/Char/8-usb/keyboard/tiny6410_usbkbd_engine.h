@@ -0,0 +1,175 @@
+#ifndef _TINY6410_USBKBD_ENGINE_H
+#define _TINY6410_USBKBD_ENGINE_H
+
+/*
+ * Key report engine, shared by tiny6410_usbkbd.c and the userspace
+ * replay benchmark kbd_replay_bench.c.
+ *
+ * Every report is turned into a 256 bit map indexed by HID usage, the
+ * modifier byte landing on usages 0xe0-0xe7. The key events are the set
+ * bits of old ^ new, found one word at a time with __ffs(), so a report
+ * costs a few word operations instead of the 2 x 6 x 6 byte compares of
+ * the memscan() version.
+ *
+ * Report formats:
+ *   KBD_FMT_BOOT    boot protocol, mod, reserved, 6 usages
+ *   KBD_FMT_ARRAY   same layout, as many usage bytes as the report holds
+ *   KBD_FMT_BITMAP  NKRO, mod byte then one bit per usage starting at
+ *                   byte bitmap_off (usage 0 = bit 0 of that byte)
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#else
+#include <string.h>
+#include <limits.h>
+typedef unsigned char u8;
+#define BITS_PER_LONG       (CHAR_BIT * sizeof(long))
+#define __ffs(x)            __builtin_ctzl(x)
+#endif
+
+#define KBD_USAGES          256
+#define KBD_WORDS           ((int)(KBD_USAGES / BITS_PER_LONG))
+#define KBD_MAX_REPORT      64      /* largest report the URB buffer holds */
+#define KBD_BOOT_REPORT     8
+
+#define KBD_USAGE_ROLLOVER  0x01    /* ErrorRollOver: too many keys down */
+#define KBD_USAGE_FIRST_KEY 0x04    /* 0x00-0x03 are no-event/error codes */
+#define KBD_USAGE_LCTRL     0xe0    /* first modifier usage */
+
+/* The modifier byte never straddles a word: 0xe0 is a multiple of 32 */
+#define KBD_MOD_WORD        (KBD_USAGE_LCTRL / BITS_PER_LONG)
+#define KBD_MOD_SHIFT       (KBD_USAGE_LCTRL % BITS_PER_LONG)
+#define KBD_MOD_MASK        (0xffUL << KBD_MOD_SHIFT)
+
+enum {
+	KBD_FMT_BOOT,
+	KBD_FMT_ARRAY,
+	KBD_FMT_BITMAP,
+	KBD_FMT_NR,
+};
+
+struct kbd_engine {
+	int format;
+	int bitmap_off;                 /* KBD_FMT_BITMAP only, >= 1 */
+	unsigned long keys[KBD_WORDS];  /* usages currently down */
+
+	unsigned long reports;
+	unsigned long events;
+	unsigned long rollovers;
+	unsigned long dropped;          /* too short to hold a modifier byte */
+};
+
+typedef void (*kbd_emit_t)(void *ctx, unsigned int usage, int down);
+
+static inline void kbd_engine_init(struct kbd_engine *e, int format,
+				   int bitmap_off)
+{
+	memset(e, 0, sizeof(*e));
+	e->format = format;
+	e->bitmap_off = bitmap_off;
+}
+
+/* Build the pressed-usage map of one report, 0 or -1 for a dropped report */
+static inline int kbd_engine_parse(struct kbd_engine *e, const u8 *rep,
+				   int len, unsigned long *map)
+{
+	unsigned int base;
+	int i, n;
+
+	if (len < 1)
+		return -1;
+
+	memset(map, 0, sizeof(e->keys));
+
+	switch (e->format) {
+	case KBD_FMT_BOOT:
+	case KBD_FMT_ARRAY:
+		n = e->format == KBD_FMT_BOOT && len > KBD_BOOT_REPORT ?
+			KBD_BOOT_REPORT : len;
+
+		/*
+		 * Phantom state: every slot says ErrorRollOver. The keys are
+		 * unknown, keep the ones we had and only take the modifiers.
+		 */
+		if (n > 2 && rep[2] == KBD_USAGE_ROLLOVER) {
+			memcpy(map, e->keys, sizeof(e->keys));
+			map[KBD_MOD_WORD] &= ~KBD_MOD_MASK;
+			e->rollovers++;
+			break;
+		}
+
+		for (i = 2; i < n; i++)
+			if (rep[i] >= KBD_USAGE_FIRST_KEY)
+				map[rep[i] / BITS_PER_LONG] |=
+					1UL << (rep[i] % BITS_PER_LONG);
+		break;
+
+	case KBD_FMT_BITMAP:
+		for (i = e->bitmap_off; i < len; i++) {
+			base = (i - e->bitmap_off) * 8;
+			if (base >= KBD_USAGES)
+				break;
+			map[base / BITS_PER_LONG] |=
+				(unsigned long)rep[i] << (base % BITS_PER_LONG);
+		}
+		map[0] &= ~((1UL << KBD_USAGE_FIRST_KEY) - 1);
+		map[KBD_MOD_WORD] &= ~KBD_MOD_MASK;
+		break;
+	}
+
+	map[KBD_MOD_WORD] |= (unsigned long)rep[0] << KBD_MOD_SHIFT;
+	return 0;
+}
+
+static inline void kbd_engine_emit_word(struct kbd_engine *e, int w,
+					unsigned long chg, const unsigned long *map,
+					kbd_emit_t emit, void *ctx)
+{
+	unsigned int bit;
+
+	while (chg) {
+		bit = __ffs(chg);
+		chg &= chg - 1;
+		emit(ctx, w * BITS_PER_LONG + bit, (map[w] >> bit) & 1);
+		e->events++;
+	}
+}
+
+/*
+ * Feed one report, calling emit() once per usage that changed state.
+ * Modifiers go first so that "shift + a" in a single report is seen as
+ * a shifted key. Returns the number of events, -1 for a dropped report.
+ */
+static inline int kbd_engine_report(struct kbd_engine *e, const u8 *rep,
+				    int len, kbd_emit_t emit, void *ctx)
+{
+	unsigned long map[KBD_WORDS];
+	unsigned long events = e->events;
+	int w;
+
+	if (kbd_engine_parse(e, rep, len, map)) {
+		e->dropped++;
+		return -1;
+	}
+	e->reports++;
+
+	kbd_engine_emit_word(e, KBD_MOD_WORD,
+			     (e->keys[KBD_MOD_WORD] ^ map[KBD_MOD_WORD]) & KBD_MOD_MASK,
+			     map, emit, ctx);
+
+	for (w = 0; w < KBD_WORDS; w++) {
+		unsigned long chg = e->keys[w] ^ map[w];
+
+		if (w == KBD_MOD_WORD)
+			chg &= ~KBD_MOD_MASK;
+		kbd_engine_emit_word(e, w, chg, map, emit, ctx);
+		e->keys[w] = map[w];
+	}
+
+	return e->events - events;
+}
+
+#endif /* _TINY6410_USBKBD_ENGINE_H */
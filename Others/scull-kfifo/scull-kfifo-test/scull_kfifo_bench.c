@@ -0,0 +1,169 @@
+
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>	/* shared counters */
+#include <sys/time.h>	/* gettimeofday */
+#include <sys/wait.h>	/* wait */
+#include <sys/ioctl.h>
+#include <sched.h>	/* sched_yield */
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#define SCULL_KFIFO_MAGIC  'k'
+/* Please use a different 8-bit number in your code */
+
+#define SCULL_KFIFO_SIZE  _IO(SCULL_KFIFO_MAGIC,   0)
+#define SCULL_KFIFO_RESET _IO(SCULL_KFIFO_MAGIC,   1)
+
+#define BENCH_REC	64		/* bytes per write(), the driver's BUFSIZE */
+#define BENCH_BYTES	(1024 * 1024)	/* written by every writer */
+#define MAX_READERS	64
+
+/*
+ * Contention benchmark: N writer and M reader processes share
+ * /dev/scull_kfifo. Load the module with scull_kfifo_split=0 and with
+ * scull_kfifo_split=1 and compare the aggregate throughput.
+ *
+ *	usage: scull_kfifo_bench [writers] [readers]
+ */
+
+/* Every reader only updates its own slot, so no atomic operations are needed */
+struct counters {
+	volatile long read_by[MAX_READERS];
+	int readers;
+	long total;
+};
+
+static long total_read(struct counters *cnt)
+{
+	long sum = 0;
+	int i;
+
+	for (i = 0; i < cnt->readers; i++)
+		sum += cnt->read_by[i];
+	return sum;
+}
+
+static double now_sec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int writer(void)
+{
+	char rec[BENCH_REC];
+	long done = 0;
+	ssize_t len;
+	int fd;
+
+	if ((fd = open("/dev/scull_kfifo", O_WRONLY)) < 0)
+		return 1;
+
+	while (done < BENCH_BYTES) {
+		len = write(fd, rec, BENCH_REC);
+		if (len < 0 && errno != EAGAIN)
+			return 1;
+		if (len <= 0) {		/* fifo full, the driver does not block */
+			sched_yield();
+			continue;
+		}
+		done += len;
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int reader(struct counters *cnt, int id)
+{
+	char rec[BENCH_REC];
+	ssize_t len;
+	int fd;
+
+	if ((fd = open("/dev/scull_kfifo", O_RDONLY | O_NONBLOCK)) < 0)
+		return 1;
+
+	while (total_read(cnt) < cnt->total) {
+		len = read(fd, rec, BENCH_REC);
+		if (len < 0 && errno != EAGAIN)
+			return 1;
+		if (len <= 0) {
+			sched_yield();
+			continue;
+		}
+		cnt->read_by[id] += len;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct counters *cnt;
+	int writers = 1, readers = 1;
+	int i, fd, status, failed = 0;
+	double start, elapsed;
+	pid_t pid;
+
+	if (argc > 1)
+		writers = atoi(argv[1]);
+	if (argc > 2)
+		readers = atoi(argv[2]);
+	if (writers <= 0 || readers <= 0 || readers > MAX_READERS) {
+		printf("usage: %s [writers] [readers]\n", argv[0]);
+		exit(1);
+	}
+
+	if ((fd = open("/dev/scull_kfifo", O_RDWR)) < 0) {
+		printf("cannot open scull_kfifo!\n");
+		exit(1);
+	}
+	ioctl(fd, SCULL_KFIFO_RESET, NULL);
+	close(fd);
+
+	cnt = mmap(NULL, sizeof(*cnt), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (cnt == MAP_FAILED) {
+		printf("scull_kfifo_bench: mmap failed\n");
+		exit(1);
+	}
+	memset(cnt, 0, sizeof(*cnt));
+	cnt->readers = readers;
+	cnt->total = (long)writers * BENCH_BYTES;
+
+	start = now_sec();
+
+	for (i = 0; i < writers + readers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			printf("scull_kfifo_bench: fork failed\n");
+			exit(1);
+		}
+		if (pid == 0)
+			exit(i < writers ? writer() : reader(cnt, i - writers));
+	}
+
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+
+	elapsed = now_sec() - start;
+
+	if (failed)
+		printf("scull_kfifo_bench: %d workers failed\n", failed);
+
+	printf("scull_kfifo_bench: %d writers, %d readers, %ld bytes in %.3f s, %.2f MB/s\n",
+		writers, readers, total_read(cnt), elapsed,
+		total_read(cnt) / elapsed / (1024 * 1024));
+
+	exit(failed ? 1 : 0);
+}
@@ -3,6 +3,10 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>	/* readv/writev */
+#include <sys/time.h>	/* gettimeofday */
+#include <sys/ioctl.h>
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
 #define SCULL_KFIFO_MAGIC  'k'
 /* Please use a different 8-bit number in your code */
@@ -10,6 +14,81 @@
 #define SCULL_KFIFO_SIZE  _IO(SCULL_KFIFO_MAGIC,   0)
 #define SCULL_KFIFO_RESET _IO(SCULL_KFIFO_MAGIC,   1)
 
+#define BENCH_BYTES	(4 * 1024 * 1024)	/* moved per run */
+#define BENCH_REC	64			/* bytes per record, the old BUFSIZE */
+#define BENCH_NREC	64			/* records per readv/writev */
+
+static double now_sec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench_report(const char *name, double start, long syscalls)
+{
+	double elapsed = now_sec() - start;
+	double mb = BENCH_BYTES / (1024.0 * 1024.0);
+
+	printf("scull_kfifo: %-14s %8.2f MB/s, %8.0f syscalls/MB\n",
+		name, mb / elapsed, syscalls / mb);
+}
+
+/*
+ * Push BENCH_BYTES through the device in the same process, once with
+ * write()/read() of one record each and once with writev()/readv() of
+ * BENCH_NREC records each.
+ */
+static void bench(int fd)
+{
+	static char data[BENCH_NREC][BENCH_REC];
+	struct iovec iov[BENCH_NREC];
+	long done, syscalls;
+	ssize_t len, got;
+	double start;
+	int i;
+
+	memset(data, 0x5a, sizeof(data));
+	for (i = 0; i < BENCH_NREC; i++) {
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = BENCH_REC;
+	}
+
+	ioctl(fd, SCULL_KFIFO_RESET, NULL);
+
+	start = now_sec();
+	for (done = 0, syscalls = 0; done < BENCH_BYTES; done += len) {
+		len = write(fd, data[0], BENCH_REC);
+		if (len <= 0 || read(fd, data[0], len) != len) {
+			printf("scull_kfifo: write/read bench failed\n");
+			return;
+		}
+		syscalls += 2;
+	}
+	bench_report("write/read", start, syscalls);
+
+	start = now_sec();
+	for (done = 0, syscalls = 0; done < BENCH_BYTES; done += len) {
+		len = writev(fd, iov, BENCH_NREC);
+		if (len <= 0) {
+			printf("scull_kfifo: writev bench failed\n");
+			return;
+		}
+		syscalls++;
+
+		/* Drain what went in, the fifo may have taken a partial batch */
+		for (got = 0; got < len; got += i, syscalls++) {
+			i = readv(fd, iov, BENCH_NREC);
+			if (i <= 0) {
+				printf("scull_kfifo: readv bench failed\n");
+				return;
+			}
+		}
+	}
+	bench_report("writev/readv", start, syscalls);
+}
+
 int main()
 {
 	int sculltest;
@@ -39,11 +118,14 @@ int main()
 		else   printf("scull_kfifo: SCULL_KFIFO_RESET ok! code=%d \n",code);
 		break;
 #endif
+	case '3':
+		bench(sculltest);
+		break;
 	case 'q':
 		break;
 
 	 default:  /* redundant, as cmd was checked against MAXNR */
-		printf("scull_kfifo:  Invalid input ! only 1、2、q !\n");
+		printf("scull_kfifo:  Invalid input ! only 1、2、3、q !\n");
 	}
 }	
 	close(sculltest);
@@ -10,6 +10,9 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/cdev.h>
 #include <linux/kfifo.h>
+#include <linux/sched.h>	/* current, wait_event_interruptible() */
+#include <linux/uio.h>		/* struct iovec */
+#include <linux/aio.h>		/* struct kiocb */
 
 #include <asm/system.h>		/* cli(), *_flags */
 #include <asm/uaccess.h>	/* copy_*_user */
@@ -20,13 +23,16 @@
  */
 int scull_kfifo_major =   0;
 int scull_kfifo_minor =   0;
+int scull_kfifo_size = SCULL_KFIFO_DEFSIZE;	/* rounded up to a power of 2 */
+int scull_kfifo_split = 1;	/* split reader/writer locking */
 
 
 module_param(scull_kfifo_major, int, S_IRUGO);
 module_param(scull_kfifo_minor, int, S_IRUGO);
+module_param(scull_kfifo_size, int, S_IRUGO);
+module_param(scull_kfifo_split, int, S_IRUGO);
 
 struct scull_kfifo *scull_kfifo_devices;	/* allocated in scull_kfifo_init_module */
-unsigned char *tekkamanbuffer;
 unsigned char *tekkaman;
 
 /*
@@ -48,6 +54,80 @@ int scull_kfifo_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+/*
+ * Locking. By default every method serializes on dev->sem. In split mode
+ * readers only serialize on dev->rsem and writers only on dev->wsem: the
+ * kfifo is safe for one reader and one writer running at the same time
+ * (__kfifo_get()/__kfifo_put() order the data against in/out with
+ * barriers), so a reader never waits for a writer or the other way round.
+ */
+static inline struct semaphore *scull_kfifo_rlock(struct scull_kfifo *dev)
+{
+	return scull_kfifo_split ? &dev->rsem : &dev->sem;
+}
+
+static inline struct semaphore *scull_kfifo_wlock(struct scull_kfifo *dev)
+{
+	return scull_kfifo_split ? &dev->wsem : &dev->sem;
+}
+
+/*
+ * Split mode read/write: the user copy goes through a bounce buffer on the
+ * stack and happens outside the lock, only the kfifo access is locked.
+ * The buffer is per call: threads sharing one file, or a reader and a
+ * writer on an O_RDWR file, must not see each other's bytes.
+ */
+static ssize_t scull_kfifo_split_read(struct file *filp, char __user *buf,
+                size_t count)
+{
+	struct scull_kfifo *dev = filp->private_data;
+	unsigned char scratch[BUFSIZE];
+
+	if (down_interruptible(&dev->rsem))
+		return -ERESTARTSYS;
+
+	while (!__kfifo_len(dev->tekkamankfifo)) { /* nothing to read */
+		up(&dev->rsem);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->inq, __kfifo_len(dev->tekkamankfifo)))
+			return -ERESTARTSYS;
+		if (down_interruptible(&dev->rsem))
+			return -ERESTARTSYS;
+	}
+
+	if (count > BUFSIZE)
+		count = BUFSIZE;
+	count = __kfifo_get(dev->tekkamankfifo, scratch, count);
+
+	up(&dev->rsem);
+	wake_up_interruptible(&dev->outq);
+
+	if (copy_to_user(buf, scratch, count))
+		return -EFAULT;
+	return count;
+}
+
+static ssize_t scull_kfifo_split_write(struct file *filp, const char __user *buf,
+                size_t count)
+{
+	struct scull_kfifo *dev = filp->private_data;
+	unsigned char scratch[BUFSIZE];
+
+	if (count > BUFSIZE)
+		count = BUFSIZE;
+	if (copy_from_user(scratch, buf, count))
+		return -EFAULT;
+
+	if (down_interruptible(&dev->wsem))
+		return -ERESTARTSYS;
+	count = __kfifo_put(dev->tekkamankfifo, scratch, count);
+	up(&dev->wsem);
+
+	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	return count;
+}
+
 /*
  * Data management: read and write
  */
@@ -55,9 +135,11 @@ int scull_kfifo_release(struct inode *inode, struct file *filp)
 ssize_t scull_kfifo_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-	struct scull_kfifo *dev = filp->private_data; 
+	struct scull_kfifo *dev = filp->private_data;
 	ssize_t retval = 0;
 
+	if (scull_kfifo_split)
+		return scull_kfifo_split_read(filp, buf, count);
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
@@ -76,6 +158,8 @@ ssize_t scull_kfifo_read(struct file *filp, char __user *buf, size_t count,
 
 	if (count > kfifo_len(dev->tekkamankfifo))
 		count = kfifo_len(dev->tekkamankfifo);
+	if (count > BUFSIZE)	/* the fifo can be larger than tekkaman */
+		count = BUFSIZE;
 	count = kfifo_get(dev->tekkamankfifo,tekkaman, count);
 
 	if (copy_to_user(buf, tekkaman, count)) {
@@ -97,6 +181,9 @@ ssize_t scull_kfifo_write(struct file *filp, const char __user *buf, size_t coun
 	struct scull_kfifo *dev = filp->private_data;
 	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
 
+	if (scull_kfifo_split)
+		return scull_kfifo_split_write(filp, buf, count);
+
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 	
@@ -115,6 +202,144 @@ ssize_t scull_kfifo_write(struct file *filp, const char __user *buf, size_t coun
 	return retval;
 }
 
+/*
+ * Vectored I/O: readv()/writev() reach the driver through aio_read and
+ * aio_write, and every segment is copied straight between user memory and
+ * the kfifo ring, without the tekkaman bounce buffer and without the
+ * BUFSIZE clamp. in/out are free running, so the slot of an index is
+ * (index & (size - 1)) and a transfer is at most two chunks. Called with
+ * the reader (or writer) side lock held, see scull_kfifo_rlock().
+ */
+static ssize_t scull_kfifo_copy_to_user(struct kfifo *fifo, char __user *buf,
+                size_t len)
+{
+	unsigned int off, l;
+
+	len = min(len, (size_t)__kfifo_len(fifo));
+
+	/* Read the data only after we have seen fifo->in move past it */
+	smp_rmb();
+
+	off = fifo->out & (fifo->size - 1);
+	l = min(len, (size_t)(fifo->size - off));
+	if (copy_to_user(buf, fifo->buffer + off, l) ||
+	    copy_to_user(buf + l, fifo->buffer, len - l))
+		return -EFAULT;
+
+	/* Done with the slots before handing them back to the writer */
+	smp_mb();
+	fifo->out += len;
+
+	return len;
+}
+
+static ssize_t scull_kfifo_copy_from_user(struct kfifo *fifo,
+                const char __user *buf, size_t len)
+{
+	unsigned int off, l;
+
+	len = min(len, (size_t)(fifo->size - __kfifo_len(fifo)));
+
+	/* Do not overwrite slots before the reader is done with them */
+	smp_mb();
+
+	off = fifo->in & (fifo->size - 1);
+	l = min(len, (size_t)(fifo->size - off));
+	if (copy_from_user(fifo->buffer + off, buf, l) ||
+	    copy_from_user(fifo->buffer, buf + l, len - l))
+		return -EFAULT;
+
+	/* Publish the data before the new fifo->in */
+	smp_wmb();
+	fifo->in += len;
+
+	return len;
+}
+
+ssize_t scull_kfifo_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                unsigned long nr_segs, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_kfifo *dev = filp->private_data;
+	struct semaphore *sem = scull_kfifo_rlock(dev);
+	ssize_t retval = 0, count;
+	unsigned long seg;
+
+	if (down_interruptible(sem))
+		return -ERESTARTSYS;
+
+	while (!__kfifo_len(dev->tekkamankfifo)) { /* nothing to read */
+		up(sem); /* release the lock */
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->inq, __kfifo_len(dev->tekkamankfifo)))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		/* otherwise loop, but first reacquire the lock */
+		if (down_interruptible(sem))
+			return -ERESTARTSYS;
+	}
+
+	/* One record per segment, stop at the first one the fifo can't fill */
+	for (seg = 0; seg < nr_segs; seg++) {
+		count = scull_kfifo_copy_to_user(dev->tekkamankfifo,
+				iov[seg].iov_base, iov[seg].iov_len);
+		if (count < 0) {
+			if (!retval)
+				retval = count;
+			break;
+		}
+		retval += count;
+		if (count < iov[seg].iov_len)
+			break;
+	}
+
+	up(sem);
+	wake_up_interruptible(&dev->outq);
+	return retval;
+}
+
+ssize_t scull_kfifo_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                unsigned long nr_segs, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_kfifo *dev = filp->private_data;
+	struct semaphore *sem = scull_kfifo_wlock(dev);
+	struct kfifo *fifo = dev->tekkamankfifo;
+	ssize_t retval = 0, count;
+	unsigned long seg;
+
+	if (down_interruptible(sem))
+		return -ERESTARTSYS;
+
+	while (__kfifo_len(fifo) == fifo->size) { /* full */
+		up(sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->outq, __kfifo_len(fifo) != fifo->size))
+			return -ERESTARTSYS;
+		if (down_interruptible(sem))
+			return -ERESTARTSYS;
+	}
+
+	/* As many whole segments as fit, then a partial one, like a pipe */
+	for (seg = 0; seg < nr_segs; seg++) {
+		count = scull_kfifo_copy_from_user(fifo,
+				iov[seg].iov_base, iov[seg].iov_len);
+		if (count < 0) {
+			if (!retval)
+				retval = count;
+			break;
+		}
+		retval += count;
+		if (count < iov[seg].iov_len)
+			break;
+	}
+
+	up(sem);
+	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	return retval;
+}
+
 int scull_kfifo_ioctl(struct inode *inode, struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
@@ -138,7 +363,20 @@ int scull_kfifo_ioctl(struct inode *inode, struct file *filp,
 		break;
 
 	  case SCULL_KFIFO_RESET:
+		if (!scull_kfifo_split) {
+			kfifo_reset(scull_kfifo_devices->tekkamankfifo);
+			break;
+		}
+		/* in and out both move, keep readers and writers out */
+		if (down_interruptible(&scull_kfifo_devices->rsem))
+			return -ERESTARTSYS;
+		if (down_interruptible(&scull_kfifo_devices->wsem)) {
+			up(&scull_kfifo_devices->rsem);
+			return -ERESTARTSYS;
+		}
 		kfifo_reset(scull_kfifo_devices->tekkamankfifo);
+		up(&scull_kfifo_devices->wsem);
+		up(&scull_kfifo_devices->rsem);
 		break;
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -152,6 +390,8 @@ struct file_operations scull_kfifo_fops = {
 	.owner =    THIS_MODULE,
 	.read =     scull_kfifo_read,
 	.write =    scull_kfifo_write,
+	.aio_read =	scull_kfifo_aio_read,
+	.aio_write =	scull_kfifo_aio_write,
 	.open =     scull_kfifo_open,
 	.release =  scull_kfifo_release,
 	.llseek =		no_llseek,
@@ -172,20 +412,15 @@ struct file_operations scull_kfifo_fops = {
 void scull_kfifo_cleanup_module(void)
 {
 	dev_t devno = MKDEV(scull_kfifo_major, scull_kfifo_minor);
-	int keke = 0xff;
 
 	/* Get rid of our char dev entries */
 	if (scull_kfifo_devices) {
-		if (scull_kfifo_devices->tekkamankfifo) 	{		kfifo_free(scull_kfifo_devices->tekkamankfifo);
-		//kfree(scull_kfifo_devices->tekkamankfifo);
-		keke = 0;
-		}
+		/* kfifo_free() releases the ring buffer as well */
+		if (scull_kfifo_devices->tekkamankfifo)
+			kfifo_free(scull_kfifo_devices->tekkamankfifo);
 		cdev_del(&scull_kfifo_devices->cdev);
 		kfree(scull_kfifo_devices);
 	}
-#if 1
-	if (tekkamanbuffer && keke) kfree(tekkamanbuffer);
-#endif
 	if (tekkaman) 	kfree(tekkaman);
 	/* cleanup_module is never called if registering failed */
 	unregister_chrdev_region(devno, 1);
@@ -241,11 +476,9 @@ int scull_kfifo_init_module(void)
 	}
 	memset(scull_kfifo_devices, 0, sizeof(struct scull_kfifo));
 
-	tekkamanbuffer = kmalloc( BUFSIZE, GFP_KERNEL);
-	if (!tekkamanbuffer) {
-		result = -ENOMEM;
-		goto fail;  /* Make this more graceful */
-	}
+	if (scull_kfifo_size < BUFSIZE)
+		scull_kfifo_size = BUFSIZE;
+
 	tekkaman = kmalloc( BUFSIZE, GFP_KERNEL);
 	if (!tekkaman) {
 		result = -ENOMEM;
@@ -254,8 +487,15 @@ int scull_kfifo_init_module(void)
 
         /* Initialize each device. */
 	init_MUTEX(&scull_kfifo_devices->sem);
+	init_MUTEX(&scull_kfifo_devices->rsem);
+	init_MUTEX(&scull_kfifo_devices->wsem);
 	spin_lock_init (&scull_kfifo_devices->lock);
-	scull_kfifo_devices->tekkamankfifo = kfifo_init(tekkamanbuffer,  BUFSIZE ,GFP_KERNEL, &scull_kfifo_devices->lock);
+	scull_kfifo_devices->tekkamankfifo = kfifo_alloc(scull_kfifo_size, GFP_KERNEL, &scull_kfifo_devices->lock);
+	if (IS_ERR(scull_kfifo_devices->tekkamankfifo)) {
+		result = PTR_ERR(scull_kfifo_devices->tekkamankfifo);
+		scull_kfifo_devices->tekkamankfifo = NULL;
+		goto fail;
+	}
 		init_waitqueue_head(&scull_kfifo_devices->inq);
 		init_waitqueue_head(&scull_kfifo_devices->outq);	
 	scull_kfifo_setup_cdev(scull_kfifo_devices);
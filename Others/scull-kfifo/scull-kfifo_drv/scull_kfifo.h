@@ -23,6 +23,8 @@
 struct scull_kfifo {
 //	unsigned int access_key;  /* used by sculluid and scullpriv */
 	struct semaphore sem;     /* mutual exclusion semaphore     */
+	struct semaphore rsem;    /* split mode: reader side only   */
+	struct semaphore wsem;    /* split mode: writer side only   */
 	struct cdev cdev;	  /* Char device structure		*/
 	spinlock_t lock;
 	struct kfifo *tekkamankfifo;
@@ -32,6 +34,7 @@ struct scull_kfifo {
 };
 
 #define  BUFSIZE		64
+#define  SCULL_KFIFO_DEFSIZE	16384	/* default kfifo size, scull_kfifo_size */
 
 /*
  * Split minors in two parts
@@ -55,6 +58,10 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                     loff_t *f_pos);
+ssize_t scull_kfifo_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                unsigned long nr_segs, loff_t pos);
+ssize_t scull_kfifo_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                unsigned long nr_segs, loff_t pos);
 /*
  * Ioctl definitions
  */